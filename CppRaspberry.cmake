@@ -25,6 +25,17 @@ set(CPP_RASPBERRY_SOURCES "")
 #    ${CMAKE_CURRENT_LIST_DIR}/src/raspberry-pi.cpp)
 set(CPP_RASPBERRY_LIBS "")
 
+# The lowest log level that is compiled in, from 0 (Trace) to 5 (Off). Release builds default to 2 (Info).
+if(DEFINED CPP_RASPBERRY_LOG_LEVEL)
+    add_compile_definitions(CPP_RASPBERRY_LOG_LEVEL=${CPP_RASPBERRY_LOG_LEVEL})
+endif()
+
+# Record trace events in a ring buffer, see include/util/trace.hpp.
+if(HAVE_TRACE)
+    message(STATUS "Tracing is enabled")
+    add_compile_definitions(HAVE_TRACE)
+endif(HAVE_TRACE)
+
 # The target platform is set with a "TARGET_XYZ" variable.
 if(TARGET_PICO)
     include(${CMAKE_CURRENT_LIST_DIR}/platforms/pico/pico.cmake)
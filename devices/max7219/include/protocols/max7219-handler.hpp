@@ -15,21 +15,28 @@
  * limitations under the License.
  */
 
-#include <vector>
+#include <span>
 
 
 #include <protocols/protocol-driver.hpp>
+#include <protocols/dispatch-table.hpp>
 #include <protocols/max7219-messages.hpp>
 #include <devices/local-max7219.hpp>
 
 
 namespace nl::rakis::raspberrypi::protocols {
 
+/**
+ * @brief Apply received MAX7219 messages to a local MAX7219 chain.
+ *
+ * @tparam MaxImpl The (local) MAX7219 implementation, e.g. a LocalMAX7219<PicoSPI>.
+ */
+template <class MaxImpl>
 class MAX7219Handler {
-    devices::LocalMAX7219& max_;
+    MaxImpl& max_;
 
 public:
-    MAX7219Handler(devices::LocalMAX7219& max) : max_(max) {}
+    MAX7219Handler(MaxImpl& max) : max_(max) {}
     MAX7219Handler(const MAX7219Handler&) = delete;
     MAX7219Handler(MAX7219Handler&&) = delete;
     MAX7219Handler& operator=(const MAX7219Handler&) = delete;
@@ -118,14 +125,23 @@ public:
         }
     }
 
+    /**
+     * @brief Handle a raw MAX7219 message, as received by a ProtocolDriver.
+     */
+    void handleMessage([[maybe_unused]] Command command, [[maybe_unused]] uint8_t sender, std::span<const uint8_t> data) {
+        if (data.size() != sizeof(MsgMax7219)) return;
+        const MsgMax7219* msg = reinterpret_cast<const MsgMax7219*>(data.data());
+        handle(*msg);
+    }
+
+    /**
+     * @brief Return a dispatch entry for this handler, e.g. to build a DispatchTable at compile time.
+     */
+    constexpr DispatchEntry dispatchEntry() noexcept { return bindHandler<&MAX7219Handler::handleMessage>(*this); }
+
     template <typename DriverImpl>
     inline void registerAt(DriverImpl& driver) {
-        driver.registerHandler(Command::Max7219, "Handle MAX7219 messages",
-                               [this]([[maybe_unused]] Command command, [[maybe_unused]] uint8_t sender, const std::vector<uint8_t>& data) {
-            if (data.size() != sizeof(MsgMax7219)) return;
-            const MsgMax7219* msg = reinterpret_cast<const MsgMax7219*>(data.data());
-            handle(*msg);
-        });
+        driver.template registerHandler<&MAX7219Handler::handleMessage>(Command::Max7219, "Handle MAX7219 messages", *this);
     }
 };
 
@@ -16,6 +16,10 @@
  */
 
 
+#include <cstdint>
+
+#include <span>
+
 #include <protocols/messages.hpp>
 
 namespace nl::rakis::raspberrypi::protocols {
@@ -53,5 +57,28 @@ struct MsgMax7219 {
     inline constexpr static uint8_t AllModules = 0xff;
 };
 
+/**
+ * @brief Collapse key for MAX7219 messages, for use with a PriorityMessageQueue. Only commands that set a value are
+ *        collapsed, per interface, module, and command. Anything else, such as clearing the display, is always sent.
+ *        Messages for all modules are never collapsed, so they also keep a later message for a single module from
+ *        replacing one queued before them.
+ */
+inline bool max7219CollapseKey(std::span<const uint8_t> data, uint32_t& key) {
+    if ((data.size() < 3) || (data[1] == MsgMax7219::AllModules)) {
+        return false;
+    }
+    switch (toMax7219Command(data[2])) {
+    case Max7219Command::SetBrightness:
+    case Max7219Command::SetScanLimit:
+    case Max7219Command::SetDecodeMode:
+    case Max7219Command::SetValue:
+        key = (uint32_t(data[0]) << 16) | (uint32_t(data[1]) << 8) | data[2];
+        return true;
+
+    default:
+        return false;
+    }
+}
+
 
 } // namespace nl::rakis::raspberrypi::protocols
\ No newline at end of file
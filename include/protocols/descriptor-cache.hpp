@@ -0,0 +1,298 @@
+#pragma once
+/*
+ * Copyright (c) 2024 by Bert Laverman. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <cstdint>
+
+#include <map>
+#include <span>
+#include <array>
+#include <format>
+#include <functional>
+
+#include <util/verbose-component.hpp>
+#include <protocols/messages.hpp>
+#include <protocols/rpc.hpp>
+#include <protocols/descriptor.hpp>
+
+
+namespace nl::rakis::raspberrypi::protocols {
+
+
+/**
+ * @brief The bus controller's cache of board descriptors. Boards are reported with the hash from their Hello, and a
+ *        descriptor is only fetched if that hash differs from the cached one, so a known topology costs no traffic.
+ *
+ * Fetching is done from update(), which should be called regularly from the main loop after the boards were given their
+ * addresses. It first asks for the summary, and then for the pages of interfaces and devices, one request at a time per
+ * board. A descriptor that does not match the hash of its summary is fetched again.
+ *
+ * @tparam Driver The ProtocolDriver used by the RpcClient.
+ */
+template <class Driver>
+class DescriptorCache : public util::VerboseComponent {
+public:
+    /**
+     * @brief Called when the descriptor of a board was fetched, and differs from what was cached.
+     */
+    using ChangeListener = std::function<void(BoardId board, const Descriptor& descriptor)>;
+
+    static constexpr unsigned DefaultMaxFetches = 4;
+    static constexpr unsigned MaxAttempts = 3;
+
+private:
+    struct Entry {
+        uint8_t address{ 0 };
+        uint32_t hash{ 0 };
+        bool complete{ false };
+        bool stale{ true };
+        bool fetching{ false };
+        unsigned attempts{ 0 };
+        uint32_t generation{ 0 };   // Of the last fetch started
+        MsgEnumerate summary;
+        Descriptor descriptor;
+        Descriptor incoming;
+    };
+
+    RpcClient<Driver>& rpc_;
+    std::map<uint64_t, Entry> boards_;
+    ChangeListener listener_;
+    unsigned maxFetches_{ DefaultMaxFetches };
+    unsigned fetching_{ 0 };
+    unsigned fetches_{ 0 };
+    uint32_t generation_{ 0 };
+
+    /**
+     * @brief Return the entry a reply is for, or nullptr if the board was forgotten since its fetch started, in which
+     *        case that fetch ends here. A board announced again after being forgotten gets a new fetch, so a late reply
+     *        to the old one must not be taken as part of it.
+     */
+    Entry* fetchOf(uint64_t id, uint32_t generation) {
+        auto it = boards_.find(id);
+        if ((it == boards_.end()) || (it->second.generation != generation)) {
+            fetching_--;
+            return nullptr;
+        }
+        return &it->second;
+    }
+
+    /**
+     * @brief End a fetch. On failure the board stays stale, and is tried again until it ran out of attempts.
+     */
+    void done(uint64_t id, bool success) {
+        auto it = boards_.find(id);
+        if (it == boards_.end()) {
+            return;
+        }
+        Entry& entry = it->second;
+        entry.fetching = false;
+        fetching_--;
+
+        if (!success) {
+            if (++entry.attempts >= MaxAttempts) {
+                log(std::format("Giving up on the descriptor of board {:016x}.", id));
+                entry.stale = false;
+            }
+            return;
+        }
+        entry.attempts = 0;
+        entry.stale = false;
+        entry.complete = true;
+
+        const bool changed = (entry.hash != entry.summary.hash);
+        entry.hash = entry.summary.hash;
+        entry.descriptor = std::move(entry.incoming);
+        entry.incoming.clear();
+
+        if (changed && listener_) {
+            listener_(BoardId{ id }, entry.descriptor);
+        }
+    }
+
+    /**
+     * @brief Ask for the next page of interfaces or devices, or finish the fetch if all have arrived.
+     */
+    void nextPage(uint64_t id) {
+        Entry& entry = boards_.at(id);
+
+        const auto haveInterfaces = entry.incoming.interfaces().size();
+        const auto haveDevices = entry.incoming.devices().size();
+
+        Command command;
+        uint8_t first;
+        if (haveInterfaces < entry.summary.interfaces) {
+            command = Command::InterfaceInfo;
+            first = uint8_t(haveInterfaces);
+        } else if (haveDevices < entry.summary.devices) {
+            command = Command::DeviceInfo;
+            first = uint8_t(haveDevices);
+        } else {
+            const bool match = (entry.incoming.hash() == entry.summary.hash);
+            if (!match) {
+                log(std::format("Descriptor of board {:016x} does not match its hash.", id));
+            }
+            done(id, match);
+            return;
+        }
+        const std::array<uint8_t, 1> body{ first };
+        const bool sent = rpc_.request(entry.address, command, body, [this, id, command, generation = entry.generation](RpcStatus status, [[maybe_unused]] uint8_t sender, std::span<const uint8_t> reply) {
+            Entry* entry = fetchOf(id, generation);
+            if (entry == nullptr) {
+                return;
+            }
+            const int added = (status != RpcStatus::Ok) ? -1
+                            : (command == Command::InterfaceInfo) ? entry->incoming.template addPage<MsgInterfaceInfo>(reply)
+                            : entry->incoming.template addPage<MsgDeviceInfo>(reply);
+            if (added <= 0) {
+                done(id, false);
+            } else {
+                nextPage(id);
+            }
+        });
+        if (!sent) {
+            done(id, false);
+        }
+    }
+
+    /**
+     * @brief Start fetching the descriptor of a board, beginning with its summary.
+     */
+    void fetch(uint64_t id, Entry& entry) {
+        entry.fetching = true;
+        entry.generation = ++generation_;
+        entry.incoming.clear();
+        fetching_++;
+        fetches_++;
+
+        const bool sent = rpc_.request(entry.address, Command::Enumerate, std::span<const uint8_t>(), [this, id, generation = entry.generation](RpcStatus status, [[maybe_unused]] uint8_t sender, std::span<const uint8_t> reply) {
+            Entry* current = fetchOf(id, generation);
+            if (current == nullptr) {
+                return;
+            }
+            Entry& entry = *current;
+            if (status == RpcStatus::UnknownCommand) {
+                // This board does not describe itself, so there is nothing to fetch.
+                entry.attempts = MaxAttempts;
+                done(id, false);
+            } else if ((status != RpcStatus::Ok) || !Descriptor::decode(reply, entry.summary)) {
+                done(id, false);
+            } else if (entry.complete && (entry.summary.hash == entry.hash)) {
+                entry.incoming = entry.descriptor;
+                done(id, true);
+            } else {
+                nextPage(id);
+            }
+        });
+        if (!sent) {
+            done(id, false);
+        }
+    }
+
+public:
+    explicit DescriptorCache(RpcClient<Driver>& rpc) : rpc_(rpc) {}
+    ~DescriptorCache() = default;
+
+    DescriptorCache(const DescriptorCache&) = delete;
+    DescriptorCache(DescriptorCache&&) = delete;
+    DescriptorCache& operator=(const DescriptorCache&) = delete;
+    DescriptorCache& operator=(DescriptorCache&&) = delete;
+
+    /**
+     * @brief Set the function called when a descriptor changed.
+     */
+    void onChange(ChangeListener listener) { listener_ = std::move(listener); }
+
+    /**
+     * @brief Set the number of boards whose descriptor can be fetched at the same time.
+     */
+    void maxFetches(unsigned fetches) noexcept { maxFetches_ = std::max(fetches, 1u); }
+
+    /**
+     * @brief Return the number of fetches started so far, which is a measure of the enumeration traffic.
+     */
+    unsigned fetches() const noexcept { return fetches_; }
+
+    /**
+     * @brief Return the number of known boards.
+     */
+    std::size_t size() const noexcept { return boards_.size(); }
+
+    /**
+     * @brief Report a board and the descriptor hash it announced. A hash of 0 means it is not known, for example for
+     *        a board whose lease was confirmed without a Hello, and then the summary is fetched to compare.
+     */
+    void announced(BoardId board, uint8_t address, uint32_t hash) {
+        Entry& entry = boards_[board.id];
+        entry.address = address;
+        if (!entry.complete || (hash == 0) || (hash != entry.hash)) {
+            entry.stale = true;
+            entry.attempts = 0;
+        }
+    }
+
+    /**
+     * @brief Forget a board, for example after it left the bus.
+     */
+    void forget(BoardId board) { boards_.erase(board.id); }
+
+    /**
+     * @brief Return true if the cached descriptor of a board has the given hash.
+     */
+    bool current(BoardId board, uint32_t hash) const {
+        auto it = boards_.find(board.id);
+        return (it != boards_.end()) && it->second.complete && (it->second.hash == hash);
+    }
+
+    /**
+     * @brief Return the cached descriptor of a board, or nullptr if there is none yet.
+     */
+    const Descriptor* find(BoardId board) const {
+        auto it = boards_.find(board.id);
+        return ((it != boards_.end()) && it->second.complete) ? &it->second.descriptor : nullptr;
+    }
+
+    /**
+     * @brief Return true if no descriptor needs to be fetched, or is being fetched.
+     */
+    bool idle() const noexcept {
+        if (fetching_ != 0) {
+            return false;
+        }
+        for (const auto& [id, entry] : boards_) {
+            if (entry.stale) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    /**
+     * @brief Start fetching stale descriptors, up to the maximum number of parallel fetches.
+     */
+    void update() {
+        for (auto& [id, entry] : boards_) {
+            if (fetching_ >= maxFetches_) {
+                return;
+            }
+            if (entry.stale && !entry.fetching) {
+                fetch(id, entry);
+            }
+        }
+    }
+};
+
+} // namespace nl::rakis::raspberrypi::protocols
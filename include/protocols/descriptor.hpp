@@ -0,0 +1,228 @@
+#pragma once
+/*
+ * Copyright (c) 2024 by Bert Laverman. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <cstdint>
+#include <cstring>
+
+#include <span>
+#include <array>
+#include <vector>
+#include <algorithm>
+#include <type_traits>
+
+#include <util/crc.hpp>
+#include <protocols/messages.hpp>
+#include <protocols/rpc.hpp>
+
+
+namespace nl::rakis::raspberrypi::protocols {
+
+
+/**
+ * @brief A compact description of the interfaces and devices attached to a board, with a hash that changes whenever
+ *        the content does. Boards serve it through "Enumerate", "InterfaceInfo" and "DeviceInfo" requests, and
+ *        announce the hash in their Hello, so the bus controller only fetches it again after a change.
+ */
+class Descriptor {
+    std::vector<MsgInterfaceInfo> interfaces_;
+    std::vector<MsgDeviceInfo> devices_;
+    uint32_t hash_{ 0 };
+
+    /**
+     * @brief Recompute the hash. It covers the number of records and their content, and is never 0, which stands for
+     *        "unknown" in a Hello.
+     */
+    void rehash() {
+        const std::array<uint8_t, 2> counts{ uint8_t(interfaces_.size()), uint8_t(devices_.size()) };
+
+        util::Crc32 crc;
+        crc.update(counts);
+        crc.update(std::span<const uint8_t>(reinterpret_cast<const uint8_t*>(interfaces_.data()), interfaces_.size() * sizeMsgInterfaceInfo));
+        crc.update(std::span<const uint8_t>(reinterpret_cast<const uint8_t*>(devices_.data()), devices_.size() * sizeMsgDeviceInfo));
+        hash_ = (crc.value() == 0) ? 1 : crc.value();
+    }
+
+    /**
+     * @brief Append a page of records to a reply, starting at the given index.
+     */
+    template <class Record>
+    static RpcStatus appendPage(const std::vector<Record>& records, std::span<const uint8_t> body, RpcReplyBuffer& reply) {
+        if (body.size() < 1) {
+            return RpcStatus::Failed;
+        }
+        const std::size_t first = std::min<std::size_t>(body[0], records.size());
+        const std::size_t count = std::min(records.size() - first, (reply.available() - sizeMsgDescriptorPage) / sizeof(Record));
+
+        const std::array<uint8_t, sizeMsgDescriptorPage> page{ uint8_t(first), uint8_t(count) };
+        reply.append(page);
+        reply.append(std::span<const uint8_t>(reinterpret_cast<const uint8_t*>(records.data() + first), count * sizeof(Record)));
+
+        return RpcStatus::Ok;
+    }
+
+    /**
+     * @brief Add or replace a record, matching on its id.
+     */
+    template <class Record, class Id>
+    bool put(std::vector<Record>& records, const Record& record, Id id) {
+        auto it = std::find_if(records.begin(), records.end(), [&](const Record& r) { return r.*id == record.*id; });
+        if (it != records.end()) {
+            *it = record;
+        } else if (records.size() < MaxRecords) {
+            records.push_back(record);
+        } else {
+            return false;
+        }
+        rehash();
+
+        return true;
+    }
+
+public:
+    /**
+     * @brief The most interfaces, and the most devices, a descriptor can hold, as indexes are sent as a single byte.
+     */
+    static constexpr std::size_t MaxRecords = 255;
+
+    /**
+     * @brief The number of records that fit in a single reply.
+     */
+    static constexpr std::size_t InterfacesPerPage = (MaxPayloadSize - sizeMsgReply - sizeMsgDescriptorPage) / sizeMsgInterfaceInfo;
+    static constexpr std::size_t DevicesPerPage = (MaxPayloadSize - sizeMsgReply - sizeMsgDescriptorPage) / sizeMsgDeviceInfo;
+
+    Descriptor() { rehash(); }
+    Descriptor(const Descriptor&) = default;
+    Descriptor(Descriptor&&) = default;
+    ~Descriptor() = default;
+
+    Descriptor& operator=(const Descriptor&) = default;
+    Descriptor& operator=(Descriptor&&) = default;
+
+    /**
+     * @brief Return the hash of the current content.
+     */
+    uint32_t hash() const noexcept { return hash_; }
+
+    std::span<const MsgInterfaceInfo> interfaces() const noexcept { return interfaces_; }
+    std::span<const MsgDeviceInfo> devices() const noexcept { return devices_; }
+
+    /**
+     * @brief Add an interface, or replace the one with the same id.
+     *
+     * @return false if the descriptor is full.
+     */
+    bool add(const MsgInterfaceInfo& info) { return put(interfaces_, info, &MsgInterfaceInfo::id); }
+
+    /**
+     * @brief Add a device, or replace the one with the same id.
+     *
+     * @return false if the descriptor is full.
+     */
+    bool add(const MsgDeviceInfo& info) { return put(devices_, info, &MsgDeviceInfo::deviceId); }
+
+    /**
+     * @brief Remove all interfaces and devices.
+     */
+    void clear() {
+        interfaces_.clear();
+        devices_.clear();
+        rehash();
+    }
+
+    /**
+     * @brief Return the summary sent in reply to an "Enumerate" request.
+     */
+    MsgEnumerate summary() const noexcept {
+        return MsgEnumerate{ hash_, uint8_t(interfaces_.size()), uint8_t(devices_.size()) };
+    }
+
+    /**
+     * @brief Encode a summary as the body of a reply.
+     */
+    static std::array<uint8_t, sizeMsgEnumerate> encode(const MsgEnumerate& summary) noexcept {
+        std::array<uint8_t, sizeMsgEnumerate> body;
+        std::memcpy(body.data(), &summary.hash, sizeof(summary.hash));
+        body[sizeof(summary.hash)] = summary.interfaces;
+        body[sizeof(summary.hash) + 1] = summary.devices;
+
+        return body;
+    }
+
+    /**
+     * @brief Decode the body of a reply to an "Enumerate" request.
+     *
+     * @return false if the body is too short.
+     */
+    static bool decode(std::span<const uint8_t> body, MsgEnumerate& summary) noexcept {
+        if (body.size() < sizeMsgEnumerate) {
+            return false;
+        }
+        std::memcpy(&summary.hash, body.data(), sizeof(summary.hash));
+        summary.interfaces = body[sizeof(summary.hash)];
+        summary.devices = body[sizeof(summary.hash) + 1];
+
+        return true;
+    }
+
+    /**
+     * @brief Add the records of a reply to an "InterfaceInfo" or "DeviceInfo" request.
+     *
+     * @return The number of records added, or -1 if the page does not continue where the descriptor ends.
+     */
+    template <class Record>
+    int addPage(std::span<const uint8_t> body) {
+        if (body.size() < sizeMsgDescriptorPage) {
+            return -1;
+        }
+        const unsigned first = body[0];
+        const unsigned count = body[1];
+        const auto& records = [this]() -> const auto& {
+            if constexpr (std::is_same_v<Record, MsgInterfaceInfo>) { return interfaces_; } else { return devices_; }
+        }();
+        if ((first != records.size()) || (body.size() != (sizeMsgDescriptorPage + count * sizeof(Record)))) {
+            return -1;
+        }
+        for (unsigned i = 0; i < count; ++i) {
+            Record record;
+            std::memcpy(&record, body.data() + sizeMsgDescriptorPage + i * sizeof(Record), sizeof(Record));
+            if (!add(record)) {
+                return -1;
+            }
+        }
+        return static_cast<int>(count);
+    }
+
+    /**
+     * @brief Answer "Enumerate", "InterfaceInfo" and "DeviceInfo" requests with this descriptor. It must outlive the server.
+     */
+    template <class Driver>
+    void serve(RpcServer<Driver>& server) {
+        server.respond(Command::Enumerate, [this]([[maybe_unused]] uint8_t sender, [[maybe_unused]] std::span<const uint8_t> body, RpcReplyBuffer& reply) {
+            reply.append(encode(summary()));
+            return RpcStatus::Ok;
+        });
+        server.respond(Command::InterfaceInfo, [this]([[maybe_unused]] uint8_t sender, std::span<const uint8_t> body, RpcReplyBuffer& reply) {
+            return appendPage(interfaces_, body, reply);
+        });
+        server.respond(Command::DeviceInfo, [this]([[maybe_unused]] uint8_t sender, std::span<const uint8_t> body, RpcReplyBuffer& reply) {
+            return appendPage(devices_, body, reply);
+        });
+    }
+};
+
+} // namespace nl::rakis::raspberrypi::protocols
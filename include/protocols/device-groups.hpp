@@ -0,0 +1,126 @@
+#pragma once
+/*
+ * Copyright (c) 2024 by Bert Laverman. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+
+#include <cstdint>
+
+#include <array>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#include <protocols/messages.hpp>
+
+
+namespace nl::rakis::raspberrypi::protocols {
+
+
+/**
+ * @brief The bus controller's registry of named device groups and their members. Groups are numbered in the order they
+ *        are defined, which is the number used in "SetGroup" and "Group" messages.
+ */
+class DeviceGroups {
+    std::array<std::string, MaxGroups> names_;
+    std::array<std::vector<uint64_t>, MaxGroups> members_;
+    unsigned count_{ 0 };
+
+public:
+    DeviceGroups() = default;
+    DeviceGroups(const DeviceGroups&) = default;
+    DeviceGroups(DeviceGroups&&) = default;
+    ~DeviceGroups() = default;
+
+    DeviceGroups& operator=(const DeviceGroups&) = default;
+    DeviceGroups& operator=(DeviceGroups&&) = default;
+
+    /**
+     * @brief Return the number of defined groups.
+     */
+    unsigned count() const noexcept { return count_; }
+
+    /**
+     * @brief Return the number of a group, or -1 if it is not defined.
+     */
+    int find(const std::string& name) const {
+        for (unsigned group = 0; group < count_; ++group) {
+            if (names_[group] == name) {
+                return static_cast<int>(group);
+            }
+        }
+        return -1;
+    }
+
+    /**
+     * @brief Return the number of a group, defining it if needed.
+     *
+     * @return The number of the group, or -1 if all groups are in use.
+     */
+    int define(const std::string& name) {
+        if (auto group = find(name); group >= 0) {
+            return group;
+        }
+        if (count_ == MaxGroups) {
+            return -1;
+        }
+        names_[count_] = name;
+
+        return static_cast<int>(count_++);
+    }
+
+    /**
+     * @brief Return the name of a group.
+     */
+    const std::string& name(uint8_t group) const { return names_.at(group); }
+
+    /**
+     * @brief Add a board to a group, defining the group if needed.
+     *
+     * @return The number of the group, or -1 if all groups are in use.
+     */
+    int add(const std::string& name, BoardId board) {
+        const auto group = define(name);
+        if ((group >= 0) && !contains(static_cast<uint8_t>(group), board)) {
+            members_[group].push_back(board.id);
+        }
+        return group;
+    }
+
+    /**
+     * @brief Remove a board from a group.
+     *
+     * @return false if it was not a member.
+     */
+    bool remove(const std::string& name, BoardId board) {
+        const auto group = find(name);
+        return (group >= 0) && (std::erase(members_[group], board.id) > 0);
+    }
+
+    /**
+     * @brief Check if a board is a member of a group.
+     */
+    bool contains(uint8_t group, BoardId board) const {
+        return (group < count_) && (std::find(members_[group].begin(), members_[group].end(), board.id) != members_[group].end());
+    }
+
+    /**
+     * @brief Return the members of a group.
+     */
+    const std::vector<uint64_t>& members(uint8_t group) const { return members_.at(group); }
+};
+
+} // namespace nl::rakis::raspberrypi::protocols
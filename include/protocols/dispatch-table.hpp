@@ -0,0 +1,126 @@
+#pragma once
+/*
+ * Copyright (c) 2024 by Bert Laverman. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <cstdint>
+
+#include <span>
+#include <array>
+
+#include <protocols/messages.hpp>
+
+
+namespace nl::rakis::raspberrypi::protocols {
+
+
+/**
+ * @brief A plain handler function. The context is whatever was bound with it, usually the handling object.
+ */
+using HandlerFunction = void (*)(void* context, Command command, uint8_t sender, std::span<const uint8_t> data);
+
+
+/**
+ * @brief An entry in the dispatch table: a function pointer plus its context.
+ */
+struct DispatchEntry {
+    HandlerFunction function{ nullptr };
+    void* context{ nullptr };
+
+    constexpr explicit operator bool() const noexcept { return function != nullptr; }
+};
+
+
+/**
+ * @brief Bind a member function of the given object as a handler. The call is resolved at compile time, so dispatching
+ *        through the entry costs a single indirect call.
+ *
+ * @tparam Method The member function, which must accept (Command, uint8_t, std::span<const uint8_t>).
+ * @param target  The object to call it on. It must outlive the entry.
+ */
+template <auto Method, class Target>
+constexpr DispatchEntry bindHandler(Target& target) noexcept {
+    return DispatchEntry{
+        .function = [](void* context, Command command, uint8_t sender, std::span<const uint8_t> data) {
+            (static_cast<Target*>(context)->*Method)(command, sender, data);
+        },
+        .context = &target
+    };
+}
+
+/**
+ * @brief Bind a free (or static member) function as a handler.
+ *
+ * @tparam Function The function, which must accept (Command, uint8_t, std::span<const uint8_t>).
+ */
+template <auto Function>
+constexpr DispatchEntry bindHandler() noexcept {
+    return DispatchEntry{
+        .function = []([[maybe_unused]] void* context, Command command, uint8_t sender, std::span<const uint8_t> data) {
+            Function(command, sender, data);
+        },
+        .context = nullptr
+    };
+}
+
+
+/**
+ * @brief A table with a handler slot for every possible Command value. It can be filled at runtime, or built
+ *        completely at compile time and installed in one go.
+ */
+class DispatchTable {
+    std::array<DispatchEntry, 256> entries_{};
+
+public:
+    constexpr DispatchTable() = default;
+
+    /**
+     * @brief Set the handler for a command.
+     */
+    constexpr void set(Command command, DispatchEntry entry) noexcept { entries_[toInt(command)] = entry; }
+
+    /**
+     * @brief Remove the handler for a command.
+     */
+    constexpr void clear(Command command) noexcept { entries_[toInt(command)] = DispatchEntry{}; }
+
+    /**
+     * @brief Return the entry for a command.
+     */
+    constexpr const DispatchEntry& at(Command command) const noexcept { return entries_[toInt(command)]; }
+
+    /**
+     * @brief Check if a handler is set for a command.
+     */
+    constexpr bool has(Command command) const noexcept { return static_cast<bool>(at(command)); }
+
+    /**
+     * @brief Call the handler for the command.
+     *
+     * @return false if there was no handler for it.
+     */
+    bool dispatch(Command command, uint8_t sender, std::span<const uint8_t> data) const {
+        const auto& entry = at(command);
+        if (!entry) {
+            return false;
+        }
+        entry.function(entry.context, command, sender, data);
+
+        return true;
+    }
+};
+
+} // namespace nl::rakis::raspberrypi::protocols
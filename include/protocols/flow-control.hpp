@@ -0,0 +1,199 @@
+#pragma once
+/*
+ * Copyright (c) 2024 by Bert Laverman. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+
+#include <cstdint>
+
+#include <array>
+#include <atomic>
+#include <limits>
+
+#include <protocols/messages.hpp>
+
+
+namespace nl::rakis::raspberrypi::protocols {
+
+
+/**
+ * @brief Credit based flow control, as used by the bus controller. Listeners advertise the free space in their incoming
+ *        queue using "Credit" messages, and the controller holds back messages to an address that has no credit left.
+ *
+ * Addresses that never sent a "Credit" are not limited, and neither is the General Call address. If the credit for an
+ * address has been exhausted for longer than the stale time, a single message is let through anyway, so a lost "Credit"
+ * message cannot stall an address forever.
+ *
+ * Both sides count the same messages: every message sent to the listener's own address, whether it was paced or not,
+ * and none sent to the General Call address. Messages combined into a "Batch" frame count one by one. A message that
+ * turns out not to have arrived, because the write failed, is taken back with unsent(). If the listener's count goes
+ * backwards, for example because it restarted, we start counting again from its count.
+ */
+class FlowControl {
+public:
+    static constexpr uint32_t DefaultStaleUs = 100'000;
+
+    /**
+     * @brief The credit reported for addresses that are not limited.
+     */
+    static constexpr unsigned Unlimited = std::numeric_limits<unsigned>::max();
+
+private:
+    struct Window {
+        bool known{ false };
+        uint8_t slots{ 0 };
+        uint8_t received{ 0 };      // As reported by the listener
+        uint8_t sent{ 0 };          // By us, modulo 256
+        uint64_t updated{ 0 };
+    };
+
+    std::array<Window, 128> windows_{};
+    std::array<std::atomic<uint8_t>, 128> unsent_{};    // Written when asynchronous writes complete
+    uint32_t staleUs_{ DefaultStaleUs };
+    uint32_t deferred_{ 0 };
+
+    /**
+     * @brief Return the number of messages sent that the listener had not yet received when it sent its credit.
+     */
+    unsigned inFlight(uint8_t address) const noexcept {
+        const auto& window = windows_[address];
+        const uint8_t sent = window.sent - unsent_[address].load(std::memory_order_relaxed);
+        const auto difference = static_cast<int8_t>(sent - window.received);
+        return (difference > 0) ? static_cast<unsigned>(difference) : 0;
+    }
+
+public:
+    FlowControl() = default;
+    FlowControl(const FlowControl&) = delete;
+    FlowControl(FlowControl&&) = delete;
+    ~FlowControl() = default;
+
+    FlowControl& operator=(const FlowControl&) = delete;
+    FlowControl& operator=(FlowControl&&) = delete;
+
+    /**
+     * @brief Set the time after which an exhausted credit lets a single message through.
+     */
+    void staleUs(uint32_t us) noexcept { staleUs_ = us; }
+
+    uint32_t staleUs() const noexcept { return staleUs_; }
+
+    /**
+     * @brief Return the number of times a message was held back for lack of credit.
+     */
+    uint32_t deferred() const noexcept { return deferred_; }
+
+    /**
+     * @brief Process a "Credit" message. The first one from an address assumes nothing is in flight, and so does one
+     *        whose count went backwards, or past the number of messages we sent.
+     */
+    void credit(uint8_t address, const MsgCredit& msg, uint64_t nowUs) noexcept {
+        if (address >= windows_.size()) {
+            return;
+        }
+        auto& window = windows_[address];
+        const uint8_t sent = window.sent - unsent_[address].load(std::memory_order_relaxed);
+        if (!window.known
+            || (static_cast<int8_t>(msg.received - window.received) < 0)
+            || (static_cast<int8_t>(sent - msg.received) < 0))
+        {
+            window.known = true;
+            window.sent = msg.received + unsent_[address].load(std::memory_order_relaxed);
+        }
+        window.slots = msg.slots;
+        window.received = msg.received;
+        window.updated = nowUs;
+    }
+
+    /**
+     * @brief Return the number of messages that can be sent to an address without overrunning it.
+     */
+    unsigned available(uint8_t address) const noexcept {
+        if ((address == 0) || (address >= windows_.size()) || !windows_[address].known) {
+            return Unlimited;
+        }
+        const auto& window = windows_[address];
+        const auto used = inFlight(address);
+
+        return (used < window.slots) ? (window.slots - used) : 0;
+    }
+
+    /**
+     * @brief Check if a message to an address may be sent now. The message is counted by sent(), once it is actually
+     *        handed to the bus.
+     *
+     * @return false if the message should be held back.
+     */
+    bool allow(uint8_t address, uint64_t nowUs) noexcept {
+        if ((address == 0) || (address >= windows_.size())) {
+            return true;
+        }
+        auto& window = windows_[address];
+        if (available(address) == 0) {
+            if ((nowUs - window.updated) < staleUs_) {
+                deferred_++;
+                return false;
+            }
+            window.updated = nowUs;
+        }
+        return true;
+    }
+
+    /**
+     * @brief Count a message sent to an address, paced or not. Messages to the General Call address are not counted, as
+     *        listeners do not count them either.
+     */
+    void sent(uint8_t address) noexcept {
+        if ((address != 0) && (address < windows_.size())) {
+            windows_[address].sent++;
+        }
+    }
+
+    /**
+     * @brief Take back messages counted by sent() that did not arrive, because writing them failed. This may be called
+     *        from the thread that completes asynchronous writes. On the Pico, where writes complete synchronously, it
+     *        must be called by the same core as sent().
+     */
+    void unsent(uint8_t address, unsigned count = 1) noexcept {
+        if ((address != 0) && (address < unsent_.size())) {
+            auto& unsent = unsent_[address];
+#if defined(TARGET_PICO)
+            unsent.store(static_cast<uint8_t>(unsent.load(std::memory_order_relaxed) + count), std::memory_order_relaxed);
+#else
+            unsent.fetch_add(static_cast<uint8_t>(count), std::memory_order_relaxed);
+#endif
+        }
+    }
+
+    /**
+     * @brief Forget what we know of an address, for example because the board restarted and announced itself again.
+     */
+    void forget(uint8_t address) noexcept {
+        if (address < windows_.size()) {
+            windows_[address] = Window{};
+            unsent_[address].store(0, std::memory_order_relaxed);
+        }
+    }
+
+    void reset() noexcept {
+        windows_.fill(Window{});
+        for (auto& unsent : unsent_) {
+            unsent.store(0, std::memory_order_relaxed);
+        }
+    }
+};
+
+} // namespace nl::rakis::raspberrypi::protocols
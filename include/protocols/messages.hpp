@@ -16,6 +16,7 @@
  */
 
 
+#include <cstddef>
 #include <cstdint>
 
 #include <span>
@@ -39,34 +40,78 @@ enum class Command : uint8_t {
 
     /**
      * @brief The "SetAddress" message is only sent as a General Call and instructs a listener to listen using the provided address.
+     *        The body is one or more MsgSetAddress records, so a single message can assign addresses to several boards.
      */
     SetAddress  = 0x01,
 
     /**
-     * @brief the "Enumerate" message requests an enumeration of attached interfaces and devices.
-     *
-     * NOT IMPLEMENTED YET!
+     * @brief the "Enumerate" message is sent as a Request, and asks a listener for the summary of its descriptor: the
+     *        hash and the number of attached interfaces and devices. The body of the reply is a MsgEnumerate.
      */
     Enumerate   = 0x02,
 
     /**
-     * @brief The "InterfaceInfo" message contains data on attached interfaces, and is used to respond to an "Enumerate"
-     *        request, or to provide a listener with information about attached interfaces.
-     *
-     * NOT IMPLEMENTED YET!
+     * @brief The "InterfaceInfo" message is sent as a Request for a page of attached interfaces. The body of the request
+     *        is a MsgDescriptorPage with the first index wanted, the reply has a MsgDescriptorPage followed by that many
+     *        MsgInterfaceInfo records.
      */
     InterfaceInfo  = 0x03,
 
     /**
-     * @brief The "DeviceInfo" message contains data on attached devices, and is used to respond to an "Enumerate"
-     *        request, or to provide a listener with information about attached devices.
-     *
-     * NOT IMPLEMENTED YET!
+     * @brief The "DeviceInfo" message is sent as a Request for a page of attached devices. The body of the request
+     *        is a MsgDescriptorPage with the first index wanted, the reply has a MsgDescriptorPage followed by that many
+     *        MsgDeviceInfo records.
      */
     DeviceInfo  = 0x04,
 
     /**
-     * @brief Devices can inform the bus controller of important events using "Log" messages.
+     * @brief A "Request" wraps another command in a remote procedure call. The body starts with a correlation id and the
+     *        command, followed by the body of the request. The receiver answers with a "Reply" carrying the same id.
+     */
+    Request     = 0x05,
+
+    /**
+     * @brief A "Reply" answers a "Request". The body starts with the correlation id, the command, and a status,
+     *        followed by the body of the reply.
+     */
+    Reply       = 0x06,
+
+    /**
+     * @brief A "Credit" message tells the bus controller how many more messages a listener can queue, so the controller
+     *        can pace what it sends to that address. The body is a MsgCredit.
+     */
+    Credit      = 0x07,
+
+    /**
+     * @brief The "SetGroup" message is only sent as a General Call, and adds a listener to a device group, or removes it
+     *        from one. The body is a MsgSetGroup.
+     */
+    SetGroup    = 0x08,
+
+    /**
+     * @brief A "Group" message is sent as a General Call, and is only handled by the members of a device group. The body
+     *        starts with the group and the command, followed by the body of that command, so a single transfer reaches
+     *        every member.
+     */
+    Group       = 0x09,
+
+    /**
+     * @brief The "ConfirmLease" message is only sent as a General Call, by a bus controller that remembers which address
+     *        it gave a board before. A board that kept that address already listens on it, and only needs to know the
+     *        controller agrees; a board listening elsewhere moves. The body is one or more MsgSetAddress records.
+     */
+    ConfirmLease = 0x0a,
+
+    /**
+     * @brief A "Batch" message packs several messages for the same address into one transfer. The body is a sequence of
+     *        records, each a (command, length) pair followed by that many bytes of payload. Receivers unpack it and handle
+     *        the records in order, as if they had been sent separately.
+     */
+    Batch       = 0x0e,
+
+    /**
+     * @brief Devices can inform the bus controller of important events using "Log" messages. The first byte of the
+     *        body is a LogKind, telling if the rest is text or binary data such as metrics.
      */
     Log         = 0x0f,
 
@@ -97,7 +142,15 @@ inline constexpr uint8_t toInt(Command value) {
 }
 
 
-using MsgCallback = std::function<void(Command command, uint8_t sender, const std::span<uint8_t> data)>;
+/**
+ * @brief Called for each received message. "generalCall" tells if it was sent to all listeners rather than to us.
+ */
+using MsgCallback = std::function<void(Command command, uint8_t sender, const std::span<uint8_t> data, bool generalCall)>;
+
+/**
+ * @brief The largest payload a message can carry, as the length field in the header is a single byte.
+ */
+inline constexpr std::size_t MaxPayloadSize = 255;
 
 /**
  * @brief The "Bus Controller" uses the magic BoardId value 0. (zero)
@@ -119,12 +172,15 @@ union BoardId {
 };
 
 /**
- * @brief Broadcast (aka I2C General Call) message announcing a device on the bus.
+ * @brief Broadcast (aka I2C General Call) message announcing a device on the bus. Boards that describe their interfaces
+ *        and devices add the hash of that descriptor, so the bus controller knows if what it has cached is still valid.
  */
 struct MsgHello {
     BoardId boardId;
+    uint32_t descriptorHash{ 0 };   // 0 if not known or not sent
 };
 inline constexpr unsigned sizeMsgHello = idSize;
+inline constexpr unsigned sizeMsgHelloWithHash = idSize + sizeof(uint32_t);
 
 
 /**
@@ -136,15 +192,31 @@ struct MsgSetAddress {
 };
 inline constexpr unsigned sizeMsgSetAddress = idSize + sizeof(uint8_t);
 
+/**
+ * @brief The number of (BoardId, address) pairs that fit in a single SetAddress message.
+ */
+inline constexpr unsigned MaxSetAddressPairs = MaxPayloadSize / sizeMsgSetAddress;
+
 
 /**
- * @brief A request to enumerate attached devices for all interfaces (default) or a specific interface.
+ * @brief The reply to an "Enumerate" request: the hash of the descriptor, and the number of interfaces and devices it
+ *        holds.
 */
 struct MsgEnumerate {
-    bool includeInterfaces{ true };
-    bool includeDevices{ true };
-    uint8_t interface{ 0x00 };
+    uint32_t hash{ 0 };
+    uint8_t interfaces{ 0 };
+    uint8_t devices{ 0 };
+};
+inline constexpr unsigned sizeMsgEnumerate = sizeof(uint32_t) + 2 * sizeof(uint8_t);
+
+/**
+ * @brief The page header of "InterfaceInfo" and "DeviceInfo" requests and replies. A request only has the first index.
+ */
+struct MsgDescriptorPage {
+    uint8_t first;
+    uint8_t count;
 };
+inline constexpr unsigned sizeMsgDescriptorPage = 2 * sizeof(uint8_t);
 
 
 /**
@@ -159,6 +231,8 @@ struct MsgInterfaceInfo {
     uint8_t numberOfPins;
     uint8_t pins[8];
 };
+inline constexpr unsigned sizeMsgInterfaceInfo = 5 * sizeof(uint8_t) + 8;
+static_assert(sizeof(MsgInterfaceInfo) == sizeMsgInterfaceInfo, "MsgInterfaceInfo must not have padding");
 enum class InterfaceTypes : uint8_t {
     I2C                 = 0x01,
     SPI                 = 0x02,
@@ -182,6 +256,8 @@ struct MsgDeviceInfo {
     uint8_t numberOfPins;
     uint8_t pins[8];
 };
+inline constexpr unsigned sizeMsgDeviceInfo = 6 * sizeof(uint8_t) + 8;
+static_assert(sizeof(MsgDeviceInfo) == sizeMsgDeviceInfo, "MsgDeviceInfo must not have padding");
 enum class DeviceTypes : uint8_t {
     Led                 = 0x01,
     RgbLed              = 0x02,
@@ -199,6 +275,73 @@ enum class RgbLedSubTypes : uint8_t {
     CommonCathode       = 0x02,
 };
 
+/**
+ * @brief A listener's advertisement of free space in its incoming queue. As messages may be on their way while this is
+ *        sent, it also tells how many messages from the controller were received so far (modulo 256), so the
+ *        controller can subtract those it sent after that.
+ */
+struct MsgCredit {
+    uint8_t slots;
+    uint8_t received;
+};
+inline constexpr unsigned sizeMsgCredit = 2 * sizeof(uint8_t);
+
+/**
+ * @brief The number of device groups. Group numbers run from 0 up to this.
+ */
+inline constexpr unsigned MaxGroups = 32;
+
+/**
+ * @brief A bus controller's broadcast (aka I2C General Call) message to add a listener to a group, or remove it.
+ */
+struct MsgSetGroup {
+    BoardId boardId;
+    uint8_t group;
+    uint8_t member;     // 1 to join, 0 to leave
+};
+inline constexpr unsigned sizeMsgSetGroup = idSize + 2 * sizeof(uint8_t);
+
+/**
+ * @brief The header of a "Group" message, which is followed by the body of the command.
+ */
+struct MsgGroup {
+    uint8_t group;
+    uint8_t command;
+};
+inline constexpr unsigned sizeMsgGroup = 2 * sizeof(uint8_t);
+
+/**
+ * @brief The header of a single record in a "Batch" message.
+ */
+struct MsgBatchRecord {
+    uint8_t command;
+    uint8_t length;
+};
+inline constexpr unsigned sizeMsgBatchRecord = 2 * sizeof(uint8_t);
+
+/**
+ * @brief The first byte of a "Log" message, telling what follows.
+ */
+enum class LogKind : uint8_t {
+    /**
+     * @brief The rest of the message is text.
+     */
+    Text                = 0x00,
+
+    /**
+     * @brief The rest of the message is a page of protocol metrics, see protocols/protocol-metrics.hpp.
+     */
+    Metrics             = 0x01,
+
+    /**
+     * @brief The rest of the message is a page of trace events, see protocols/trace-log.hpp.
+     */
+    Trace               = 0x02,
+};
+inline constexpr uint8_t toInt(LogKind value) {
+    return static_cast<uint8_t>(value);
+}
+
 // Led commands
 enum class LedCommand : uint8_t {
     Off                 = 0x00,
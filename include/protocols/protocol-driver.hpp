@@ -17,29 +17,31 @@
 
 
 #include <cstdint>
+#include <cstring>
 
+#include <map>
 #include <span>
+#include <list>
+#include <atomic>
+#include <bitset>
+#include <algorithm>
 #include <string>
 #include <format>
 #include <vector>
 
 #include <util/verbose-component.hpp>
 #include <util/message-queue.hpp>
+#include <util/trace.hpp>
 #include <protocols/messages.hpp>
+#include <protocols/protocol-metrics.hpp>
+#include <protocols/trace-log.hpp>
+#include <protocols/flow-control.hpp>
+#include <protocols/dispatch-table.hpp>
 
 
 namespace nl::rakis::raspberrypi::protocols {
 
 
-/**
- * @brief A handler for a particular command.
- */
-struct CommandHandler {
-    Command command;
-    std::string description;
-    util::MessageQueue::Handler handler;
-};
-
 /**
     * @brief The address used for broadcast messages, called "General Call" for I2C.
     */
@@ -47,61 +49,196 @@ static constexpr uint8_t GeneralCallAddress = 0x00;
 
 /**
  * @brief A ProtocolDriver allows you to send and receive messages using the message definitions in this namespace.
+ *
+ * @tparam QueueImpl    The queue used for incoming messages.
+ * @tparam OutQueueImpl The queue used for outgoing messages, which defaults to the same type as the incoming one.
  */
-template <typename QueueImpl>
+template <typename QueueImpl, typename OutQueueImpl = QueueImpl>
 class ProtocolDriver : public util::VerboseComponent
 {
     QueueImpl incoming_;
-    QueueImpl outgoing_;
+    OutQueueImpl outgoing_;
+
+    ProtocolMetrics metrics_;
+
+    FlowControl flowControl_;
+    bool pacing_{ false };
+    util::MessageQueue deferred_;                   // Held back for lack of credit, in the order they were queued
+
+    int creditAddress_{ -1 };
+    std::atomic<uint8_t> creditReceived_{ 0 };     // Only written by the producer of the incoming queue
+    uint8_t creditAdvertised_{ 0 };
+
+    void (*incomingNotify_)(void* context){ nullptr };
+    void* incomingContext_{ nullptr };
 
-    std::vector<CommandHandler> handlers_;
+    DispatchTable dispatch_;
+    std::list<util::MessageQueue::Handler> functions_;
+#if !defined(NDEBUG)
+    std::map<Command, std::string> descriptions_;
+#endif
+
+    static void callFunction(void* context, Command command, uint8_t sender, std::span<const uint8_t> data) {
+        (*static_cast<util::MessageQueue::Handler*>(context))(command, sender, data);
+    }
 
 protected:
 
-    static void noopHandler(Command command, uint8_t sender, [[maybe_unused]] const std::vector<uint8_t>& data) {
+    static void noopHandler(Command command, uint8_t sender, [[maybe_unused]] std::span<const uint8_t> data) {
         RaspberryPi::log(std::format("No registered handler for command {} from {}. Ignoring message.\n", toInt(command), sender));
     }
 
-    bool haveHandler(Command command) const {
-        unsigned index = toInt(command);
-        return (handlers_.size() > index) && handlers_[index].handler;
+    bool haveHandler(Command command) const { return dispatch_.has(command); }
+
+    /**
+     * @brief Send a message taken from the outgoing queue. Implementations may hold it back to combine it with others,
+     *        as long as it is sent by the next call to flushOutgoing().
+     *
+     * @param command The command of the message.
+     * @param address The address of the recipient.
+     * @param data    A view of the payload, only valid for the duration of the call.
+     */
+    virtual void sendOutgoing(Command command, uint8_t address, std::span<const uint8_t> data) {
+        util::TraceScope trace(util::TracePoint::MessageSent, toInt(command));
+        if (!sendMessage(command, address, data)) {
+            debug("Failed to send {} to {}, no response.", toInt(command), address);
+        }
     }
 
-    util::MessageQueue::Handler handler(Command command) const {
-        return haveHandler(command) ? handlers_.at(toInt(command)).handler : noopHandler;
+    /**
+     * @brief Send whatever sendOutgoing() held back. Called after the outgoing queue has been emptied.
+     */
+    virtual void flushOutgoing() {}
+
+    /**
+     * @brief Move what the interfaces received, but left for thread context, to the incoming queue.
+     */
+    virtual void pollIncoming() {}
+
+    /**
+     * @brief Count a message for flow control. Implementations call this for every message they hand to the bus,
+     *        including those sent with sendMessage(), as the listener counts every message it receives from us. A
+     *        message whose write fails is taken back with FlowControl::unsent().
+     */
+    void countSent(uint8_t address) noexcept { flowControl_.sent(address); }
+
+    /**
+     * @brief Send a message from the outgoing queue if the address has credit, or hold it back.
+     *
+     * @param held The addresses that already have a message held back, so later ones are not sent before it.
+     */
+    void pace(Command command, uint8_t address, std::span<const uint8_t> data, uint64_t nowUs, std::bitset<128>& held) {
+        const bool known = (address < held.size());
+        if ((known && held.test(address)) || !flowControl_.allow(address, nowUs)) {
+            if (known) {
+                held.set(address);
+            }
+            deferred_.push(command, address, data);
+            return;
+        }
+        sendOutgoing(command, address, data);
     }
 
 public:
     ProtocolDriver() = default;
-    ProtocolDriver(const ProtocolDriver&) = default;
-    ProtocolDriver(ProtocolDriver&&) = default;
-    ~ProtocolDriver() = default;
+    ProtocolDriver(const ProtocolDriver&) = delete;
+    ProtocolDriver(ProtocolDriver&&) = delete;
+    virtual ~ProtocolDriver() = default;
 
-    ProtocolDriver& operator=(const ProtocolDriver&) = default;
-    ProtocolDriver& operator=(ProtocolDriver&&) = default;
+    ProtocolDriver& operator=(const ProtocolDriver&) = delete;
+    ProtocolDriver& operator=(ProtocolDriver&&) = delete;
 
 
     /**
-     * @brief Register a handler for a certain command.
+     * @brief Register a handler for a certain command. This is the flexible (type-erased) variant, which costs an extra
+     *        indirection per message. Prefer binding a member function if the handler is an object.
      *
      * @param command     The command to handle.
-     * @param description A description of the handler.
+     * @param description A description of the handler, only kept in debug builds.
      * @param handler     The actual handler.
      */
-    void registerHandler(Command command, std::string description, util::MessageQueue::Handler handler) {
-        unsigned index = toInt(command);
-        if (index >= handlers_.size()) {
-            handlers_.resize(index+1);
+    void registerHandler(Command command, [[maybe_unused]] std::string description, util::MessageQueue::Handler handler) {
+        const auto& entry = dispatch_.at(command);
+        if (entry.function == callFunction) {
+            *static_cast<util::MessageQueue::Handler*>(entry.context) = std::move(handler);
+        } else {
+            functions_.push_back(std::move(handler));
+            dispatch_.set(command, DispatchEntry{ .function = callFunction, .context = &functions_.back() });
+        }
+#if !defined(NDEBUG)
+        descriptions_[command] = description;
+#endif
+    }
+
+    /**
+     * @brief Register a handler for a certain command.
+     *
+     * @param command     The command to handle.
+     * @param description A description of the handler, only kept in debug builds.
+     * @param entry       The function pointer and context to call.
+     */
+    void registerHandler(Command command, [[maybe_unused]] std::string description, DispatchEntry entry) {
+        dispatch_.set(command, entry);
+#if !defined(NDEBUG)
+        descriptions_[command] = description;
+#endif
+    }
+
+    /**
+     * @brief Register a member function of an object as the handler for a certain command. The call is bound at
+     *        compile time, so dispatching a message is a single indirect call.
+     *
+     * @tparam Method     The member function, accepting (Command, uint8_t, std::span<const uint8_t>).
+     * @param command     The command to handle.
+     * @param description A description of the handler, only kept in debug builds.
+     * @param target      The object to call the handler on.
+     */
+    template <auto Method, class Target>
+    void registerHandler(Command command, std::string description, Target& target) {
+        registerHandler(command, std::move(description), bindHandler<Method>(target));
+    }
+
+    /**
+     * @brief Replace all handlers with a (possibly compile-time built) dispatch table.
+     */
+    void dispatchTable(const DispatchTable& table) {
+        dispatch_ = table;
+#if !defined(NDEBUG)
+        descriptions_.clear();
+#endif
+    }
+
+    /**
+     * @brief Return the current dispatch table.
+     */
+    const DispatchTable& dispatchTable() const noexcept { return dispatch_; }
+
+    /**
+     * @brief Return the description of the handler for a command. Descriptions are only kept in debug builds.
+     */
+    std::string description([[maybe_unused]] Command command) const {
+#if !defined(NDEBUG)
+        auto it = descriptions_.find(command);
+        if (it != descriptions_.end()) {
+            return it->second;
         }
-        handlers_[index] = CommandHandler{ .command = command, .description = description, .handler = handler };
+#endif
+        return std::string();
     }
 
 
     /**
      * @brief try to call the appropriate handler for a message.
+     *
+     * @param command The command of the message.
+     * @param sender  The address of the sender.
+     * @param data    A view of the payload, only valid for the duration of the call.
      */
-    void handle(Command command, uint8_t sender, const std::vector<uint8_t>& data) {
-        handler(command) (command, sender, data);
+    void handle(Command command, uint8_t sender, std::span<const uint8_t> data) {
+        util::TraceScope trace(util::TracePoint::Handler, toInt(command));
+        if (!dispatch_.dispatch(command, sender, data)) {
+            noopHandler(command, sender, data);
+        }
     }
 
     /**
@@ -191,55 +328,233 @@ public:
     }
 
     /**
-     * @brief Check if there are incoming messages in the queue.
+     * @brief Send a message.
+     *
+     * @param command The command to send.
+     * @param address The address to send it to.
+     * @param payload A view of the payload of the message.
+     */
+    bool sendMessage(Command command, uint8_t address, std::span<const uint8_t> payload) {
+        return sendMessage(command, address, std::span<uint8_t>(const_cast<uint8_t*>(payload.data()), payload.size()));
+    }
+
+    /**
+     * @brief Check if there are incoming messages in the queue, after collecting any the interfaces still hold.
       */
-    bool haveIncoming() { return incoming_.haveMessages(); }
+    bool haveIncoming() {
+        pollIncoming();
+        return incoming_.haveMessages();
+    }
 
     /**
      * @brief Add a message to the incoming queue.
      *
-     * @param command The command of the message.
-     * @param address The address of the sender.
-     * @param data    The payload of the message.
+     * @param command     The command of the message.
+     * @param address     The address of the sender.
+     * @param data        The payload of the message.
+     * @param generalCall If the message was sent to the General Call address, so it does not count against our credit.
      */
-    void pushIncoming(protocols::Command command, uint8_t address, const std::span<uint8_t> data) {
+    void pushIncoming(protocols::Command command, uint8_t address, std::span<const uint8_t> data, bool generalCall = false) {
+        util::Trace::instant(util::TracePoint::MessageReceived, toInt(command));
         incoming_.push(command, address, data);
+        metrics_.received(command, data.size(), incoming_.size());
+        if (!generalCall && (address == creditAddress_)) {
+            creditReceived_.store(creditReceived_.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+        }
+        if (incomingNotify_ != nullptr) {
+            incomingNotify_(incomingContext_);
+        }
     }
 
     /**
-     * @brief Process all messagesin the incoming queue.
+     * @brief Set a function to call whenever a message is added to the incoming queue, for example to wake an event
+     *        loop. It may be called from an interrupt handler or another thread, so it must be safe for that.
+     *
+     * @param notify  The function, or nullptr to remove it.
+     * @param context The argument to pass to it.
+     */
+    void incomingNotify(void (*notify)(void* context), void* context) noexcept {
+        incomingNotify_ = notify;
+        incomingContext_ = context;
+    }
+
+    /**
+     * @brief Process all messagesin the incoming queue. If credit is advertised, and messages from the bus controller
+     *        were received since the last advertisement, a new "Credit" message is sent.
      */
     void processIncoming() {
-        incoming_.processAll([this](Command command, uint8_t address, const std::vector<uint8_t>& data) {
+        pollIncoming();
+        incoming_.processAll([this](Command command, uint8_t address, std::span<const uint8_t> data) {
             handle(command, address, data);
         });
+        if (creditAddress_ >= 0) {
+            const auto received = creditReceived_.load(std::memory_order_acquire);
+            if (received != creditAdvertised_) {
+                sendCredit(static_cast<uint8_t>(creditAddress_), received);
+            }
+        }
+    }
+
+    /**
+     * @brief Return the number of messages the incoming queue has room for, limited to what a "Credit" message can carry.
+     */
+    uint8_t incomingSlots() {
+        const std::size_t capacity = incoming_.capacity();
+        if (capacity == 0) {
+            return 0xff;
+        }
+        const std::size_t used = incoming_.size();
+
+        return static_cast<uint8_t>(std::min<std::size_t>((used < capacity) ? (capacity - used) : 0, 0xff));
     }
 
     /**
-      * @brief Check if there are messages in the outgoing queue.
+     * @brief Send a "Credit" message with the free space in the incoming queue to the bus controller.
+     *
+     * @param controller The address of the bus controller.
+     * @param received   The number of messages received from it so far, modulo 256.
+     */
+    bool sendCredit(uint8_t controller, uint8_t received) {
+        MsgCredit msg{ incomingSlots(), received };
+        creditAdvertised_ = received;
+
+        return sendMessage(Command::Credit, controller, msg);
+    }
+
+    /**
+     * @brief Send the trace events recorded so far as one or more "Log" messages, for example to let a Pico report to
+     *        the bus controller, which can collect them with a RemoteTraces.
+     *
+     * @return true if all pages were sent.
+     */
+    bool sendTrace(uint8_t address) {
+        const auto events = util::Trace::snapshot();
+
+        std::array<uint8_t, MaxPayloadSize> page;
+        std::size_t cursor{ 0 };
+        uint8_t number{ 0 };
+        bool success{ true };
+        do {
+            const auto size = encodeTrace(events, cursor, number, page);
+            success = sendMessage(Command::Log, address, std::span<uint8_t>(page.data(), size)) && success;
+        } while (cursor < events.size());
+
+        return success;
+    }
+
+    /**
+     * @brief Advertise the free space in the incoming queue to the bus controller, so it can pace the messages it sends
+     *        us. An initial "Credit" message is sent immediately.
+     *
+     * @param controller The address of the bus controller, or -1 to stop advertising.
+     */
+    void advertiseCredit(int controller) {
+        creditAddress_ = controller;
+        if (controller >= 0) {
+            sendCredit(static_cast<uint8_t>(controller), creditReceived_.load(std::memory_order_acquire));
+        }
+    }
+
+    /**
+     * @brief Handle a "Credit" message from a listener.
+     */
+    void handleCredit([[maybe_unused]] Command command, uint8_t sender, std::span<const uint8_t> data) {
+        if (data.size() < sizeMsgCredit) {
+            log(std::format("Ignoring short Credit message from 0x{:02x}.", sender));
+            return;
+        }
+        MsgCredit msg;
+        std::memcpy(&msg, data.data(), sizeMsgCredit);
+        flowControl_.credit(sender, msg, RaspberryPi::timeUs());
+    }
+
+    /**
+     * @brief Enable or disable pacing outgoing messages by the credit listeners advertise. Enabling it registers the
+     *        handler for "Credit" messages.
+     */
+    void flowControl(bool enabled) {
+        pacing_ = enabled;
+        if (enabled) {
+            registerHandler<&ProtocolDriver::handleCredit>(Command::Credit, "Flow control credit", *this);
+        }
+    }
+
+    /**
+     * @brief Return the credit administration, for configuration or to forget a board that restarted.
+     */
+    FlowControl& flowControl() noexcept { return flowControl_; }
+    const FlowControl& flowControl() const noexcept { return flowControl_; }
+
+    /**
+     * @brief Return the incoming queue, for configuration.
+     */
+    QueueImpl& incoming() noexcept { return incoming_; }
+
+    /**
+     * @brief Return the outgoing queue, for configuration such as priority lanes.
+     */
+    OutQueueImpl& outgoing() noexcept { return outgoing_; }
+
+    /**
+     * @brief Return the metrics of this driver. Sent messages are counted by the implementation of sendMessage().
+     */
+    ProtocolMetrics& metrics() noexcept { return metrics_; }
+    const ProtocolMetrics& metrics() const noexcept { return metrics_; }
+
+    /**
+     * @brief Return the number of messages waiting in the incoming queue.
+     */
+    std::size_t incomingDepth() { return incoming_.size(); }
+
+    /**
+     * @brief Return the number of messages waiting in the outgoing queue, including those held back for lack of credit.
+     */
+    std::size_t outgoingDepth() { return outgoing_.size() + deferred_.size(); }
+
+    /**
+      * @brief Check if there are messages in the outgoing queue, or held back for lack of credit.
       */
-    bool haveOutgoing() const { return outgoing_.haveMessages(); }
+    bool haveOutgoing() { return outgoing_.haveMessages() || deferred_.haveMessages(); }
 
     /**
-     * @brief Add a message to the outgoing queue.
+     * @brief Add a message to the outgoing queue. This may be called from another thread or core, if the queue allows
+     *        that, so the high-water mark is left to processOutgoing().
      *
      * @param command The command of the message.
      * @param address The address of the recipient.
      * @param data    The payload of the message.
      */
-    void pushOutgoing(protocols::Command command, uint8_t address, std::span<uint8_t> data) {
+    void pushOutgoing(protocols::Command command, uint8_t address, std::span<const uint8_t> data) {
         outgoing_.push(command, address, data);
     }
 
     /**
-     * @brief Process all messages in the outgoing queue.
+     * @brief Process all messages in the outgoing queue. With flow control enabled, messages to an address without
+     *        credit are held back. They are retried first on the next call, and while an address has a message held
+     *        back, later messages to it are held back behind it, so messages to one address are never reordered.
      */
     void processOutgoing() {
-        outgoing_.processAll([this](Command command, uint8_t address, const std::vector<uint8_t>& data) {
-            if (!sendMessage(command, address, data) && verbose()) {
-                log(std::format("Failed to send {} to {}, no response.\n", toInt(command), address));
-            }
+        metrics_.queued(outgoing_.size());
+        if (!pacing_) {
+            outgoing_.processAll([this](Command command, uint8_t address, std::span<const uint8_t> data) {
+                sendOutgoing(command, address, data);
+            });
+            flushOutgoing();
+            return;
+        }
+        const uint64_t now = RaspberryPi::timeUs();
+        std::bitset<128> held;
+
+        util::MessageQueue::Queue slot;
+        for (auto retries = deferred_.size(); (retries > 0) && deferred_.pop(slot); --retries) {
+            const auto& msg = slot.front();
+            pace(msg.command, msg.sender, std::span<const uint8_t>(msg.data), now, held);
+            deferred_.release(slot);
+        }
+        outgoing_.processAll([this, now, &held](Command command, uint8_t address, std::span<const uint8_t> data) {
+            pace(command, address, data, now, held);
         });
+        flushOutgoing();
     }
 };
 
@@ -0,0 +1,508 @@
+#pragma once
+/*
+ * Copyright (c) 2024 by Bert Laverman. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#include <bit>
+#include <algorithm>
+#include <span>
+#include <array>
+#include <atomic>
+
+#include <protocols/messages.hpp>
+
+
+namespace nl::rakis::raspberrypi::protocols {
+
+
+/**
+ * @brief A counter that can be read from any thread or core without locking. On the Pico, which has no atomic
+ *        read-modify-write instructions, every counter must have a single writer, such as the interrupt handler for
+ *        received messages, or the main loop for sent ones.
+ */
+class Counter {
+    std::atomic<uint32_t> value_{ 0 };
+
+public:
+    Counter() = default;
+    Counter(const Counter&) = delete;
+    Counter(Counter&&) = delete;
+    ~Counter() = default;
+
+    Counter& operator=(const Counter&) = delete;
+    Counter& operator=(Counter&&) = delete;
+
+    /**
+     * @brief Add to the counter. It wraps around at 2^32.
+     */
+    void add(uint32_t n =1) noexcept {
+#if defined(TARGET_PICO)
+        value_.store(value_.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+#else
+        value_.fetch_add(n, std::memory_order_relaxed);
+#endif
+    }
+
+    /**
+     * @brief Raise the value to the given one, if that is higher. Used for high-water marks.
+     */
+    void raise(uint32_t value) noexcept {
+        if (value > value_.load(std::memory_order_relaxed)) {
+            value_.store(value, std::memory_order_relaxed);
+        }
+    }
+
+    /**
+     * @brief Return the current value.
+     */
+    uint32_t value() const noexcept { return value_.load(std::memory_order_relaxed); }
+
+    /**
+     * @brief Set the counter back to zero. An increment happening at the same time may be lost.
+     */
+    void reset() noexcept { value_.store(0, std::memory_order_relaxed); }
+};
+
+
+/**
+ * @brief A histogram of latencies in microseconds, using powers of two as bucket limits. Bucket 0 counts latencies
+ *        of 0 µs, bucket n those from 2^(n-1) up to 2^n µs, and the last one everything from 16 ms up.
+ */
+class LatencyHistogram {
+public:
+    static constexpr unsigned Buckets = 16;
+
+private:
+    std::array<Counter, Buckets> buckets_;
+
+public:
+    LatencyHistogram() = default;
+    LatencyHistogram(const LatencyHistogram&) = delete;
+    LatencyHistogram(LatencyHistogram&&) = delete;
+    ~LatencyHistogram() = default;
+
+    LatencyHistogram& operator=(const LatencyHistogram&) = delete;
+    LatencyHistogram& operator=(LatencyHistogram&&) = delete;
+
+    /**
+     * @brief Return the bucket a latency is counted in.
+     */
+    static constexpr unsigned bucket(uint32_t us) noexcept {
+        const unsigned width = std::bit_width(us);
+        return (width < Buckets) ? width : (Buckets - 1);
+    }
+
+    /**
+     * @brief Return the (exclusive) upper limit of a bucket in microseconds, or 0 for the last one, which has none.
+     */
+    static constexpr uint32_t limit(unsigned bucket) noexcept {
+        return (bucket < (Buckets - 1)) ? (uint32_t(1) << bucket) : 0;
+    }
+
+    void record(uint32_t us) noexcept { buckets_[bucket(us)].add(); }
+
+    uint32_t count(unsigned bucket) const noexcept { return buckets_[bucket].value(); }
+
+    /**
+     * @brief Return the total number of latencies recorded.
+     */
+    uint32_t total() const noexcept {
+        uint32_t result{ 0 };
+        for (const auto& bucket : buckets_) {
+            result += bucket.value();
+        }
+        return result;
+    }
+
+    /**
+     * @brief Return the bucket holding the given percentile, or 0 if nothing was recorded.
+     */
+    unsigned percentile(unsigned percent) const noexcept {
+        const uint64_t wanted = (uint64_t(total()) * percent + 99) / 100;
+        uint64_t seen{ 0 };
+
+        for (unsigned i = 0; i < Buckets; ++i) {
+            seen += buckets_[i].value();
+            if ((seen >= wanted) && (seen > 0)) {
+                return i;
+            }
+        }
+        return 0;
+    }
+
+    void reset() noexcept {
+        for (auto& bucket : buckets_) {
+            bucket.reset();
+        }
+    }
+};
+
+
+/**
+ * @brief The metrics kept per command. Messages are counted after unpacking, so a "Batch" counts as the messages in it
+ *        on the receiving side, and as one message on the sending side.
+ */
+struct CommandMetrics {
+    Counter sent;
+    Counter sentBytes;
+    Counter received;
+    Counter receivedBytes;
+
+    /**
+     * @brief Sends that failed, usually because nobody acknowledged the address.
+     */
+    Counter nacks;
+
+    /**
+     * @brief The time it took to send a message, including any time spent in an asynchronous transmit queue.
+     */
+    LatencyHistogram latency;
+
+    bool active() const noexcept { return (sent.value() != 0) || (received.value() != 0) || (nacks.value() != 0); }
+
+    void reset() noexcept {
+        sent.reset();
+        sentBytes.reset();
+        received.reset();
+        receivedBytes.reset();
+        nacks.reset();
+        latency.reset();
+    }
+};
+
+
+/**
+ * @brief The metrics a ProtocolDriver keeps. Commands below TrackedCommands get their own counters, all others share
+ *        a single "other" set.
+ */
+class ProtocolMetrics {
+public:
+    static constexpr unsigned TrackedCommands = 0x20;
+
+private:
+    std::array<CommandMetrics, TrackedCommands + 1> commands_;
+
+    Counter incomingHighWater_;
+    Counter outgoingHighWater_;
+    Counter dropped_;
+
+public:
+    ProtocolMetrics() = default;
+    ProtocolMetrics(const ProtocolMetrics&) = delete;
+    ProtocolMetrics(ProtocolMetrics&&) = delete;
+    ~ProtocolMetrics() = default;
+
+    ProtocolMetrics& operator=(const ProtocolMetrics&) = delete;
+    ProtocolMetrics& operator=(ProtocolMetrics&&) = delete;
+
+    /**
+     * @brief Return the index of the counters used for a command.
+     */
+    static constexpr unsigned slot(Command command) noexcept {
+        return (toInt(command) < TrackedCommands) ? toInt(command) : TrackedCommands;
+    }
+
+    CommandMetrics& command(Command command) noexcept { return commands_[slot(command)]; }
+    const CommandMetrics& command(Command command) const noexcept { return commands_[slot(command)]; }
+
+    /**
+     * @brief Return the counters at a slot. The last slot holds all commands from TrackedCommands up.
+     */
+    const CommandMetrics& at(unsigned slot) const noexcept { return commands_[slot]; }
+
+    /**
+     * @brief Count a message that was received and queued.
+     */
+    void received(Command command, std::size_t bytes, std::size_t queueDepth) noexcept {
+        auto& metrics = this->command(command);
+        metrics.received.add();
+        metrics.receivedBytes.add(static_cast<uint32_t>(bytes));
+        incomingHighWater_.raise(static_cast<uint32_t>(queueDepth));
+    }
+
+    /**
+     * @brief Count a message that was sent, or that nobody acknowledged.
+     */
+    void sent(Command command, std::size_t bytes, bool success, uint32_t latencyUs) noexcept {
+        auto& metrics = this->command(command);
+        if (success) {
+            metrics.sent.add();
+            metrics.sentBytes.add(static_cast<uint32_t>(bytes));
+        } else {
+            metrics.nacks.add();
+        }
+        metrics.latency.record(latencyUs);
+    }
+
+    /**
+     * @brief Note the depth of the outgoing queue before it is processed, which is when it is deepest. Only the thread
+     *        processing the queue calls this, so the high-water mark has a single writer even when other threads or
+     *        the other core add messages.
+     */
+    void queued(std::size_t queueDepth) noexcept { outgoingHighWater_.raise(static_cast<uint32_t>(queueDepth)); }
+
+    /**
+     * @brief Count an outgoing message that could not be sent or queued at all.
+     */
+    void dropped() noexcept { dropped_.add(); }
+
+    uint32_t incomingHighWater() const noexcept { return incomingHighWater_.value(); }
+    uint32_t outgoingHighWater() const noexcept { return outgoingHighWater_.value(); }
+    uint32_t drops() const noexcept { return dropped_.value(); }
+
+    void reset() noexcept {
+        for (auto& metrics : commands_) {
+            metrics.reset();
+        }
+        incomingHighWater_.reset();
+        outgoingHighWater_.reset();
+        dropped_.reset();
+    }
+};
+
+
+/**
+ * @brief The metrics an interface, such as an I2C bus, keeps of the frames it transfers.
+ */
+struct LinkMetrics {
+    Counter framesReceived;
+    Counter bytesReceived;
+
+    /**
+     * @brief Frames dropped because of a failed checksum or CRC, or an unknown integrity check.
+     */
+    Counter integrityFailures;
+
+    /**
+     * @brief Frames dropped because they were cut short, or a "Batch" in them was malformed.
+     */
+    Counter malformed;
+
+    /**
+     * @brief Frames dropped because there was no room to receive them, as earlier ones were not processed yet.
+     */
+    Counter overruns;
+
+    Counter writes;
+    Counter bytesWritten;
+
+    /**
+     * @brief Writes that failed, usually because nobody acknowledged the address.
+     */
+    Counter nacks;
+
+    void received(std::size_t bytes) noexcept {
+        framesReceived.add();
+        bytesReceived.add(static_cast<uint32_t>(bytes));
+    }
+
+    void written(std::size_t bytes, bool success) noexcept {
+        if (success) {
+            writes.add();
+            bytesWritten.add(static_cast<uint32_t>(bytes));
+        } else {
+            nacks.add();
+        }
+    }
+
+    void reset() noexcept {
+        framesReceived.reset();
+        bytesReceived.reset();
+        integrityFailures.reset();
+        malformed.reset();
+        overruns.reset();
+        writes.reset();
+        bytesWritten.reset();
+        nacks.reset();
+    }
+};
+
+
+/*
+ * Metrics are exported as pages, each a "Log" message, with all values in little endian:
+ *
+ *   LogKind::Metrics, the slot of the first record, the number of records, and flags (MetricsLastPage)
+ *   a summary, only on the first page
+ *   records, one per command that saw any traffic
+ */
+
+inline constexpr uint8_t MetricsLastPage = 0x01;
+
+inline constexpr unsigned sizeMetricsHeader = 4;
+
+/**
+ * @brief The totals sent on the first page of exported metrics.
+ */
+struct MetricsSummary {
+    uint16_t incomingHighWater;
+    uint16_t outgoingHighWater;
+    uint32_t dropped;
+    uint32_t framesReceived;
+    uint32_t integrityFailures;
+    uint32_t malformed;
+    uint32_t nacks;
+};
+inline constexpr unsigned sizeMetricsSummary = 2 * sizeof(uint16_t) + 5 * sizeof(uint32_t);
+
+/**
+ * @brief The exported metrics of a single command. The command is the slot, so ProtocolMetrics::TrackedCommands
+ *        stands for all others. The latencies are bucket numbers of the LatencyHistogram.
+ */
+struct MetricsRecord {
+    uint8_t command;
+    uint32_t sent;
+    uint32_t sentBytes;
+    uint32_t received;
+    uint32_t receivedBytes;
+    uint32_t nacks;
+    uint8_t latencyP50;
+    uint8_t latencyP99;
+};
+inline constexpr unsigned sizeMetricsRecord = 3 * sizeof(uint8_t) + 5 * sizeof(uint32_t);
+
+
+namespace metrics_detail {
+
+template <typename T>
+inline uint8_t* put(uint8_t* pos, T value) noexcept {
+    for (unsigned i = 0; i < sizeof(T); ++i) {
+        *pos++ = static_cast<uint8_t>(value >> (8 * i));
+    }
+    return pos;
+}
+
+template <typename T>
+inline const uint8_t* get(const uint8_t* pos, T& value) noexcept {
+    value = 0;
+    for (unsigned i = 0; i < sizeof(T); ++i) {
+        value |= static_cast<T>(static_cast<T>(*pos++) << (8 * i));
+    }
+    return pos;
+}
+
+} // namespace metrics_detail
+
+
+/**
+ * @brief Write a page of metrics as the body of a "Log" message. Start with a cursor of 0, and call it again with the
+ *        updated cursor until it is beyond ProtocolMetrics::TrackedCommands, which is the case after the last page.
+ *
+ * @param metrics  The metrics of the protocol driver.
+ * @param incoming The metrics of the interface messages are received on.
+ * @param outgoing The metrics of the interface messages are sent on.
+ * @param cursor   The slot to start from, updated to the one to start the next page from.
+ * @param out      The buffer for the page.
+ * @return The number of bytes written.
+ */
+inline std::size_t encodeMetrics(const ProtocolMetrics& metrics, const LinkMetrics& incoming, const LinkMetrics& outgoing,
+                                 unsigned& cursor, std::span<uint8_t, MaxPayloadSize> out) noexcept
+{
+    using metrics_detail::put;
+
+    uint8_t* pos = out.data() + sizeMetricsHeader;
+    out[0] = toInt(LogKind::Metrics);
+    out[1] = static_cast<uint8_t>(cursor);
+
+    if (cursor == 0) {
+        pos = put<uint16_t>(pos, static_cast<uint16_t>(std::min<uint32_t>(metrics.incomingHighWater(), 0xffff)));
+        pos = put<uint16_t>(pos, static_cast<uint16_t>(std::min<uint32_t>(metrics.outgoingHighWater(), 0xffff)));
+        pos = put<uint32_t>(pos, metrics.drops());
+        pos = put<uint32_t>(pos, incoming.framesReceived.value());
+        pos = put<uint32_t>(pos, incoming.integrityFailures.value());
+        pos = put<uint32_t>(pos, incoming.malformed.value());
+        pos = put<uint32_t>(pos, outgoing.nacks.value());
+    }
+
+    uint8_t records{ 0 };
+    const uint8_t* end = out.data() + out.size();
+    for (; cursor <= ProtocolMetrics::TrackedCommands; ++cursor) {
+        const auto& command = metrics.at(cursor);
+        if (!command.active()) {
+            continue;
+        }
+        if ((end - pos) < static_cast<std::ptrdiff_t>(sizeMetricsRecord)) {
+            break;
+        }
+        pos = put<uint8_t>(pos, static_cast<uint8_t>(cursor));
+        pos = put<uint32_t>(pos, command.sent.value());
+        pos = put<uint32_t>(pos, command.sentBytes.value());
+        pos = put<uint32_t>(pos, command.received.value());
+        pos = put<uint32_t>(pos, command.receivedBytes.value());
+        pos = put<uint32_t>(pos, command.nacks.value());
+        pos = put<uint8_t>(pos, static_cast<uint8_t>(command.latency.percentile(50)));
+        pos = put<uint8_t>(pos, static_cast<uint8_t>(command.latency.percentile(99)));
+        records++;
+    }
+    out[2] = records;
+    out[3] = (cursor > ProtocolMetrics::TrackedCommands) ? MetricsLastPage : 0x00;
+
+    return static_cast<std::size_t>(pos - out.data());
+}
+
+/**
+ * @brief Read a page of metrics from the body of a "Log" message.
+ *
+ * @param onSummary Called with the summary, if this is the first page.
+ * @param onRecord  Called for each record.
+ * @return false if this is not a (complete) metrics page.
+ */
+template <typename SummaryHandler, typename RecordHandler>
+bool decodeMetrics(std::span<const uint8_t> data, SummaryHandler onSummary, RecordHandler onRecord)
+{
+    using metrics_detail::get;
+
+    if ((data.size() < sizeMetricsHeader) || (data[0] != toInt(LogKind::Metrics))) {
+        return false;
+    }
+    const bool first = (data[1] == 0);
+    const unsigned records = data[2];
+    if (data.size() != (sizeMetricsHeader + (first ? sizeMetricsSummary : 0) + records * sizeMetricsRecord)) {
+        return false;
+    }
+
+    const uint8_t* pos = data.data() + sizeMetricsHeader;
+    if (first) {
+        MetricsSummary summary;
+        pos = get(pos, summary.incomingHighWater);
+        pos = get(pos, summary.outgoingHighWater);
+        pos = get(pos, summary.dropped);
+        pos = get(pos, summary.framesReceived);
+        pos = get(pos, summary.integrityFailures);
+        pos = get(pos, summary.malformed);
+        pos = get(pos, summary.nacks);
+        onSummary(summary);
+    }
+    for (unsigned i = 0; i < records; ++i) {
+        MetricsRecord record;
+        pos = get(pos, record.command);
+        pos = get(pos, record.sent);
+        pos = get(pos, record.sentBytes);
+        pos = get(pos, record.received);
+        pos = get(pos, record.receivedBytes);
+        pos = get(pos, record.nacks);
+        pos = get(pos, record.latencyP50);
+        pos = get(pos, record.latencyP99);
+        onRecord(record);
+    }
+    return true;
+}
+
+} // namespace nl::rakis::raspberrypi::protocols
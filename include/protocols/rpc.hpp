@@ -0,0 +1,398 @@
+#pragma once
+/*
+ * Copyright (c) 2024 by Bert Laverman. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#include <map>
+#include <span>
+#include <array>
+#include <vector>
+#include <format>
+#include <ranges>
+#include <functional>
+#include <type_traits>
+#if !defined(TARGET_PICO)
+#include <memory>
+#include <future>
+#endif
+
+#include <raspberry-pi.hpp>
+#include <util/verbose-component.hpp>
+#include <protocols/messages.hpp>
+#include <protocols/protocol-driver.hpp>
+
+
+namespace nl::rakis::raspberrypi::protocols {
+
+
+/**
+ * @brief The outcome of a remote procedure call.
+ */
+enum class RpcStatus : uint8_t {
+    Ok                  = 0x00,
+    UnknownCommand      = 0x01,     // The receiver has no responder for the command
+    Failed              = 0x02,     // The responder could not handle the request
+    Timeout             = 0xff,     // No reply arrived in time. Never sent, only reported locally.
+};
+
+/**
+ * @brief The start of the body of a "Request" message.
+ */
+struct MsgRequest {
+    uint8_t correlationId;
+    uint8_t command;
+};
+inline constexpr unsigned sizeMsgRequest = 2 * sizeof(uint8_t);
+
+/**
+ * @brief The start of the body of a "Reply" message.
+ */
+struct MsgReply {
+    uint8_t correlationId;
+    uint8_t command;
+    uint8_t status;
+};
+inline constexpr unsigned sizeMsgReply = 3 * sizeof(uint8_t);
+
+
+/**
+ * @brief Called with the outcome of a request. The body is only valid for the duration of the call.
+ */
+using ReplyCallback = std::function<void(RpcStatus status, uint8_t sender, std::span<const uint8_t> body)>;
+
+
+/**
+ * @brief The client side of remote procedure calls: it sends "Request" messages and matches the "Reply" messages that
+ *        arrive on the listening bus to them.
+ *
+ * Requests do not wait for their reply, so any number (up to 256) can be in flight at the same time, to the same or to
+ * different listeners. Replies are matched on correlation id, sender, and command. Requests that are not answered in
+ * time are completed with RpcStatus::Timeout by expire(), which should be called regularly from the main loop.
+ *
+ * @tparam Driver The ProtocolDriver used to send requests and receive replies.
+ */
+template <class Driver>
+class RpcClient : public util::VerboseComponent {
+    struct Pending {
+        bool active{ false };
+        uint8_t address{ 0 };
+        Command command{ Command::Hello };
+        uint64_t deadline{ 0 };
+        ReplyCallback callback;
+    };
+
+    Driver& driver_;
+    std::array<Pending, 256> pending_;
+    uint8_t nextId_{ 0 };
+    unsigned inFlight_{ 0 };
+    uint32_t timeoutMs_{ 100 };
+
+    /**
+     * @brief Complete a pending request. The entry is freed before the callback runs, so the callback may send new requests.
+     */
+    void complete(Pending& pending, RpcStatus status, uint8_t sender, std::span<const uint8_t> body) {
+        ReplyCallback callback = std::move(pending.callback);
+        pending.active = false;
+        pending.callback = nullptr;
+        inFlight_--;
+
+        if (callback) {
+            callback(status, sender, body);
+        }
+    }
+
+public:
+    explicit RpcClient(Driver& driver) : driver_(driver) {}
+    ~RpcClient() = default;
+
+    RpcClient(const RpcClient&) = delete;
+    RpcClient(RpcClient&&) = delete;
+    RpcClient& operator=(const RpcClient&) = delete;
+    RpcClient& operator=(RpcClient&&) = delete;
+
+    /**
+     * @brief Register the reply handler with the driver.
+     */
+    void registerAt() {
+        driver_.template registerHandler<&RpcClient::handleReply>(Command::Reply, "RPC reply handler", *this);
+    }
+
+    /**
+     * @brief Set the default timeout for requests, in milliseconds.
+     */
+    void timeoutMs(uint32_t timeout) noexcept { timeoutMs_ = timeout; }
+
+    /**
+     * @brief Return the default timeout for requests, in milliseconds.
+     */
+    uint32_t timeoutMs() const noexcept { return timeoutMs_; }
+
+    /**
+     * @brief Return the number of requests waiting for a reply.
+     */
+    unsigned inFlight() const noexcept { return inFlight_; }
+
+    /**
+     * @brief Send a request.
+     *
+     * @param address   The address of the listener to ask.
+     * @param command   The command to call.
+     * @param body      The body of the request.
+     * @param callback  Called with the reply, or with RpcStatus::Timeout.
+     * @param timeoutMs The timeout in milliseconds, or 0 for the default.
+     * @return false if the request could not be sent, in which case the callback is not called.
+     */
+    bool request(uint8_t address, Command command, std::span<const uint8_t> body, ReplyCallback callback, uint32_t timeoutMs = 0) {
+        if (body.size() > (MaxPayloadSize - sizeMsgRequest)) {
+            log(std::format("Request body of {} bytes is too large.", body.size()));
+            return false;
+        }
+        if (inFlight_ == pending_.size()) {
+            log("Too many requests in flight.");
+            return false;
+        }
+        while (pending_[nextId_].active) {
+            nextId_++;
+        }
+        const uint8_t id = nextId_++;
+
+        std::array<uint8_t, MaxPayloadSize> payload;
+        payload[0] = id;
+        payload[1] = toInt(command);
+        std::memcpy(payload.data() + sizeMsgRequest, body.data(), body.size());
+
+        Pending& pending = pending_[id];
+        pending.active = true;
+        pending.address = address;
+        pending.command = command;
+        pending.deadline = RaspberryPi::timeUs() + 1000 * uint64_t((timeoutMs == 0) ? timeoutMs_ : timeoutMs);
+        pending.callback = std::move(callback);
+        inFlight_++;
+
+        if (!driver_.sendMessage(Command::Request, address, std::span<const uint8_t>(payload.data(), sizeMsgRequest + body.size()))) {
+            pending.active = false;
+            pending.callback = nullptr;
+            inFlight_--;
+
+            return false;
+        }
+        return true;
+    }
+
+    /**
+     * @brief Send a request with a message as body. Containers such as std::vector or std::array go to the overload
+     *        taking a span, so their contents are sent rather than the container object itself.
+     */
+    template <class Msg>
+        requires (std::is_trivially_copyable_v<Msg> && !std::ranges::contiguous_range<Msg>)
+    bool request(uint8_t address, Command command, const Msg& msg, ReplyCallback callback, uint32_t timeoutMs = 0) {
+        return request(address, command, std::span<const uint8_t>(reinterpret_cast<const uint8_t*>(&msg), sizeof(Msg)), std::move(callback), timeoutMs);
+    }
+
+#if !defined(TARGET_PICO)
+    /**
+     * @brief A reply, as delivered through a future.
+     */
+    struct Reply {
+        RpcStatus status{ RpcStatus::Timeout };
+        uint8_t sender{ 0 };
+        std::vector<uint8_t> body;
+    };
+
+    /**
+     * @brief Send a request, and return a future for the reply. The future is only completed by processing incoming
+     *        messages and calling expire(), so do not wait on it from the thread that does that.
+     *
+     * @return A future for the reply, which is already complete with RpcStatus::Failed if sending failed.
+     */
+    std::future<Reply> request(uint8_t address, Command command, std::span<const uint8_t> body, uint32_t timeoutMs = 0) {
+        auto promise = std::make_shared<std::promise<Reply>>();
+        auto result = promise->get_future();
+
+        const bool sent = request(address, command, body, [promise](RpcStatus status, uint8_t sender, std::span<const uint8_t> data) {
+            promise->set_value(Reply{ status, sender, std::vector<uint8_t>(data.begin(), data.end()) });
+        }, timeoutMs);
+        if (!sent) {
+            promise->set_value(Reply{ RpcStatus::Failed, address, {} });
+        }
+        return result;
+    }
+#endif
+
+    /**
+     * @brief Complete all requests whose deadline has passed with RpcStatus::Timeout.
+     */
+    void expire() {
+        if (inFlight_ == 0) {
+            return;
+        }
+        const uint64_t now = RaspberryPi::timeUs();
+        for (auto& pending : pending_) {
+            if (pending.active && (now >= pending.deadline)) {
+                if (verbose()) {
+                    log(std::format("Request for command {} to 0x{:02x} timed out.", toInt(pending.command), pending.address));
+                }
+                complete(pending, RpcStatus::Timeout, pending.address, {});
+            }
+        }
+    }
+
+    /**
+     * @brief Handle an incoming "Reply" message.
+     */
+    void handleReply([[maybe_unused]] Command command, uint8_t sender, std::span<const uint8_t> data) {
+        if (data.size() < sizeMsgReply) {
+            log(std::format("Ignoring short reply from 0x{:02x}.", sender));
+            return;
+        }
+        Pending& pending = pending_[data[0]];
+        if (!pending.active || (toInt(pending.command) != data[1]) ||
+            ((pending.address != sender) && (pending.address != GeneralCallAddress)))
+        {
+            if (verbose()) {
+                log(std::format("Ignoring unexpected reply {} from 0x{:02x}.", data[0], sender));
+            }
+            return;
+        }
+        complete(pending, static_cast<RpcStatus>(data[2]), sender, data.subspan(sizeMsgReply));
+    }
+};
+
+
+/**
+ * @brief Collects the body of a reply. Responders append to it, and the server sends it when the responder returns.
+ */
+class RpcReplyBuffer {
+    std::array<uint8_t, MaxPayloadSize> data_;
+    std::size_t size_{ sizeMsgReply };
+
+public:
+    RpcReplyBuffer() = default;
+
+    /**
+     * @brief Return the number of bytes that can still be added.
+     */
+    std::size_t available() const noexcept { return data_.size() - size_; }
+
+    /**
+     * @brief Append bytes to the reply.
+     *
+     * @return false if they do not fit, in which case nothing is added.
+     */
+    bool append(std::span<const uint8_t> bytes) noexcept {
+        if (bytes.size() > available()) {
+            return false;
+        }
+        std::memcpy(data_.data() + size_, bytes.data(), bytes.size());
+        size_ += bytes.size();
+
+        return true;
+    }
+
+    /**
+     * @brief Append a message to the reply.
+     */
+    template <class Msg>
+    bool append(const Msg& msg) noexcept {
+        return append(std::span<const uint8_t>(reinterpret_cast<const uint8_t*>(&msg), sizeof(Msg)));
+    }
+
+    /**
+     * @brief Fill in the reply header and return the complete payload.
+     */
+    std::span<const uint8_t> seal(uint8_t correlationId, uint8_t command, RpcStatus status) noexcept {
+        data_[0] = correlationId;
+        data_[1] = command;
+        data_[2] = static_cast<uint8_t>(status);
+
+        return std::span<const uint8_t>(data_.data(), size_);
+    }
+};
+
+
+/**
+ * @brief Produces the reply to a request.
+ *
+ * @param sender The address of the client.
+ * @param body   The body of the request.
+ * @param reply  The body of the reply.
+ * @return The status to send back.
+ */
+using Responder = std::function<RpcStatus(uint8_t sender, std::span<const uint8_t> body, RpcReplyBuffer& reply)>;
+
+
+/**
+ * @brief The server side of remote procedure calls: it answers "Request" messages using the responder registered for
+ *        the wrapped command, or RpcStatus::UnknownCommand if there is none.
+ *
+ * @tparam Driver The ProtocolDriver used to receive requests and send replies.
+ */
+template <class Driver>
+class RpcServer : public util::VerboseComponent {
+    Driver& driver_;
+    std::map<Command, Responder> responders_;
+
+public:
+    explicit RpcServer(Driver& driver) : driver_(driver) {}
+    ~RpcServer() = default;
+
+    RpcServer(const RpcServer&) = delete;
+    RpcServer(RpcServer&&) = delete;
+    RpcServer& operator=(const RpcServer&) = delete;
+    RpcServer& operator=(RpcServer&&) = delete;
+
+    /**
+     * @brief Register the request handler with the driver.
+     */
+    void registerAt() {
+        driver_.template registerHandler<&RpcServer::handleRequest>(Command::Request, "RPC request handler", *this);
+    }
+
+    /**
+     * @brief Set the responder for a command.
+     */
+    void respond(Command command, Responder responder) { responders_[command] = std::move(responder); }
+
+    /**
+     * @brief Handle an incoming "Request" message, and send the reply.
+     */
+    void handleRequest([[maybe_unused]] Command command, uint8_t sender, std::span<const uint8_t> data) {
+        if (data.size() < sizeMsgRequest) {
+            log(std::format("Ignoring short request from 0x{:02x}.", sender));
+            return;
+        }
+        const uint8_t correlationId = data[0];
+        const Command requested = toCommand(data[1]);
+
+        RpcReplyBuffer reply;
+        RpcStatus status{ RpcStatus::UnknownCommand };
+        if (auto it = responders_.find(requested); it != responders_.end()) {
+            status = it->second(sender, data.subspan(sizeMsgRequest), reply);
+        } else if (verbose()) {
+            log(std::format("No responder for command {} from 0x{:02x}.", data[1], sender));
+        }
+
+        if (!driver_.sendMessage(Command::Reply, sender, reply.seal(correlationId, data[1], status))) {
+            log(std::format("Failed to send reply {} to 0x{:02x}.", correlationId, sender));
+        }
+    }
+};
+
+} // namespace nl::rakis::raspberrypi::protocols
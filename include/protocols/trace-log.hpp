@@ -0,0 +1,181 @@
+#pragma once
+/*
+ * Copyright (c) 2024 by Bert Laverman. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+
+#include <cstddef>
+#include <cstdint>
+
+#include <map>
+#include <span>
+#include <vector>
+#include <format>
+#include <algorithm>
+
+#include <util/trace.hpp>
+#include <util/trace-export.hpp>
+#include <protocols/messages.hpp>
+#include <protocols/protocol-metrics.hpp>
+
+
+namespace nl::rakis::raspberrypi::protocols {
+
+
+/*
+ * Trace events are exported as pages, each a "Log" message, with all values in little endian:
+ *
+ *   LogKind::Trace, the page number modulo 256, the number of events, and flags (TraceFirstPage, TraceLastPage)
+ *   events, each the time, argument, point, phase, and track
+ */
+
+inline constexpr uint8_t TraceLastPage = 0x01;
+inline constexpr uint8_t TraceFirstPage = 0x02;
+
+inline constexpr unsigned sizeTraceHeader = 4;
+
+inline constexpr unsigned sizeTraceRecord = 2 * sizeof(uint32_t) + 3 * sizeof(uint8_t);
+
+
+/**
+ * @brief Write a page of trace events as the body of a "Log" message. Start with a cursor and page of 0, and call it
+ *        again with the updated values until the cursor has reached the end of the events.
+ *
+ * @param events The events, e.g. from util::Trace::snapshot().
+ * @param cursor The index of the first event for this page, updated to the one to start the next page from.
+ * @param page   The number of the page, incremented for the next one.
+ * @param out    The buffer for the page.
+ * @return The number of bytes written.
+ */
+inline std::size_t encodeTrace(std::span<const util::TraceEvent> events, std::size_t& cursor, uint8_t& page,
+                               std::span<uint8_t, MaxPayloadSize> out) noexcept
+{
+    using metrics_detail::put;
+
+    const bool first = (cursor == 0);
+    constexpr std::size_t perPage = (MaxPayloadSize - sizeTraceHeader) / sizeTraceRecord;
+    const std::size_t count = std::min(perPage, events.size() - std::min(cursor, events.size()));
+
+    uint8_t* pos = out.data() + sizeTraceHeader;
+    for (std::size_t i = 0; i < count; ++i) {
+        const auto& event = events[cursor++];
+        pos = put<uint32_t>(pos, event.timeUs);
+        pos = put<uint32_t>(pos, event.arg);
+        pos = put<uint8_t>(pos, util::toInt(event.point));
+        pos = put<uint8_t>(pos, static_cast<uint8_t>(event.phase));
+        pos = put<uint8_t>(pos, event.track);
+    }
+    out[0] = toInt(LogKind::Trace);
+    out[1] = page++;
+    out[2] = static_cast<uint8_t>(count);
+    out[3] = static_cast<uint8_t>(((cursor >= events.size()) ? TraceLastPage : 0x00) | (first ? TraceFirstPage : 0x00));
+
+    return static_cast<std::size_t>(pos - out.data());
+}
+
+/**
+ * @brief Read a page of trace events from the body of a "Log" message.
+ *
+ * @param onEvent Called for each event.
+ * @return false if this is not a (complete) trace page.
+ */
+template <typename EventHandler>
+bool decodeTrace(std::span<const uint8_t> data, EventHandler onEvent)
+{
+    using metrics_detail::get;
+
+    if ((data.size() < sizeTraceHeader) || (data[0] != toInt(LogKind::Trace))) {
+        return false;
+    }
+    const unsigned count = data[2];
+    if (data.size() != (sizeTraceHeader + count * sizeTraceRecord)) {
+        return false;
+    }
+    const uint8_t* pos = data.data() + sizeTraceHeader;
+    for (unsigned i = 0; i < count; ++i) {
+        util::TraceEvent event;
+        uint8_t point;
+        uint8_t phase;
+        pos = get(pos, event.timeUs);
+        pos = get(pos, event.arg);
+        pos = get(pos, point);
+        pos = get(pos, phase);
+        pos = get(pos, event.track);
+        event.point = static_cast<util::TracePoint>(point);
+        event.phase = static_cast<util::TracePhase>(phase);
+        onEvent(event);
+    }
+    return true;
+}
+
+
+/**
+ * @brief Collect the trace events sent by other boards, so the bus controller can write them out together with its
+ *        own. A first page from a board replaces what was collected from it before.
+ */
+class RemoteTraces {
+    std::map<uint8_t, std::vector<util::TraceEvent>> boards_;
+
+public:
+    RemoteTraces() = default;
+    RemoteTraces(const RemoteTraces&) = delete;
+    RemoteTraces(RemoteTraces&&) = default;
+    RemoteTraces& operator=(const RemoteTraces&) = delete;
+    RemoteTraces& operator=(RemoteTraces&&) = default;
+    ~RemoteTraces() = default;
+
+    /**
+     * @brief Take the events from a "Log" message.
+     *
+     * @return false if it was not a trace page, so the caller can try another kind.
+     */
+    bool handleLog(uint8_t sender, std::span<const uint8_t> data) {
+        if ((data.size() >= sizeTraceHeader) && (data[0] == toInt(LogKind::Trace)) && ((data[3] & TraceFirstPage) != 0)) {
+            boards_[sender].clear();
+        }
+        return decodeTrace(data, [this, sender](const util::TraceEvent& event) { boards_[sender].push_back(event); });
+    }
+
+    /**
+     * @brief Handle a raw "Log" message, as received by a ProtocolDriver.
+     */
+    void handleMessage([[maybe_unused]] Command command, uint8_t sender, std::span<const uint8_t> data) {
+        handleLog(sender, data);
+    }
+
+    /**
+     * @brief Return the events per board address.
+     */
+    const std::map<uint8_t, std::vector<util::TraceEvent>>& boards() const noexcept { return boards_; }
+
+    /**
+     * @brief Add the collected events to a trace, using the board address as process id.
+     */
+    template <typename Sink>
+    void writeTo(util::ChromeTraceWriter<Sink>& writer) const {
+        for (const auto& [address, events] : boards_) {
+            writer.process(address, std::format("board 0x{:02x}", address));
+            writer.add(address, events);
+        }
+    }
+
+    /**
+     * @brief Forget everything collected.
+     */
+    void clear() { boards_.clear(); }
+};
+
+} // namespace nl::rakis::raspberrypi::protocols
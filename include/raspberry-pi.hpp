@@ -60,6 +60,11 @@ public:
      */
     void sleepMs(unsigned ms) const;
 
+    /**
+     * Return a monotonic timestamp in microseconds, for measuring intervals and timeouts.
+     */
+    static uint64_t timeUs();
+
     /**
      * Return a reference to the (local) GPIO interface
      */
@@ -0,0 +1,124 @@
+#pragma once
+/*
+ * Copyright (c) 2024 by Bert Laverman. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <cstddef>
+#include <cstdint>
+
+#include <span>
+#include <array>
+
+
+namespace nl::rakis::raspberrypi::util {
+
+
+/**
+ * @brief A table-driven, non-reflected CRC, computed four bytes at a time ("slice-by-4"). The tables are generated at
+ *        compile time, so they end up in flash on the Pico.
+ *
+ * As the CRCs used here have no final XOR, running a CRC over a message followed by its (big-endian) CRC yields zero.
+ * This is what lets a receiver check a message in a single pass.
+ *
+ * @tparam Word       The type holding the CRC value.
+ * @tparam Polynomial The generator polynomial, without the top bit.
+ * @tparam Initial    The initial value of the register.
+ */
+template <typename Word, Word Polynomial, Word Initial>
+class Crc {
+    static constexpr unsigned bits = 8 * sizeof(Word);
+    static constexpr uint32_t topBit = uint32_t(1) << (bits - 1);
+    static constexpr uint32_t mask = (bits == 32) ? 0xffffffff : ((uint32_t(1) << bits) - 1);
+
+    using Tables = std::array<std::array<Word, 256>, 4>;
+
+    static constexpr Tables makeTables() {
+        Tables tables{};
+        for (uint32_t i = 0; i < 256; ++i) {
+            uint32_t crc = i << (bits - 8);
+            for (unsigned bit = 0; bit < 8; ++bit) {
+                crc = ((crc & topBit) != 0) ? ((crc << 1) ^ Polynomial) : (crc << 1);
+            }
+            tables[0][i] = static_cast<Word>(crc & mask);
+        }
+        for (unsigned slice = 1; slice < 4; ++slice) {
+            for (unsigned i = 0; i < 256; ++i) {
+                const uint32_t prev = tables[slice - 1][i];
+                tables[slice][i] = static_cast<Word>(((prev << 8) ^ tables[0][prev >> (bits - 8)]) & mask);
+            }
+        }
+        return tables;
+    }
+
+    static constexpr Tables tables_ = makeTables();
+
+    Word value_{ Initial };
+
+public:
+    static constexpr Word initial = Initial;
+
+    constexpr Crc() = default;
+    constexpr explicit Crc(Word value) : value_(value) {}
+
+    /**
+     * @brief Add bytes to the CRC.
+     */
+    constexpr Crc& update(std::span<const uint8_t> data) noexcept {
+        uint32_t crc = value_;
+        std::size_t i = 0;
+
+        for (; (i + 4) <= data.size(); i += 4) {
+            const uint32_t x = (crc << (32 - bits)) ^ ((uint32_t(data[i]) << 24) | (uint32_t(data[i + 1]) << 16) |
+                                                       (uint32_t(data[i + 2]) << 8) | uint32_t(data[i + 3]));
+            crc = tables_[3][x >> 24] ^ tables_[2][(x >> 16) & 0xff] ^ tables_[1][(x >> 8) & 0xff] ^ tables_[0][x & 0xff];
+        }
+        for (; i < data.size(); ++i) {
+            crc = ((crc << 8) ^ tables_[0][((crc >> (bits - 8)) ^ data[i]) & 0xff]) & mask;
+        }
+        value_ = static_cast<Word>(crc);
+
+        return *this;
+    }
+
+    /**
+     * @brief Return the current CRC value.
+     */
+    constexpr Word value() const noexcept { return value_; }
+
+    /**
+     * @brief Compute the CRC of a block of bytes in one go.
+     */
+    static constexpr Word compute(std::span<const uint8_t> data) noexcept { return Crc().update(data).value(); }
+};
+
+/**
+ * @brief CRC-16/CCITT-FALSE: polynomial 0x1021, initial value 0xffff, not reflected, no final XOR.
+ */
+using Crc16 = Crc<uint16_t, 0x1021, 0xffff>;
+
+/**
+ * @brief CRC-32/MPEG-2: polynomial 0x04c11db7, initial value 0xffffffff, not reflected, no final XOR.
+ */
+using Crc32 = Crc<uint32_t, 0x04c11db7, 0xffffffff>;
+
+
+namespace detail {
+    inline constexpr std::array<uint8_t, 9> crcCheckInput{ '1', '2', '3', '4', '5', '6', '7', '8', '9' };
+}
+static_assert(Crc16::compute(detail::crcCheckInput) == 0x29b1, "CRC-16/CCITT-FALSE check value mismatch");
+static_assert(Crc32::compute(detail::crcCheckInput) == 0x0376e6e7, "CRC-32/MPEG-2 check value mismatch");
+
+} // namespace nl::rakis::raspberrypi::util
@@ -0,0 +1,400 @@
+#pragma once
+/*
+ * Copyright (c) 2024 by Bert Laverman. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <cstdint>
+
+#include <span>
+#include <limits>
+#include <atomic>
+#include <vector>
+#include <utility>
+#include <algorithm>
+#include <coroutine>
+#include <exception>
+#include <functional>
+
+#include <raspberry-pi.hpp>
+#include <interfaces/gpio.hpp>
+#include <util/verbose-component.hpp>
+#include <protocols/messages.hpp>
+
+
+namespace nl::rakis::raspberrypi::util {
+
+class EventLoop;
+
+
+/**
+ * @brief A coroutine run by an EventLoop. It does not start until it is given to EventLoop::spawn(), and its frame is
+ *        freed as soon as it finishes.
+ */
+class Task {
+public:
+    struct promise_type {
+        EventLoop* loop{ nullptr };
+
+        ~promise_type();
+
+        Task get_return_object() noexcept { return Task(std::coroutine_handle<promise_type>::from_promise(*this)); }
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() noexcept {}
+        void unhandled_exception() noexcept { std::terminate(); }
+    };
+
+private:
+    std::coroutine_handle<promise_type> handle_;
+
+    explicit Task(std::coroutine_handle<promise_type> handle) : handle_(handle) {}
+
+public:
+    Task(const Task&) = delete;
+    Task(Task&& other) noexcept : handle_(std::exchange(other.handle_, nullptr)) {}
+    Task& operator=(const Task&) = delete;
+    Task& operator=(Task&& other) noexcept {
+        if (this != &other) {
+            if (handle_) {
+                handle_.destroy();
+            }
+            handle_ = std::exchange(other.handle_, nullptr);
+        }
+        return *this;
+    }
+
+    ~Task() {
+        if (handle_) {
+            handle_.destroy();
+        }
+    }
+
+    /**
+     * @brief Hand over the coroutine, which is then no longer owned by this Task.
+     */
+    std::coroutine_handle<promise_type> release() noexcept { return std::exchange(handle_, nullptr); }
+};
+
+
+/**
+ * @brief A suspended coroutine waiting for a condition. The event loop checks the condition after every wake-up, so
+ *        whatever makes it true must call EventLoop::wake() afterwards.
+ */
+struct Waiter {
+    bool (*ready)(Waiter& self){ nullptr };
+    std::coroutine_handle<> handle;
+};
+
+
+/**
+ * @brief A single-threaded executor for coroutines. Tasks can wait for a timer, incoming messages, a send to
+ *        complete, or a GPIO edge, and the loop sleeps until one of those can continue. It uses WFE/SEV on the Pico
+ *        and epoll with an eventfd on the Zero 2W, so there is no busy polling and no fixed sleep.
+ *
+ * Only wake() may be called from other threads or interrupt handlers.
+ */
+class EventLoop : public VerboseComponent {
+    friend struct Task::promise_type;
+
+    static constexpr uint64_t NoDeadline = std::numeric_limits<uint64_t>::max();
+
+    using Timer = std::pair<uint64_t, std::coroutine_handle<>>;
+    static constexpr auto laterTimer = [](const Timer& a, const Timer& b) { return a.first > b.first; };
+
+    std::vector<std::coroutine_handle<>> ready_;
+    std::vector<std::coroutine_handle<>> resuming_;
+    std::vector<Waiter*> waiters_;
+    std::vector<Timer> timers_;
+    unsigned tasks_{ 0 };
+    bool running_{ false };
+
+#if !defined(TARGET_PICO)
+    int eventFd_{ -1 };
+    int epollFd_{ -1 };
+#endif
+
+    /**
+     * @brief Sleep until woken, or until the deadline (in RaspberryPi::timeUs() time) has passed.
+     */
+    void wait(uint64_t deadlineUs);
+
+public:
+    EventLoop();
+    ~EventLoop();
+
+    EventLoop(const EventLoop&) = delete;
+    EventLoop(EventLoop&&) = delete;
+    EventLoop& operator=(const EventLoop&) = delete;
+    EventLoop& operator=(EventLoop&&) = delete;
+
+    /**
+     * @brief Start a task. It first runs when the loop does.
+     */
+    void spawn(Task task) {
+        auto handle = task.release();
+        handle.promise().loop = this;
+        tasks_++;
+        ready_.push_back(handle);
+    }
+
+    /**
+     * @brief Return the number of tasks that have not finished yet.
+     */
+    unsigned tasks() const noexcept { return tasks_; }
+
+    /**
+     * @brief Run until all tasks have finished, or stop() is called.
+     */
+    void run() {
+        running_ = true;
+        while (running_ && (tasks_ > 0)) {
+            const uint64_t now = RaspberryPi::timeUs();
+            while (!timers_.empty() && (timers_.front().first <= now)) {
+                std::pop_heap(timers_.begin(), timers_.end(), laterTimer);
+                ready_.push_back(timers_.back().second);
+                timers_.pop_back();
+            }
+            std::erase_if(waiters_, [this](Waiter* waiter) {
+                if (waiter->ready(*waiter)) {
+                    ready_.push_back(waiter->handle);
+                    return true;
+                }
+                return false;
+            });
+
+            if (ready_.empty()) {
+                wait(timers_.empty() ? NoDeadline : timers_.front().first);
+                continue;
+            }
+            resuming_.swap(ready_);
+            for (auto handle : resuming_) {
+                handle.resume();
+            }
+            resuming_.clear();
+        }
+        running_ = false;
+    }
+
+    /**
+     * @brief Make run() return after the current round. Tasks stay suspended.
+     */
+    void stop() noexcept { running_ = false; }
+
+    /**
+     * @brief Wake the loop so it checks its waiters. Safe to call from other threads and interrupt handlers.
+     */
+    void wake() noexcept;
+
+    /**
+     * @brief Wake the loop given as context. This fits ProtocolDriver::incomingNotify().
+     */
+    static void wakeUp(void* loop) noexcept { static_cast<EventLoop*>(loop)->wake(); }
+
+    /**
+     * @brief Suspend a coroutine until the waiter's condition holds. For use by awaitables.
+     */
+    void await(Waiter& waiter) { waiters_.push_back(&waiter); }
+
+    /**
+     * @brief Suspend a coroutine until the given time. For use by awaitables.
+     */
+    void awaitTime(uint64_t deadlineUs, std::coroutine_handle<> handle) {
+        timers_.emplace_back(deadlineUs, handle);
+        std::push_heap(timers_.begin(), timers_.end(), laterTimer);
+    }
+
+
+    /**
+     * @brief Wait for a number of microseconds.
+     */
+    auto sleepUs(uint64_t us) {
+        struct Awaiter {
+            EventLoop& loop;
+            uint64_t deadline;
+
+            bool await_ready() const noexcept { return false; }
+            void await_suspend(std::coroutine_handle<> handle) { loop.awaitTime(deadline, handle); }
+            void await_resume() const noexcept {}
+        };
+        return Awaiter{ *this, RaspberryPi::timeUs() + us };
+    }
+
+    /**
+     * @brief Wait for a number of milliseconds.
+     */
+    auto sleepMs(uint32_t ms) { return sleepUs(uint64_t(ms) * 1000); }
+
+    /**
+     * @brief Let other ready tasks run first.
+     */
+    auto yield() {
+        struct Awaiter {
+            EventLoop& loop;
+
+            bool await_ready() const noexcept { return false; }
+            void await_suspend(std::coroutine_handle<> handle) { loop.ready_.push_back(handle); }
+            void await_resume() const noexcept {}
+        };
+        return Awaiter{ *this };
+    }
+
+    /**
+     * @brief Wait until the driver has incoming messages. The driver is set up to wake this loop when one arrives.
+     */
+    template <class Driver>
+    auto received(Driver& driver) {
+        struct Awaiter : Waiter {
+            EventLoop& loop;
+            Driver& driver;
+
+            Awaiter(EventLoop& l, Driver& d) : loop(l), driver(d) {
+                ready = [](Waiter& self) { return static_cast<Awaiter&>(self).driver.haveIncoming(); };
+            }
+
+            bool await_ready() { return driver.haveIncoming(); }
+            void await_suspend(std::coroutine_handle<> h) { handle = h; loop.await(*this); }
+            void await_resume() const noexcept {}
+        };
+        driver.incomingNotify(&EventLoop::wakeUp, this);
+
+        return Awaiter{ *this, driver };
+    }
+
+    /**
+     * @brief Send a message and wait until the transfer has finished, without blocking the loop if the driver's
+     *        outgoing interface sends asynchronously.
+     *
+     * @return (when awaited) true if the message was delivered.
+     */
+    template <class Driver>
+    auto send(Driver& driver, protocols::Command command, uint8_t address, std::span<const uint8_t> payload) {
+        struct Awaiter : Waiter {
+            EventLoop& loop;
+            Driver& driver;
+            protocols::Command command;
+            uint8_t address;
+            std::span<const uint8_t> payload;
+            std::atomic<bool> done{ false };
+            bool success{ false };
+
+            Awaiter(EventLoop& l, Driver& d, protocols::Command c, uint8_t a, std::span<const uint8_t> p)
+                : loop(l), driver(d), command(c), address(a), payload(p)
+            {
+                ready = [](Waiter& self) { return static_cast<Awaiter&>(self).done.load(std::memory_order_acquire); };
+            }
+
+            bool await_ready() const noexcept { return false; }
+            bool await_suspend(std::coroutine_handle<> h) {
+                handle = h;
+                // Once done is set, the coroutine may resume and free this frame, so the loop is captured by itself.
+                const bool queued = driver.sendMessageAsync(command, address, payload, [this, &l = loop](bool result) {
+                    success = result;
+                    done.store(true, std::memory_order_release);
+                    l.wake();
+                });
+                if (!queued || done.load(std::memory_order_acquire)) {
+                    return false;
+                }
+                loop.await(*this);
+                return true;
+            }
+            bool await_resume() const noexcept { return success; }
+        };
+        return Awaiter{ *this, driver, command, address, payload };
+    }
+};
+
+inline Task::promise_type::~promise_type() {
+    if (loop != nullptr) {
+        loop->tasks_--;
+    }
+}
+
+
+/**
+ * @brief Edges on a GPIO input pin, which a task can wait for with "co_await". This installs the pin's rise and/or
+ *        fall handler, replacing any handler set before, and must outlive the loop.
+ */
+class GPIOEdge {
+public:
+    enum class Edge { Rising, Falling, Both };
+
+private:
+    EventLoop& loop_;
+    unsigned pin_;
+    std::atomic<uint32_t> edges_{ 0 };     // Only written by the GPIO handler
+    uint32_t seen_{ 0 };                   // Only written by the task
+
+    void edge() noexcept {
+        edges_.store(edges_.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+        loop_.wake();
+    }
+
+public:
+    GPIOEdge(EventLoop& loop, unsigned pin, Edge edge = Edge::Both) : loop_(loop), pin_(pin) {
+        auto handler = [this]([[maybe_unused]] unsigned pin, [[maybe_unused]] uint32_t event) { this->edge(); };
+        if (edge != Edge::Falling) {
+            RaspberryPi::gpio().addRiseHandler(pin, handler);
+        }
+        if (edge != Edge::Rising) {
+            RaspberryPi::gpio().addFallHandler(pin, handler);
+        }
+    }
+
+    GPIOEdge(const GPIOEdge&) = delete;
+    GPIOEdge(GPIOEdge&&) = delete;
+    GPIOEdge& operator=(const GPIOEdge&) = delete;
+    GPIOEdge& operator=(GPIOEdge&&) = delete;
+
+    ~GPIOEdge() = default;
+
+    /**
+     * @brief Return the pin.
+     */
+    unsigned pin() const noexcept { return pin_; }
+
+    /**
+     * @brief Check if edges happened that were not awaited yet.
+     */
+    bool pending() const noexcept { return edges_.load(std::memory_order_acquire) != seen_; }
+
+    /**
+     * @brief Wait for the next edge.
+     *
+     * @return (when awaited) the number of edges since the last time, at least one.
+     */
+    auto operator co_await() {
+        struct Awaiter : Waiter {
+            GPIOEdge& edge;
+
+            explicit Awaiter(GPIOEdge& e) : edge(e) {
+                ready = [](Waiter& self) { return static_cast<Awaiter&>(self).edge.pending(); };
+            }
+
+            bool await_ready() const noexcept { return edge.pending(); }
+            void await_suspend(std::coroutine_handle<> h) { handle = h; edge.loop_.await(*this); }
+            uint32_t await_resume() noexcept {
+                const uint32_t edges = edge.edges_.load(std::memory_order_acquire);
+                const uint32_t count = edges - edge.seen_;
+                edge.seen_ = edges;
+                return count;
+            }
+        };
+        return Awaiter{ *this };
+    }
+};
+
+} // namespace nl::rakis::raspberrypi::util
@@ -16,10 +16,11 @@
  */
 
 
+#include <cstddef>
 #include <cstdint>
 
+#include <span>
 #include <list>
-#include <tuple>
 #include <vector>
 #include <functional>
 
@@ -29,16 +30,90 @@
 
 namespace nl::rakis::raspberrypi::util {
 
+/**
+ * @brief What a bounded queue does with a new message when it is full.
+ */
+enum class DropPolicy : uint8_t {
+    /**
+     * @brief Drop the new message.
+     */
+    DropNewest = 0,
+
+    /**
+     * @brief Drop the oldest queued message to make room.
+     */
+    DropOldest = 1,
+
+    /**
+     * @brief Drop the oldest queued message with the same command and address, as the new one supersedes it. If there
+     *        is none, drop the new message.
+     */
+    Collapse = 2,
+};
+
+/**
+ * @brief A simple message queue, unbounded unless a capacity is set. Messages are kept in a pool of list nodes, so once the queue has warmed up,
+ *        pushing and processing messages reuses earlier nodes (and their payload buffers) rather than allocating.
+ */
 class MessageQueue : public VerboseComponent {
 public:
-    using Handler = std::function<void(protocols::Command command, uint8_t sender, const std::vector<uint8_t>& data)>;
-    using Queue = std::list<std::tuple<protocols::Command, uint8_t, std::vector<uint8_t>>>;
+    /**
+     * @brief A handler receives a view of the payload, which is only valid for the duration of the call.
+     */
+    using Handler = std::function<void(protocols::Command command, uint8_t sender, std::span<const uint8_t> data)>;
+
+    /**
+     * @brief A queued message.
+     */
+    struct Message {
+        protocols::Command command{ protocols::Command::Hello };
+        uint8_t sender{ 0x00 };
+        std::vector<uint8_t> data;
+    };
+    using Queue = std::list<Message>;
 
 private:
     Queue queue_;
+    Queue free_;
+
+    std::size_t capacity_{ 0 };
+    DropPolicy policy_{ DropPolicy::DropNewest };
+    uint32_t dropped_{ 0 };
+
+    /**
+     * @brief Drop a queued message according to the policy, to make room for a new one.
+     *
+     * @return false if the new message should be dropped instead.
+     */
+    bool makeRoom(protocols::Command command, uint8_t address) {
+        switch (policy_) {
+        case DropPolicy::DropOldest:
+            free_.splice(free_.end(), queue_, queue_.begin());
+            return true;
+
+        case DropPolicy::Collapse:
+            for (auto it = queue_.begin(); it != queue_.end(); ++it) {
+                if ((it->command == command) && (it->sender == address)) {
+                    free_.splice(free_.end(), queue_, it);
+                    return true;
+                }
+            }
+            return false;
+
+        case DropPolicy::DropNewest:
+            break;
+        }
+        return false;
+    }
 
 public:
     MessageQueue() = default;
+
+    /**
+     * @brief Create a bounded queue. The nodes for all messages are allocated up front.
+     */
+    MessageQueue(std::size_t capacity, DropPolicy policy) { this->capacity(capacity, policy); }
+
     MessageQueue(const MessageQueue&) = default;
     MessageQueue(MessageQueue&&) = default;
     ~MessageQueue() = default;
@@ -46,6 +121,33 @@ public:
     MessageQueue& operator=(const MessageQueue&) = default;
     MessageQueue& operator=(MessageQueue&&) = default;
 
+    /**
+     * @brief Limit the number of queued messages, or remove the limit with a capacity of 0. Nodes are allocated up to
+     *        the capacity, so pushing never needs to allocate a node later on.
+     */
+    void capacity(std::size_t capacity, DropPolicy policy) {
+        capacity_ = capacity;
+        policy_ = policy;
+        while ((queue_.size() + free_.size()) < capacity_) {
+            free_.emplace_back();
+        }
+    }
+
+    /**
+     * @brief Return the maximum number of queued messages, or 0 if unbounded.
+     */
+    std::size_t capacity() const noexcept { return capacity_; }
+
+    /**
+     * @brief Return what happens when the queue is full.
+     */
+    DropPolicy policy() const noexcept { return policy_; }
+
+    /**
+     * @brief Return the number of messages that were dropped because the queue was full.
+     */
+    uint32_t dropped() const noexcept { return dropped_; }
+
     /**
      * @brief check if there are no messages in the queue.
      */
@@ -53,6 +155,13 @@ public:
         return queue_.empty();
     }
 
+    /**
+     * @brief Return the number of messages in the queue.
+     */
+    virtual std::size_t size() {
+        return queue_.size();
+    }
+
     /**
      * @brief Check if there are messages in the queue.
      */
@@ -61,46 +170,62 @@ public:
     }
 
     /**
-     * @brief Add a message to the queue.
+     * @brief Add a message to the queue, reusing a pooled node if one is available.
+     *
+     * @return false if the queue was full and the new message was dropped.
      */
-    virtual void push(protocols::Command command, uint8_t address, std::span<uint8_t> data) {
-        queue_.push_back({command, address, std::vector<uint8_t>(data.begin(), data.end())});
+    virtual bool push(protocols::Command command, uint8_t address, std::span<const uint8_t> data) {
+        if ((capacity_ != 0) && (queue_.size() >= capacity_)) {
+            dropped_++;
+            if (!makeRoom(command, address)) {
+                return false;
+            }
+        }
+        if (free_.empty()) {
+            free_.emplace_back();
+        }
+        auto& msg = free_.front();
+        msg.command = command;
+        msg.sender = address;
+        msg.data.assign(data.begin(), data.end());
+
+        queue_.splice(queue_.end(), free_, free_.begin());
+
+        return true;
     }
 
     /**
-     * @brief Get the next message from the queue and return true if there was one.
+     * @brief Move the next message from the queue into the (empty) slot and return true if there was one. The message
+     *        stays valid until the slot is given back using release().
      */
     [[nodiscard]]
-    virtual bool pop(protocols::Command& command, uint8_t& address, std::vector<uint8_t>& data) {
-        auto result = !queue_.empty();
-        bool error{ false };
-
-        try {
-            if (result) {
-                std::tie(command, address, data) = queue_.front();
-                queue_.pop_front();
-            }
-        }
-        catch (...) {
-            error = true;
-        }
-        if (error) {
-            log("Error trying to remove a message from the 'incoming' queue.");
-            result = false;
+    virtual bool pop(Queue& slot) {
+        if (queue_.empty()) {
+            return false;
         }
-        return result;
+        slot.splice(slot.end(), queue_, queue_.begin());
+
+        return true;
+    }
+
+    /**
+     * @brief Give the message(s) in the slot back to the pool.
+     */
+    virtual void release(Queue& slot) {
+        free_.splice(free_.end(), slot);
     }
 
     /**
-     * @brief Convenience method for emptying the queue and calling a given function on each.
+     * @brief Convenience method for emptying the queue and calling a given function on each. The handler gets a view
+     *        into the pooled message, which is released after it returns.
      */
     void processAll(Handler handle) {
-        protocols::Command command{ protocols::Command::Hello };
-        uint8_t sender{ 0x00 };
-        std::vector<uint8_t> data;
+        Queue slot;
 
-        while (pop(command, sender, data)) {
-            handle(command, sender, data);
+        while (pop(slot)) {
+            const auto& msg = slot.front();
+            handle(msg.command, msg.sender, std::span<const uint8_t>(msg.data));
+            release(slot);
         }
     }
 
@@ -0,0 +1,321 @@
+#pragma once
+/*
+ * Copyright (c) 2024 by Bert Laverman. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <cstddef>
+#include <cstdint>
+
+#include <span>
+#include <list>
+#include <array>
+#include <vector>
+
+#include <util/verbose-component.hpp>
+#include <util/message-queue.hpp>
+#include <protocols/messages.hpp>
+
+
+namespace nl::rakis::raspberrypi::util {
+
+
+/**
+ * @brief The lanes of a PriorityMessageQueue. Messages in the Control lane are always sent before any in the Bulk lane.
+ */
+enum class Lane : uint8_t {
+    Control = 0,
+    Bulk = 1,
+};
+
+/**
+ * @brief A function that decides if a message only carries a "latest value", and if so, for what. Two queued messages
+ *        with the same command, address, and key are redundant: only the last one needs to be sent.
+ *
+ * @param data The payload of the message.
+ * @param key  Set to the key identifying what the message sets, for example the device or module.
+ * @return true if the message may be replaced by a later one with the same key.
+ */
+using CollapseKey = bool (*)(std::span<const uint8_t> data, uint32_t& key);
+
+
+/**
+ * @brief Collapse key for Led messages: the latest state for each Led wins.
+ */
+inline bool ledCollapseKey(std::span<const uint8_t> data, uint32_t& key) {
+    if (data.empty()) {
+        return false;
+    }
+    key = data[0];
+
+    return true;
+}
+
+
+/**
+ * @brief An outgoing message queue with two priority lanes, which also drops updates that are superseded by a later one
+ *        before they are sent.
+ *
+ * By default "Hello", "SetAddress", "SetGroup", "ConfirmLease", and "Button" messages go into the Control lane, and "Led"
+ * messages are collapsed per Led. A message only replaces a queued one if no other, non-collapsible, message to the same
+ * address was queued in between, so commands such as "clear display" are never reordered with the values around them.
+ * The replacement takes the place of the message it replaces, so a value that keeps changing is still sent as early as
+ * the first change.
+ */
+class PriorityMessageQueue : public VerboseComponent {
+public:
+    struct Message {
+        protocols::Command command{ protocols::Command::Hello };
+        uint8_t sender{ 0x00 };
+        bool collapsible{ false };
+        uint32_t key{ 0 };
+        std::vector<uint8_t> data;
+    };
+    using Queue = std::list<Message>;
+
+private:
+    std::array<Queue, 2> lanes_;
+    Queue free_;
+
+    std::array<Lane, 256> laneFor_;
+    std::array<CollapseKey, 256> collapseKeys_{};
+
+    uint32_t collapsed_{ 0 };
+
+    std::size_t capacity_{ 0 };
+    DropPolicy policy_{ DropPolicy::DropNewest };
+    uint32_t dropped_{ 0 };
+
+    Queue& lane(protocols::Command command) { return lanes_[static_cast<unsigned>(laneFor_[protocols::toInt(command)])]; }
+
+    /**
+     * @brief Find a queued message that the new one makes redundant, searching back until the first message to the same
+     *        address that cannot be collapsed.
+     */
+    Message* findSuperseded(Queue& queue, protocols::Command command, uint8_t address, uint32_t key) {
+        for (auto it = queue.rbegin(); it != queue.rend(); ++it) {
+            if (it->sender != address) {
+                continue;
+            }
+            if (!it->collapsible) {
+                break;
+            }
+            if ((it->command == command) && (it->key == key)) {
+                return &*it;
+            }
+        }
+        return nullptr;
+    }
+
+    /**
+     * @brief Drop a queued message according to the policy, to make room for a new one. Bulk messages are dropped
+     *        before Control messages.
+     *
+     * @return false if the new message should be dropped instead.
+     */
+    bool makeRoom(protocols::Command command, uint8_t address) {
+        switch (policy_) {
+        case DropPolicy::DropOldest:
+            for (auto queue = lanes_.rbegin(); queue != lanes_.rend(); ++queue) {
+                if (!queue->empty()) {
+                    free_.splice(free_.end(), *queue, queue->begin());
+                    return true;
+                }
+            }
+            return false;
+
+        case DropPolicy::Collapse: {
+            Queue& queue = lane(command);
+            for (auto it = queue.begin(); it != queue.end(); ++it) {
+                if ((it->command == command) && (it->sender == address)) {
+                    free_.splice(free_.end(), queue, it);
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        case DropPolicy::DropNewest:
+            break;
+        }
+        return false;
+    }
+
+public:
+    PriorityMessageQueue() {
+        laneFor_.fill(Lane::Bulk);
+        lane(protocols::Command::Hello, Lane::Control);
+        lane(protocols::Command::SetAddress, Lane::Control);
+        lane(protocols::Command::SetGroup, Lane::Control);
+        lane(protocols::Command::ConfirmLease, Lane::Control);
+        lane(protocols::Command::Button, Lane::Control);
+
+        collapse(protocols::Command::Led, ledCollapseKey);
+    }
+    PriorityMessageQueue(const PriorityMessageQueue&) = default;
+    PriorityMessageQueue(PriorityMessageQueue&&) = default;
+    ~PriorityMessageQueue() = default;
+
+    PriorityMessageQueue& operator=(const PriorityMessageQueue&) = default;
+    PriorityMessageQueue& operator=(PriorityMessageQueue&&) = default;
+
+    /**
+     * @brief Set the lane for messages with the given command.
+     */
+    void lane(protocols::Command command, Lane lane) noexcept { laneFor_[protocols::toInt(command)] = lane; }
+
+    /**
+     * @brief Return the lane for messages with the given command.
+     */
+    Lane lane(protocols::Command command) const noexcept { return laneFor_[protocols::toInt(command)]; }
+
+    /**
+     * @brief Set the function that determines if messages with the given command can be collapsed. Pass nullptr to
+     *        always send every message.
+     */
+    void collapse(protocols::Command command, CollapseKey keyFunction) noexcept { collapseKeys_[protocols::toInt(command)] = keyFunction; }
+
+    /**
+     * @brief Return the number of messages that were dropped because a later message superseded them.
+     */
+    uint32_t collapsed() const noexcept { return collapsed_; }
+
+    /**
+     * @brief Limit the number of queued messages, or remove the limit with a capacity of 0. Nodes are allocated up to
+     *        the capacity, so pushing never needs to allocate a node later on.
+     */
+    void capacity(std::size_t capacity, DropPolicy policy) {
+        capacity_ = capacity;
+        policy_ = policy;
+        while ((size() + free_.size()) < capacity_) {
+            free_.emplace_back();
+        }
+    }
+
+    /**
+     * @brief Return the maximum number of queued messages, or 0 if unbounded.
+     */
+    std::size_t capacity() const noexcept { return capacity_; }
+
+    /**
+     * @brief Return what happens when the queue is full.
+     */
+    DropPolicy policy() const noexcept { return policy_; }
+
+    /**
+     * @brief Return the number of messages that were dropped because the queue was full.
+     */
+    uint32_t dropped() const noexcept { return dropped_; }
+
+    /**
+     * @brief check if there are no messages in the queue.
+     */
+    virtual bool empty() {
+        return lanes_[0].empty() && lanes_[1].empty();
+    }
+
+    /**
+     * @brief Return the number of messages in the queue, in both lanes.
+     */
+    virtual std::size_t size() {
+        return lanes_[0].size() + lanes_[1].size();
+    }
+
+    /**
+     * @brief Check if there are messages in the queue.
+     */
+    inline bool haveMessages() {
+        return !empty();
+    }
+
+    /**
+     * @brief Add a message to its lane, or replace the queued message it supersedes.
+     *
+     * @return false if the queue was full and the new message was dropped.
+     */
+    virtual bool push(protocols::Command command, uint8_t address, std::span<const uint8_t> data) {
+        Queue& queue = lane(command);
+
+        uint32_t key{ 0 };
+        const CollapseKey keyFunction = collapseKeys_[protocols::toInt(command)];
+        const bool collapsible = (keyFunction != nullptr) && keyFunction(data, key);
+
+        if (collapsible) {
+            if (Message* msg = findSuperseded(queue, command, address, key); msg != nullptr) {
+                msg->data.assign(data.begin(), data.end());
+                collapsed_++;
+                return true;
+            }
+        }
+
+        if ((capacity_ != 0) && (size() >= capacity_)) {
+            dropped_++;
+            if (!makeRoom(command, address)) {
+                return false;
+            }
+        }
+
+        if (free_.empty()) {
+            free_.emplace_back();
+        }
+        auto& msg = free_.front();
+        msg.command = command;
+        msg.sender = address;
+        msg.collapsible = collapsible;
+        msg.key = key;
+        msg.data.assign(data.begin(), data.end());
+
+        queue.splice(queue.end(), free_, free_.begin());
+
+        return true;
+    }
+
+    /**
+     * @brief Move the next message into the (empty) slot and return true if there was one. The Control lane is checked
+     *        first every time, so a control message never waits for more than one bulk message.
+     */
+    [[nodiscard]]
+    virtual bool pop(Queue& slot) {
+        for (auto& queue : lanes_) {
+            if (!queue.empty()) {
+                slot.splice(slot.end(), queue, queue.begin());
+                return true;
+            }
+        }
+        return false;
+    }
+
+    /**
+     * @brief Give the message(s) in the slot back to the pool.
+     */
+    virtual void release(Queue& slot) {
+        free_.splice(free_.end(), slot);
+    }
+
+    /**
+     * @brief Empty the queue in priority order, calling the given function on each message.
+     */
+    void processAll(MessageQueue::Handler handle) {
+        Queue slot;
+
+        while (pop(slot)) {
+            const auto& msg = slot.front();
+            handle(msg.command, msg.sender, std::span<const uint8_t>(msg.data));
+            release(slot);
+        }
+    }
+};
+
+} // namespace nl::rakis::raspberrypi::util
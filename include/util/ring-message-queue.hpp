@@ -0,0 +1,155 @@
+#pragma once
+/*
+ * Copyright (c) 2024 by Bert Laverman. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#include <span>
+#include <array>
+#include <atomic>
+
+#include <util/verbose-component.hpp>
+#include <util/message-queue.hpp>
+#include <protocols/messages.hpp>
+
+
+namespace nl::rakis::raspberrypi::util {
+
+
+/**
+ * @brief The size we align shared indices to, so producer and consumer never share a cache line.
+ */
+inline constexpr std::size_t CacheLineSize = 64;
+
+using protocols::MaxPayloadSize;
+
+
+/**
+ * @brief A fixed-capacity, lock-free message queue for exactly one producer and one consumer.
+ *
+ * Each slot holds a complete message, so pushing never allocates and never needs a critical section. This makes it
+ * safe to push from an interrupt handler while the main loop is consuming. If the queue is full, the new message is
+ * dropped and counted, as the producer is not allowed to touch slots owned by the consumer.
+ *
+ * @tparam Slots The number of slots, which must be a power of two.
+ */
+template <unsigned Slots = 16>
+class RingMessageQueue : public VerboseComponent {
+    static_assert((Slots >= 2) && ((Slots & (Slots - 1)) == 0), "The number of slots must be a power of two.");
+
+    struct Slot {
+        protocols::Command command;
+        uint8_t sender;
+        uint8_t length;
+        std::array<uint8_t, MaxPayloadSize> data;
+    };
+
+    static constexpr uint32_t mask = Slots - 1;
+
+    alignas(CacheLineSize) std::atomic<uint32_t> head_{ 0 };     // Only written by the producer
+    alignas(CacheLineSize) std::atomic<uint32_t> tail_{ 0 };     // Only written by the consumer
+    alignas(CacheLineSize) std::atomic<uint32_t> dropped_{ 0 };  // Only written by the producer
+    alignas(CacheLineSize) std::array<Slot, Slots> slots_;
+
+public:
+    RingMessageQueue() = default;
+    ~RingMessageQueue() = default;
+
+    RingMessageQueue(const RingMessageQueue&) = delete;
+    RingMessageQueue(RingMessageQueue&&) = delete;
+    RingMessageQueue& operator=(const RingMessageQueue&) = delete;
+    RingMessageQueue& operator=(RingMessageQueue&&) = delete;
+
+    /**
+     * @brief Return the number of slots in the queue.
+     */
+    static constexpr unsigned capacity() noexcept { return Slots; }
+
+    /**
+     * @brief Return what happens when the queue is full, which is always dropping the new message.
+     */
+    static constexpr DropPolicy policy() noexcept { return DropPolicy::DropNewest; }
+
+    /**
+     * @brief Return the number of messages that were dropped because the queue was full or the message too large.
+     */
+    uint32_t dropped() const noexcept { return dropped_.load(std::memory_order_relaxed); }
+
+    /**
+     * @brief Check if there are no messages in the queue. Only the consumer should call this.
+     */
+    bool empty() const noexcept {
+        return head_.load(std::memory_order_acquire) == tail_.load(std::memory_order_relaxed);
+    }
+
+    /**
+     * @brief Return the number of messages in the queue. From the producer this is an upper bound, from the consumer a
+     *        lower one, as the other side may be busy changing it.
+     */
+    std::size_t size() const noexcept {
+        return head_.load(std::memory_order_acquire) - tail_.load(std::memory_order_acquire);
+    }
+
+    /**
+     * @brief Check if there are messages in the queue. Only the consumer should call this.
+     */
+    inline bool haveMessages() const noexcept {
+        return !empty();
+    }
+
+    /**
+     * @brief Add a message to the queue. Only the producer may call this, and it never blocks or allocates.
+     *
+     * @return true if the message was queued, false if it was dropped.
+     */
+    bool push(protocols::Command command, uint8_t address, std::span<const uint8_t> data) noexcept {
+        const uint32_t head = head_.load(std::memory_order_relaxed);
+        const uint32_t tail = tail_.load(std::memory_order_acquire);
+
+        if (((head - tail) >= Slots) || (data.size() > MaxPayloadSize)) {
+            dropped_.store(dropped_.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+            return false;
+        }
+        Slot& slot = slots_[head & mask];
+        slot.command = command;
+        slot.sender = address;
+        slot.length = static_cast<uint8_t>(data.size());
+        std::memcpy(slot.data.data(), data.data(), data.size());
+
+        head_.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+    /**
+     * @brief Empty the queue, calling the given function on each message. Only the consumer may call this. The handler
+     *        gets a view directly into the slot, which is handed back to the producer after the handler returns.
+     */
+    void processAll(MessageQueue::Handler handle) {
+        uint32_t tail = tail_.load(std::memory_order_relaxed);
+
+        while (tail != head_.load(std::memory_order_acquire)) {
+            const Slot& slot = slots_[tail & mask];
+            handle(slot.command, slot.sender, std::span<const uint8_t>(slot.data.data(), slot.length));
+
+            tail_.store(++tail, std::memory_order_release);
+        }
+    }
+};
+
+} // namespace nl::rakis::raspberrypi::util
@@ -0,0 +1,177 @@
+#pragma once
+/*
+ * Copyright (c) 2024 by Bert Laverman. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+
+#include <cstdint>
+
+#include <span>
+#include <array>
+#include <vector>
+#include <algorithm>
+#include <string>
+#include <utility>
+#include <charconv>
+#include <limits>
+#include <string_view>
+
+#if !defined(TARGET_PICO)
+#include <fstream>
+#endif
+
+#include <util/trace.hpp>
+
+
+namespace nl::rakis::raspberrypi::util {
+
+
+/**
+ * @brief Write trace events as Chrome trace JSON, which both chrome://tracing and the Perfetto UI can open. Each board
+ *        is a process, and each track (core or thread) a thread within it. The output is produced in small pieces, and
+ *        passed to the sink, which can append it to a file or print it to the (USB) console.
+ *
+ * @tparam Sink A function accepting a std::string_view.
+ */
+template <typename Sink>
+class ChromeTraceWriter {
+    Sink sink_;
+    bool first_{ true };
+    bool finished_{ false };
+
+    void write(std::string_view text) { sink_(text); }
+
+    void write(uint64_t value) {
+        std::array<char, 24> buffer;
+        auto result = std::to_chars(buffer.data(), buffer.data() + buffer.size(), value);
+        write(std::string_view(buffer.data(), result.ptr - buffer.data()));
+    }
+
+    void writeString(std::string_view text) {
+        write("\"");
+        for (char c : text) {
+            if ((c == '"') || (c == '\\')) {
+                write("\\");
+            }
+            write(std::string_view(&c, 1));
+        }
+        write("\"");
+    }
+
+    void separate() {
+        write(first_ ? "\n" : ",\n");
+        first_ = false;
+    }
+
+public:
+    ChromeTraceWriter(Sink sink) : sink_(std::move(sink)) { write("{\"displayTimeUnit\":\"ms\",\"traceEvents\":["); }
+    ChromeTraceWriter(const ChromeTraceWriter&) = delete;
+    ChromeTraceWriter(ChromeTraceWriter&&) = delete;
+    ChromeTraceWriter& operator=(const ChromeTraceWriter&) = delete;
+    ChromeTraceWriter& operator=(ChromeTraceWriter&&) = delete;
+    ~ChromeTraceWriter() { finish(); }
+
+    /**
+     * @brief Name a process, e.g. "controller" or "pico 0x21".
+     */
+    void process(unsigned pid, std::string_view name) {
+        separate();
+        write("{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":");
+        write(pid);
+        write(",\"args\":{\"name\":");
+        writeString(name);
+        write("}}");
+    }
+
+    /**
+     * @brief Add the events of one process. Events must be in recording order per track, as timestamps are unwrapped
+     *        from one event to the next. Each track has its own clock, as the events may come from a board with more
+     *        tracks than this one, such as a Pico with a track per core. Small steps back are allowed for.
+     */
+    void add(unsigned pid, std::span<const TraceEvent> events) {
+        struct Clock {
+            uint32_t last{ 0 };
+            int64_t time{ 0 };
+            bool started{ false };
+        };
+        std::array<Clock, std::numeric_limits<decltype(TraceEvent::track)>::max() + 1> clocks{};
+
+        for (const auto& event : events) {
+            Clock& clock = clocks[event.track];
+            clock.time = clock.started ? (clock.time + static_cast<int32_t>(event.timeUs - clock.last)) : event.timeUs;
+            clock.last = event.timeUs;
+            clock.started = true;
+
+            separate();
+            write("{\"name\":\"");
+            write(traceName(event.point));
+            write("\",\"ph\":\"");
+            const char phase = static_cast<char>(event.phase);
+            write(std::string_view(&phase, 1));
+            write((event.phase == TracePhase::Instant) ? "\",\"s\":\"t\",\"ts\":" : "\",\"ts\":");
+            write(static_cast<uint64_t>(std::max<int64_t>(clock.time, 0)));
+            write(",\"pid\":");
+            write(pid);
+            write(",\"tid\":");
+            write(event.track);
+            write(",\"args\":{\"arg\":");
+            write(event.arg);
+            write("}}");
+        }
+    }
+
+    /**
+     * @brief Close the JSON document. Called by the destructor if not done before.
+     */
+    void finish() {
+        if (!finished_) {
+            write("\n]}\n");
+            finished_ = true;
+        }
+    }
+};
+
+
+/**
+ * @brief Write the events recorded by this process as Chrome trace JSON.
+ */
+template <typename Sink>
+void writeChromeTrace(Sink sink, std::string_view name ="local") {
+    const auto events = Trace::snapshot();
+
+    ChromeTraceWriter<Sink> writer(std::move(sink));
+    writer.process(0, name);
+    writer.add(0, events);
+}
+
+#if !defined(TARGET_PICO)
+/**
+ * @brief Save the events recorded by this process as a Chrome trace JSON file.
+ *
+ * @return false if the file could not be written.
+ */
+inline bool saveChromeTrace(const std::string& path, std::string_view name ="controller") {
+    std::ofstream out(path);
+    if (!out) {
+        return false;
+    }
+    writeChromeTrace([&out](std::string_view text) { out << text; }, name);
+
+    return static_cast<bool>(out);
+}
+#endif
+
+} // namespace nl::rakis::raspberrypi::util
@@ -0,0 +1,298 @@
+#pragma once
+/*
+ * Copyright (c) 2024 by Bert Laverman. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+
+#include <cstddef>
+#include <cstdint>
+
+#include <span>
+#include <array>
+#include <atomic>
+#include <vector>
+
+#if defined(TARGET_PICO)
+#include <pico/sync.h>
+#include <pico/platform.h>
+#endif
+
+#include <raspberry-pi.hpp>
+
+
+namespace nl::rakis::raspberrypi::util {
+
+
+/**
+ * @brief Tracing is compiled in only if HAVE_TRACE is defined. Otherwise recording an event is an empty inline call.
+ */
+#if defined(HAVE_TRACE)
+inline constexpr bool TraceEnabled = true;
+#else
+inline constexpr bool TraceEnabled = false;
+#endif
+
+
+/**
+ * @brief The places that record trace events. The argument recorded with an event depends on the point.
+ */
+enum class TracePoint : uint8_t {
+    MessageReceived = 0x00,     // A message was added to the incoming queue. The argument is the command.
+    Handler         = 0x01,     // A handler runs for a received message. The argument is the command.
+    MessageSent     = 0x02,     // A message from the outgoing queue is sent. The argument is the command.
+    SpiWrite        = 0x03,     // Data is written to an SPI bus. The argument is the number of bytes.
+    DisplayData     = 0x04,     // Pixel data is sent to a display. The argument is the number of bytes.
+    GpioEdge        = 0x05,     // A GPIO interrupt handler runs. The argument is the pin.
+    User            = 0x06,     // Free for the application.
+};
+inline constexpr uint8_t toInt(TracePoint value) {
+    return static_cast<uint8_t>(value);
+}
+
+/**
+ * @brief Return the name of a trace point, as shown in trace viewers.
+ */
+inline constexpr const char* traceName(TracePoint point) noexcept {
+    switch (point) {
+    case TracePoint::MessageReceived:   return "MessageReceived";
+    case TracePoint::Handler:           return "Handler";
+    case TracePoint::MessageSent:       return "MessageSent";
+    case TracePoint::SpiWrite:          return "SpiWrite";
+    case TracePoint::DisplayData:       return "DisplayData";
+    case TracePoint::GpioEdge:          return "GpioEdge";
+    case TracePoint::User:              return "User";
+    }
+    return "Unknown";
+}
+
+/**
+ * @brief The kind of event, using the letters of the Chrome trace format.
+ */
+enum class TracePhase : uint8_t {
+    Begin   = 'B',
+    End     = 'E',
+    Instant = 'i',
+};
+
+
+/**
+ * @brief A single recorded event. The time is the lower 32 bits of RaspberryPi::timeUs(), which wraps after 71 minutes.
+ *        The track is the core on a Pico, and the recording thread on a Zero 2W.
+ */
+struct TraceEvent {
+    uint32_t timeUs;
+    uint32_t arg;
+    TracePoint point;
+    TracePhase phase;
+    uint8_t track;
+};
+
+
+/**
+ * @brief A fixed-size ring of trace events, which overwrites the oldest events when full. Recording an event takes a
+ *        timestamp and a few stores, and never formats, allocates, or blocks.
+ *
+ * On the Zero 2W any thread may record. The Pico has no atomic read-modify-write instructions, so there each core gets
+ * its own ring, and a slot is claimed with interrupts disabled for a moment, so interrupt handlers can record too.
+ *
+ * Each slot carries the sequence number of its event, so a reader can skip events that are being overwritten.
+ *
+ * @tparam Capacity The number of events kept, which must be a power of two.
+ */
+template <unsigned Capacity>
+class TraceRing {
+    static_assert((Capacity >= 2) && ((Capacity & (Capacity - 1)) == 0), "The capacity must be a power of two.");
+
+    struct Slot {
+        std::atomic<uint32_t> sequence{ 0 };    // Index of the event plus one, or 0 while it is written.
+        TraceEvent event{};
+    };
+
+    static constexpr uint32_t mask = Capacity - 1;
+
+    std::atomic<uint32_t> next_{ 0 };
+    std::array<Slot, Capacity> slots_{};
+
+    uint32_t claim() noexcept {
+#if defined(TARGET_PICO)
+        const uint32_t saved = save_and_disable_interrupts();
+        const uint32_t index = next_.load(std::memory_order_relaxed);
+        next_.store(index + 1, std::memory_order_relaxed);
+        restore_interrupts(saved);
+
+        return index;
+#else
+        return next_.fetch_add(1, std::memory_order_relaxed);
+#endif
+    }
+
+public:
+    constexpr TraceRing() = default;
+    TraceRing(const TraceRing&) = delete;
+    TraceRing(TraceRing&&) = delete;
+    TraceRing& operator=(const TraceRing&) = delete;
+    TraceRing& operator=(TraceRing&&) = delete;
+    ~TraceRing() = default;
+
+    /**
+     * @brief Return the number of events kept.
+     */
+    static constexpr unsigned capacity() noexcept { return Capacity; }
+
+    /**
+     * @brief Return the number of events recorded since the start, including those already overwritten.
+     */
+    uint32_t recorded() const noexcept { return next_.load(std::memory_order_relaxed); }
+
+    /**
+     * @brief Record an event.
+     */
+    void record(TracePoint point, TracePhase phase, uint32_t arg, uint8_t track) noexcept {
+        const uint32_t index = claim();
+        Slot& slot = slots_[index & mask];
+
+        slot.sequence.store(0, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        slot.event = TraceEvent{ static_cast<uint32_t>(RaspberryPi::timeUs()), arg, point, phase, track };
+        slot.sequence.store(index + 1, std::memory_order_release);
+    }
+
+    /**
+     * @brief Call the given function for every event still in the ring, oldest first. Events that are being
+     *        overwritten while reading are skipped.
+     */
+    template <typename Function>
+    void forEach(Function&& function) const {
+        const uint32_t end = next_.load(std::memory_order_acquire);
+        const uint32_t begin = (end > Capacity) ? (end - Capacity) : 0;
+
+        for (uint32_t index = begin; index != end; ++index) {
+            const Slot& slot = slots_[index & mask];
+            if (slot.sequence.load(std::memory_order_acquire) != (index + 1)) {
+                continue;
+            }
+            const TraceEvent event = slot.event;
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (slot.sequence.load(std::memory_order_relaxed) != (index + 1)) {
+                continue;
+            }
+            function(event);
+        }
+    }
+
+    /**
+     * @brief Forget all events. Only call this while nobody is recording.
+     */
+    void clear() noexcept {
+        for (auto& slot : slots_) {
+            slot.sequence.store(0, std::memory_order_relaxed);
+        }
+        next_.store(0, std::memory_order_release);
+    }
+};
+
+
+/**
+ * @brief The process-wide trace buffer. Instrumented code calls begin(), end(), and instant(), or uses a TraceScope.
+ *        All of these compile to nothing unless HAVE_TRACE is defined.
+ */
+class Trace {
+public:
+#if defined(TARGET_PICO)
+    static constexpr unsigned Tracks = 2;
+    static constexpr unsigned Capacity = 256;
+#else
+    static constexpr unsigned Tracks = 1;
+    static constexpr unsigned Capacity = 8192;
+#endif
+    using Ring = TraceRing<Capacity>;
+
+private:
+    static inline std::array<Ring, Tracks> rings_{};
+
+#if !defined(TARGET_PICO)
+    static inline std::atomic<uint8_t> threads_{ 0 };
+#endif
+
+    static uint8_t track() noexcept {
+#if defined(TARGET_PICO)
+        return static_cast<uint8_t>(get_core_num());
+#else
+        thread_local const uint8_t thread = threads_.fetch_add(1, std::memory_order_relaxed);
+
+        return thread;
+#endif
+    }
+
+public:
+    /**
+     * @brief Record an event on the ring of the caller.
+     */
+    static void record([[maybe_unused]] TracePoint point, [[maybe_unused]] TracePhase phase, [[maybe_unused]] uint32_t arg =0) noexcept {
+        if constexpr (TraceEnabled) {
+            const uint8_t t = track();
+            rings_[(Tracks == 1) ? 0 : t].record(point, phase, arg, t);
+        }
+    }
+
+    static void begin(TracePoint point, uint32_t arg =0) noexcept { record(point, TracePhase::Begin, arg); }
+    static void end(TracePoint point, uint32_t arg =0) noexcept { record(point, TracePhase::End, arg); }
+    static void instant(TracePoint point, uint32_t arg =0) noexcept { record(point, TracePhase::Instant, arg); }
+
+    /**
+     * @brief Return the ring of a track. On the Zero 2W all threads share ring 0.
+     */
+    static const Ring& ring(unsigned index =0) noexcept { return rings_[index]; }
+
+    /**
+     * @brief Copy all events still in the rings, oldest first per ring.
+     */
+    static std::vector<TraceEvent> snapshot() {
+        std::vector<TraceEvent> events;
+        for (const auto& ring : rings_) {
+            ring.forEach([&events](const TraceEvent& event) { events.push_back(event); });
+        }
+        return events;
+    }
+
+    /**
+     * @brief Forget all recorded events. Only call this while nobody is recording.
+     */
+    static void clear() noexcept {
+        for (auto& ring : rings_) {
+            ring.clear();
+        }
+    }
+};
+
+
+/**
+ * @brief Record a begin event when constructed, and the matching end event when destroyed.
+ */
+class TraceScope {
+    [[maybe_unused]] TracePoint point_;
+    [[maybe_unused]] uint32_t arg_;
+
+public:
+    TraceScope(TracePoint point, uint32_t arg =0) noexcept : point_(point), arg_(arg) { Trace::begin(point_, arg_); }
+    TraceScope(const TraceScope&) = delete;
+    TraceScope(TraceScope&&) = delete;
+    TraceScope& operator=(const TraceScope&) = delete;
+    TraceScope& operator=(TraceScope&&) = delete;
+    ~TraceScope() { Trace::end(point_, arg_); }
+};
+
+} // namespace nl::rakis::raspberrypi::util
@@ -15,17 +15,54 @@
  * limitations under the License.
  */
 
+#include <cstdint>
+
+#include <format>
+#include <string>
+#include <utility>
+
 #include <raspberry-pi.hpp>
 
 
 namespace nl::rakis::raspberrypi::util {
 
 
+/**
+ * @brief The importance of a log message, from the per-message chatter of hot paths up to errors.
+ */
+enum class LogLevel : uint8_t {
+    Trace = 0,      // Every transfer, pin change, or message.
+    Debug = 1,      // Details that help to find out why something does not work.
+    Info = 2,       // What plain log() calls use.
+    Warning = 3,
+    Error = 4,
+    Off = 5
+};
+
+
+/**
+ * @brief The lowest level that is compiled in. Calls below it are removed completely, including the evaluation of
+ *        their arguments. Set CPP_RASPBERRY_LOG_LEVEL to the number of a LogLevel to override the default, which
+ *        strips Trace and Debug from release builds.
+ */
+#if defined(CPP_RASPBERRY_LOG_LEVEL)
+inline constexpr LogLevel MinLogLevel{ static_cast<LogLevel>(CPP_RASPBERRY_LOG_LEVEL) };
+#elif defined(NDEBUG)
+inline constexpr LogLevel MinLogLevel{ LogLevel::Info };
+#else
+inline constexpr LogLevel MinLogLevel{ LogLevel::Trace };
+#endif
+
+
 /**
  * A VerboseComponent can emit logging, if enabled.
+ *
+ * Each component has its own runtime log level, which is checked before anything is formatted. The leveled log()
+ * takes a format string and its arguments, so nothing is formatted or allocated unless the message is actually
+ * logged, and calls below MinLogLevel compile to nothing.
  */
 class VerboseComponent {
-    bool verbose_ { false };
+    LogLevel logLevel_ { LogLevel::Off };
 
 public:
     VerboseComponent() = default;
@@ -37,16 +74,41 @@ public:
     VerboseComponent& operator=(VerboseComponent&&) = default;
 
 
+    /**
+     * Returns the lowest level this component logs at.
+     */
+    LogLevel logLevel() const noexcept { return logLevel_; }
+
+
+    /**
+     * Set the lowest level this component logs at. Levels below MinLogLevel are never logged.
+     */
+    void logLevel(LogLevel level) noexcept { logLevel_ = level; }
+
+
+    /**
+     * Returns if a message at the given level would be logged. This is a compile-time false below MinLogLevel.
+     */
+    template <LogLevel Level>
+    bool logging() const noexcept {
+        if constexpr (Level < MinLogLevel) {
+            return false;
+        } else {
+            return logLevel_ <= Level;
+        }
+    }
+
+
     /**
      * Returns if this component should actually produce logging.
      */
-    bool verbose() const noexcept { return verbose_; }
+    bool verbose() const noexcept { return logging<LogLevel::Info>(); }
 
 
     /**
-     * Set if this component should actually produce logging.
+     * Set if this component should actually produce logging. Verbose means everything, down to Trace.
      */
-    void verbose(bool verb) noexcept { verbose_ = verb; }
+    void verbose(bool verb) noexcept { logLevel_ = verb ? LogLevel::Trace : LogLevel::Off; }
 
     /**
      * Convenience method to send the provided string to the log, if in verbose mode.
@@ -59,6 +121,28 @@ public:
             RaspberryPi::log(s, addNewline);
         }
     }
+
+    /**
+     * Format and log a message at the given level. The arguments are only formatted if the message is logged.
+     */
+    template <LogLevel Level, typename... Args>
+    void log(std::format_string<Args...> fmt, Args&&... args) {
+        if (logging<Level>()) {
+            RaspberryPi::log(std::format(fmt, std::forward<Args>(args)...), true);
+        }
+    }
+
+    /**
+     * Log a message about a single transfer, pin change, or message.
+     */
+    template <typename... Args>
+    void trace(std::format_string<Args...> fmt, Args&&... args) { log<LogLevel::Trace>(fmt, std::forward<Args>(args)...); }
+
+    /**
+     * Log a message that helps with finding problems.
+     */
+    template <typename... Args>
+    void debug(std::format_string<Args...> fmt, Args&&... args) { log<LogLevel::Debug>(fmt, std::forward<Args>(args)...); }
 };
 
-} // namespace nl::rakis::raspberrypi::util
\ No newline at end of file
+} // namespace nl::rakis::raspberrypi::util
@@ -21,4 +21,19 @@ set(CPP_RASPBERRY_INCLUDES ${CPP_RASPBERRY_INCLUDES}
     ${CMAKE_CURRENT_LIST_DIR}/include)
 
 set(CPP_RASPBERRY_SOURCES ${CPP_RASPBERRY_SOURCES}
-    ${CMAKE_CURRENT_LIST_DIR}/src/protocols/i2c-protocol-driver.cpp)
\ No newline at end of file
+    ${CMAKE_CURRENT_LIST_DIR}/src/protocols/i2c-protocol-driver.cpp)
+
+# The virtual bus is for simulations on Linux only.
+
+if(NOT TARGET_PICO)
+    set(CPP_RASPBERRY_SOURCES ${CPP_RASPBERRY_SOURCES}
+        ${CMAKE_CURRENT_LIST_DIR}/src/interfaces/virtual-i2c.cpp)
+endif(NOT TARGET_PICO)
+
+# Host-side tests, built only when the including project enables testing.
+
+if(NOT TARGET_PICO AND BUILD_TESTING)
+    add_executable(i2c-frame-parser-test ${CMAKE_CURRENT_LIST_DIR}/test/i2c-frame-parser-test.cpp)
+    target_include_directories(i2c-frame-parser-test PRIVATE ${CPP_RASPBERRY_INCLUDES})
+    add_test(NAME i2c-frame-parser-test COMMAND i2c-frame-parser-test)
+endif(NOT TARGET_PICO AND BUILD_TESTING)
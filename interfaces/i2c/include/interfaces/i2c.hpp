@@ -16,36 +16,42 @@
  */
 
 #include <cstdint>
+#include <cstring>
 
 #include <iostream>
 #if !defined(TARGET_PICO)
 #include <format>
 #endif
 #include <span>
+#include <array>
+#include <atomic>
+#include <functional>
 
 #include <util/named-component.hpp>
 #include <util/verbose-component.hpp>
 #include <interfaces/gpio.hpp>
 #include <protocols/messages.hpp>
+#include <protocols/protocol-metrics.hpp>
+#include <protocols/i2c-batch.hpp>
+#include <protocols/i2c-integrity.hpp>
 
 
-namespace nl::rakis::raspberrypi::protocols {
+namespace nl::rakis::raspberrypi::interfaces
+{
 
 /**
- * @brief Message header
+ * @brief Called when an asynchronous write has finished, with true if there was a listener at the address.
  */
-struct MsgHeader {
-    uint8_t command;
-    uint8_t length;
-    uint8_t sender;
-    uint8_t checksum;
-};
-constexpr unsigned MsgHeaderSize = sizeof(MsgHeader);
+using WriteCompletion = std::function<void(bool success)>;
 
-}
-
-namespace nl::rakis::raspberrypi::interfaces
-{
+/**
+ * @brief One message of a batch write. The result is filled in by I2C::writeBatch().
+ */
+struct WriteRequest {
+    uint8_t address;
+    std::span<const uint8_t> data;
+    bool success{ false };
+};
 
 class I2C : public util::NamedComponent, public util::VerboseComponent {
     bool initialized_{ false };
@@ -57,6 +63,44 @@ class I2C : public util::NamedComponent, public util::VerboseComponent {
     uint8_t address_{ 0 };
     protocols::MsgCallback callback_;
 
+    protocols::LinkMetrics metrics_;
+
+    std::atomic<uint32_t> groups_{ 0 };
+
+    /**
+     * @brief How deep "Batch" and "Group" messages may be nested, which bounds the recursion while delivering a frame.
+     */
+    static constexpr unsigned MaxNesting = 2;
+
+    /**
+     * @brief Pass a message to the callback, unpacking "Batch" messages and "Group" messages for groups we are in.
+     *
+     * @return false if the message was malformed.
+     */
+    bool dispatch(protocols::Command command, uint8_t sender, std::span<uint8_t> data, bool generalCall, unsigned depth) {
+        switch (command) {
+        case protocols::Command::Batch:
+            return (depth < MaxNesting) && protocols::unpackBatch(data, [this, sender, generalCall, depth](protocols::Command cmd, std::span<uint8_t> body) {
+                if (!dispatch(cmd, sender, body, generalCall, depth + 1)) {
+                    metrics_.malformed.add();
+                }
+            });
+
+        case protocols::Command::Group:
+            if ((depth >= MaxNesting) || (data.size() < protocols::sizeMsgGroup)) {
+                return false;
+            }
+            if (memberOf(data[0])) {
+                return dispatch(protocols::toCommand(data[1]), sender, data.subspan(protocols::sizeMsgGroup), true, depth + 1);
+            }
+            return true;
+
+        default:
+            callback_(command, sender, data, generalCall);
+            return true;
+        }
+    }
+
 protected:
 
     /**
@@ -78,9 +122,9 @@ public:
     I2C() = default;
 
     I2C(I2C const &) = delete;
-    I2C(I2C &&) = default;
+    I2C(I2C &&) = delete;
     I2C &operator=(I2C const &) = delete;
-    I2C &operator=(I2C &&) = default;
+    I2C &operator=(I2C &&) = delete;
 
     virtual ~I2C() = default;
 
@@ -188,7 +232,69 @@ public:
     /**
      * @brief return the callback function used in responder mode.
      */
-    protocols::MsgCallback callback() const noexcept { return callback_; }
+    const protocols::MsgCallback& callback() const noexcept { return callback_; }
+
+    /**
+     * @brief Return the metrics of this bus. Implementations count failed integrity checks and writes, deliver() counts
+     *        received frames.
+     */
+    protocols::LinkMetrics& metrics() noexcept { return metrics_; }
+    const protocols::LinkMetrics& metrics() const noexcept { return metrics_; }
+
+    /**
+     * @brief Add this interface to a device group, so it accepts "Group" messages for it.
+     */
+    void joinGroup(uint8_t group) noexcept {
+        if (group < protocols::MaxGroups) {
+            groups_.store(groups_.load(std::memory_order_relaxed) | (uint32_t(1) << group), std::memory_order_relaxed);
+        }
+    }
+
+    /**
+     * @brief Remove this interface from a device group.
+     */
+    void leaveGroup(uint8_t group) noexcept {
+        if (group < protocols::MaxGroups) {
+            groups_.store(groups_.load(std::memory_order_relaxed) & ~(uint32_t(1) << group), std::memory_order_relaxed);
+        }
+    }
+
+    /**
+     * @brief Return the groups this interface is a member of, as a bitmask.
+     */
+    uint32_t groups() const noexcept { return groups_.load(std::memory_order_relaxed); }
+
+    /**
+     * @brief Check if this interface is a member of the given group.
+     */
+    bool memberOf(uint8_t group) const noexcept { return (group < protocols::MaxGroups) && ((groups() & (uint32_t(1) << group)) != 0); }
+
+    /**
+     * @brief Pass a received and verified message on to the callback. A "Batch" message is unpacked, and each message in
+     *        it is delivered separately, in order. A "Group" message is unwrapped if we are a member of its group, and
+     *        dropped here otherwise, so it never reaches the incoming queue. Messages unwrapped from a "Group" message
+     *        are always delivered as General Call messages.
+     *
+     * @param generalCall If the frame was sent to the General Call address, where the implementation can tell.
+     * @return false if there was no callback, or the message was malformed.
+     */
+    bool deliver(protocols::Command command, uint8_t sender, std::span<uint8_t> data, bool generalCall = false) {
+        metrics_.received(data.size());
+        if (!callback_) {
+            return false;
+        }
+        const bool valid = dispatch(command, sender, data, generalCall, 0);
+        if (!valid) {
+            metrics_.malformed.add();
+        }
+        return valid;
+    }
+
+    /**
+     * @brief Deliver received frames that were left for thread context. Implementations that deliver from an interrupt
+     *        handler or their own thread need not do anything here.
+     */
+    virtual void poll() {}
 
     /**
      * @brief Attempt to send a span of bytes to a listener at the given address.
@@ -197,6 +303,63 @@ public:
      */
     virtual bool write(uint8_t address, std::span<uint8_t> data) = 0;
 
+    /**
+     * @brief Send several spans of bytes, such as a header and a payload, to a listener at the given address as a single
+     *        transfer. This default implementation copies them into a buffer on the stack, which must hold a complete
+     *        message frame, and calls write().
+     *
+     * @return true if successfull, which means there was a listener active at that address.
+     */
+    virtual bool write(uint8_t address, std::span<const std::span<const uint8_t>> parts) {
+        std::array<uint8_t, protocols::MaxFrameSize> buffer;
+        std::size_t size{ 0 };
+
+        for (auto part : parts) {
+            if (part.size() > (buffer.size() - size)) {
+                log("Gathered write is too large for the staging buffer.");
+                return false;
+            }
+            std::memcpy(buffer.data() + size, part.data(), part.size());
+            size += part.size();
+        }
+        return write(address, std::span<uint8_t>(buffer.data(), size));
+    }
+
+    /**
+     * @brief Check if writeBatch() needs fewer transfers than writing the messages one by one.
+     */
+    virtual bool canBatch() const noexcept { return false; }
+
+    /**
+     * @brief Send several messages, possibly to different addresses, and set the result of each. This default
+     *        implementation writes them one by one.
+     *
+     * @return The number of messages that were sent successfully.
+     */
+    virtual unsigned writeBatch(std::span<WriteRequest> requests) {
+        unsigned sent{ 0 };
+        for (auto& request : requests) {
+            request.success = write(request.address, std::span<uint8_t>(const_cast<uint8_t*>(request.data.data()), request.data.size()));
+            sent += request.success ? 1 : 0;
+        }
+        return sent;
+    }
+
+    /**
+     * @brief Queue a span of bytes to be sent to a listener at the given address. The bytes are copied, so they need not
+     *        outlive the call. This default implementation just writes them immediately.
+     *
+     * @param completion Called with the result, possibly on another thread.
+     * @return false if the write could not be queued, in which case the completion is not called.
+     */
+    virtual bool writeAsync(uint8_t address, std::span<const uint8_t> data, WriteCompletion completion) {
+        const bool success = write(address, std::span<uint8_t>(const_cast<uint8_t*>(data.data()), data.size()));
+        if (completion) {
+            completion(success);
+        }
+        return true;
+    }
+
 };
 
 } // namespace nl::rakis::raspberrypi::interfaces
\ No newline at end of file
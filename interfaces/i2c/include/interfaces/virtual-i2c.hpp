@@ -0,0 +1,201 @@
+#pragma once
+/*
+ * Copyright (c) 2024 by Bert Laverman. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+
+#include <cstddef>
+#include <cstdint>
+
+#include <span>
+#include <mutex>
+#include <memory>
+#include <vector>
+
+#include <interfaces/i2c.hpp>
+
+
+namespace nl::rakis::raspberrypi::interfaces {
+
+
+class VirtualI2C;
+
+
+/**
+ * @brief Standard I2C clock rates.
+ */
+enum class BusSpeed : uint32_t {
+    Standard    = 100'000,
+    Fast        = 400'000,
+    FastPlus    = 1'000'000,
+};
+
+
+/**
+ * @brief An in-process I2C bus connecting any number of VirtualI2C endpoints, for simulating large setups without
+ *        hardware. Transfers are delivered immediately, but also timed in virtual time, so a simulation can measure how
+ *        long the same traffic would occupy a real bus.
+ *
+ * Every endpoint keeps its own virtual clock, which a simulation may set to make endpoints act at the same moment. A
+ * transfer starts at the endpoint's time, or when the bus becomes free if it is busy. A controller that was already
+ * waiting when another transfer started, or that started within the same bit time, took part in its arbitration: the
+ * transfer that got here first wins, and the other one retries when the bus is free again. A transfer takes nine clocks per byte, including the address byte, plus START and STOP, and each
+ * receiver may add clock stretching per byte.
+ */
+class VirtualBus {
+    mutable std::recursive_mutex mutex_;
+    std::vector<VirtualI2C*> endpoints_;
+
+    uint32_t clockHz_{ static_cast<uint32_t>(BusSpeed::Standard) };
+
+    uint64_t lastStartNs_{ 0 };
+    uint64_t idleAtNs_{ 0 };
+
+    uint64_t transfers_{ 0 };
+    uint64_t bytes_{ 0 };
+    uint64_t nacks_{ 0 };
+    uint64_t arbitrationLosses_{ 0 };
+    uint64_t waits_{ 0 };
+    uint64_t busyNs_{ 0 };
+
+    /**
+     * @brief Return the time the given number of clocks takes, in nanoseconds.
+     */
+    uint64_t clocks(uint64_t count) const noexcept { return (count * 1'000'000'000 + clockHz_ - 1) / clockHz_; }
+
+public:
+    VirtualBus() = default;
+    VirtualBus(BusSpeed speed) : clockHz_(static_cast<uint32_t>(speed)) {}
+
+    VirtualBus(const VirtualBus&) = delete;
+    VirtualBus(VirtualBus&&) = delete;
+    ~VirtualBus() = default;
+
+    VirtualBus& operator=(const VirtualBus&) = delete;
+    VirtualBus& operator=(VirtualBus&&) = delete;
+
+    void clockHz(uint32_t hz) noexcept { clockHz_ = (hz == 0) ? 1 : hz; }
+    void speed(BusSpeed speed) noexcept { clockHz_ = static_cast<uint32_t>(speed); }
+    uint32_t clockHz() const noexcept { return clockHz_; }
+
+    void attach(VirtualI2C& endpoint);
+    void detach(VirtualI2C& endpoint);
+
+    /**
+     * @brief Return the number of attached endpoints.
+     */
+    std::size_t endpoints() const;
+
+    /**
+     * @brief Perform a write from an endpoint to an address, or to all listeners if it is the General Call address.
+     *
+     * @return true if at least one listener acknowledged the address.
+     */
+    bool transfer(VirtualI2C& from, uint8_t address, std::span<const uint8_t> data);
+
+    /**
+     * @brief Return the virtual time at which the bus is free again, in nanoseconds.
+     */
+    uint64_t idleAtNs() const;
+
+    uint64_t transfers() const;
+    uint64_t bytes() const;
+    uint64_t nacks() const;
+    uint64_t arbitrationLosses() const;
+
+    /**
+     * @brief Return the number of transfers that had to wait for another one to finish.
+     */
+    uint64_t waits() const;
+
+    /**
+     * @brief Return the virtual time the bus was busy, in nanoseconds.
+     */
+    uint64_t busyNs() const;
+
+    /**
+     * @brief Return the share of virtual time the bus was busy, from 0.0 to 1.0.
+     */
+    double utilization() const;
+
+    void resetStatistics();
+};
+
+
+/**
+ * @brief An endpoint on a VirtualBus. It can both send and listen, like a Pico, and receives General Call messages while
+ *        listening. Received frames are checked and delivered just like on real hardware.
+ */
+class VirtualI2C : public I2C {
+    std::shared_ptr<VirtualBus> bus_;
+    uint64_t nowNs_{ 0 };
+    uint32_t stretchNs_{ 0 };
+
+public:
+    using I2C::write;
+
+    VirtualI2C(std::shared_ptr<VirtualBus> bus) : bus_(bus) {}
+
+    VirtualI2C(VirtualI2C const &) = delete;
+    VirtualI2C(VirtualI2C &&) = delete;
+    VirtualI2C &operator=(VirtualI2C const &) = delete;
+    VirtualI2C &operator=(VirtualI2C &&) = delete;
+
+    virtual ~VirtualI2C();
+
+    /**
+     * @brief Return the bus this endpoint is attached to when opened.
+     */
+    const std::shared_ptr<VirtualBus>& bus() const noexcept { return bus_; }
+
+    /**
+     * @brief Set the virtual time of this endpoint, in nanoseconds. A write advances it to the end of the transfer.
+     */
+    void nowNs(uint64_t ns) noexcept { nowNs_ = ns; }
+    uint64_t nowNs() const noexcept { return nowNs_; }
+
+    /**
+     * @brief Set how long this endpoint stretches the clock after each byte it receives, in nanoseconds.
+     */
+    void stretchNs(uint32_t ns) noexcept { stretchNs_ = ns; }
+    uint32_t stretchNs() const noexcept { return stretchNs_; }
+
+    /**
+     * @brief Check if this endpoint acknowledges a transfer to the given address.
+     */
+    bool accepts(uint8_t address) const noexcept;
+
+    /**
+     * @brief Check, verify, and deliver a frame written to the given address, and advance our clock to when it arrived.
+     */
+    void receive(uint8_t address, std::span<const uint8_t> frame, uint64_t arrivedNs);
+
+    virtual void open() override;
+
+    virtual void close() override;
+
+    virtual bool canListen() const noexcept override;
+
+    virtual void startListening() override;
+
+    virtual void stopListening() override;
+
+    virtual bool canSend() const noexcept override;
+
+    bool write(uint8_t address, std::span<uint8_t> data) override;
+};
+
+} // namespace nl::rakis::raspberrypi::interfaces
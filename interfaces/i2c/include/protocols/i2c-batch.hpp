@@ -0,0 +1,165 @@
+#pragma once
+/*
+ * Copyright (c) 2024 by Bert Laverman. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#include <span>
+#include <array>
+
+#include <protocols/messages.hpp>
+
+
+namespace nl::rakis::raspberrypi::protocols {
+
+
+/**
+ * @brief Collects messages for a single address into the payload of one "Batch" message, so they can be sent in a
+ *        single I2C transaction. Each record costs only two bytes of overhead, compared to a full transaction with its
+ *        own START, address byte and message header.
+ */
+class BatchFrame {
+    uint8_t address_{ 0 };
+    unsigned records_{ 0 };
+    std::size_t size_{ 0 };
+    Command firstCommand_{ Command::Hello };
+    std::array<uint8_t, MaxPayloadSize> payload_;
+
+public:
+    BatchFrame() = default;
+    ~BatchFrame() = default;
+
+    BatchFrame(const BatchFrame&) = default;
+    BatchFrame(BatchFrame&&) = default;
+    BatchFrame& operator=(const BatchFrame&) = default;
+    BatchFrame& operator=(BatchFrame&&) = default;
+
+    /**
+     * @brief Return the largest message payload that fits into an empty batch.
+     */
+    static constexpr std::size_t maxRecordSize() noexcept { return MaxPayloadSize - sizeMsgBatchRecord; }
+
+    /**
+     * @brief Empty the batch and start collecting for the given address.
+     */
+    void start(uint8_t address) noexcept {
+        address_ = address;
+        records_ = 0;
+        size_ = 0;
+    }
+
+    /**
+     * @brief Return the address this batch is for.
+     */
+    uint8_t address() const noexcept { return address_; }
+
+    /**
+     * @brief Return the number of messages in the batch.
+     */
+    unsigned records() const noexcept { return records_; }
+
+    /**
+     * @brief Check if the batch has no messages.
+     */
+    bool empty() const noexcept { return records_ == 0; }
+
+    /**
+     * @brief Check if a message with the given payload size still fits.
+     */
+    bool fits(std::size_t size) const noexcept { return (size_ + sizeMsgBatchRecord + size) <= MaxPayloadSize; }
+
+    /**
+     * @brief Append a message to the batch.
+     *
+     * @return false if it does not fit.
+     */
+    bool add(Command command, std::span<const uint8_t> data) noexcept {
+        if (!fits(data.size())) {
+            return false;
+        }
+        if (records_ == 0) {
+            firstCommand_ = command;
+        }
+        payload_[size_++] = toInt(command);
+        payload_[size_++] = static_cast<uint8_t>(data.size());
+        std::memcpy(payload_.data() + size_, data.data(), data.size());
+        size_ += data.size();
+        records_++;
+
+        return true;
+    }
+
+    /**
+     * @brief Return the payload of the "Batch" message.
+     */
+    std::span<const uint8_t> payload() const noexcept { return std::span<const uint8_t>(payload_.data(), size_); }
+
+    /**
+     * @brief Return the command of the first message. If that is the only one, it is cheaper to send it as is.
+     */
+    Command firstCommand() const noexcept { return firstCommand_; }
+
+    /**
+     * @brief Return the payload of the first message.
+     */
+    std::span<const uint8_t> firstPayload() const noexcept {
+        return (size_ < sizeMsgBatchRecord) ? std::span<const uint8_t>() : payload().subspan(sizeMsgBatchRecord, payload_[1]);
+    }
+};
+
+
+/**
+ * @brief Check that the payload of a "Batch" message consists of complete records.
+ */
+inline bool validBatch(std::span<const uint8_t> payload) noexcept {
+    std::size_t pos{ 0 };
+    while (pos < payload.size()) {
+        if ((payload.size() - pos) < sizeMsgBatchRecord) {
+            return false;
+        }
+        pos += sizeMsgBatchRecord + payload[pos + 1];
+    }
+    return pos == payload.size();
+}
+
+/**
+ * @brief Call the given function for each message in the payload of a "Batch" message. Nothing is delivered unless
+ *        the whole batch is well-formed, so a corrupted batch cannot be half-applied.
+ *
+ * @param payload The payload of the "Batch" message.
+ * @param handle  The function to call, accepting (Command, std::span<uint8_t>).
+ * @return false if the batch was malformed.
+ */
+template <typename Handler>
+bool unpackBatch(std::span<uint8_t> payload, Handler&& handle) {
+    if (!validBatch(payload)) {
+        return false;
+    }
+    std::size_t pos{ 0 };
+    while (pos < payload.size()) {
+        const Command command{ payload[pos] };
+        const std::size_t length{ payload[pos + 1] };
+        pos += sizeMsgBatchRecord;
+        handle(command, payload.subspan(pos, length));
+        pos += length;
+    }
+    return true;
+}
+
+} // namespace nl::rakis::raspberrypi::protocols
@@ -0,0 +1,346 @@
+#pragma once
+/*
+ * Copyright (c) 2024 by Bert Laverman. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+
+#include <cstddef>
+#include <cstdint>
+
+#include <span>
+#include <array>
+#include <vector>
+#include <format>
+#include <algorithm>
+
+#include <raspberry-pi.hpp>
+#include <util/verbose-component.hpp>
+#include <util/message-queue.hpp>
+#include <protocols/messages.hpp>
+#include <protocols/i2c-integrity.hpp>
+
+
+namespace nl::rakis::raspberrypi::protocols {
+
+
+/**
+ * @brief Schedules the messages a bus controller sends, so that every board gets its fair share of the bus, and the
+ *        bus is never filled up completely.
+ *
+ * Messages are queued per destination address, and taken from those queues using deficit round-robin: every round, a
+ * board may send up to its weight times the quantum in bytes. The result is handed to the driver's outgoing queue, so
+ * batching and flow control still apply. A board that has no flow control credit left is skipped for the round.
+ *
+ * The utilization ceiling is enforced with a token bucket measured in time on the bus. Each byte costs nine clock
+ * cycles (eight bits and the acknowledge), and each transfer a START, address byte, and STOP on top of that. The time
+ * not used leaves room for traffic initiated by the Picos themselves, such as button events.
+ *
+ * @tparam Driver The protocol driver to send through, usually an I2CProtocolDriver.
+ */
+template <class Driver>
+class BusScheduler : public util::VerboseComponent {
+public:
+    static constexpr unsigned Addresses = 128;
+    static constexpr uint32_t DefaultClockHz = 100'000;
+    static constexpr unsigned DefaultCeilingPercent = 70;
+    static constexpr uint32_t DefaultQuantum = 64;
+    static constexpr uint32_t DefaultBurstUs = 5'000;
+    static constexpr std::size_t DefaultMaxQueued = 64;
+
+private:
+    struct Board {
+        util::MessageQueue::Queue queue;
+        unsigned weight{ 1 };
+        uint32_t deficit{ 0 };
+        uint64_t bytesSent{ 0 };
+        uint32_t messagesSent{ 0 };
+        uint32_t dropped{ 0 };
+    };
+
+    Driver& driver_;
+
+    std::array<Board, Addresses> boards_;
+    util::MessageQueue::Queue free_;
+    std::vector<uint8_t> active_;
+    std::size_t current_{ 0 };
+    bool credited_{ false };
+
+    uint32_t clockHz_{ DefaultClockHz };
+    unsigned ceilingPercent_{ DefaultCeilingPercent };
+    uint32_t quantum_{ DefaultQuantum };
+    uint32_t burstUs_{ DefaultBurstUs };
+    std::size_t maxQueued_{ DefaultMaxQueued };
+
+    uint64_t budget_{ 0 };           // In millionths of a microsecond on the bus, so rounding does not add up
+    uint64_t lastRefill_{ 0 };
+    uint64_t busTimeUs_{ 0 };
+    uint64_t statsStart_{ 0 };
+
+    static constexpr uint64_t Scale = 1'000'000;
+
+    /**
+     * @brief Return the bytes a message occupies on the wire, including the address byte.
+     */
+    std::size_t wireBytes(std::size_t payload) const noexcept {
+        return 1 + MsgHeaderSize + payload + trailerSize(driver_.integrity());
+    }
+
+    /**
+     * @brief Return the time a transfer of the given number of bytes occupies the bus, in microseconds.
+     */
+    uint64_t busTime(std::size_t bytes) const noexcept {
+        constexpr uint64_t startAndStop = 2;
+        return ((bytes * 9 + startAndStop) * 1'000'000 + clockHz_ - 1) / clockHz_;
+    }
+
+    void refill(uint64_t now) noexcept {
+        const uint64_t elapsed = now - lastRefill_;
+        lastRefill_ = now;
+        budget_ = std::min<uint64_t>(budget_ + elapsed * ceilingPercent_ * (Scale / 100), uint64_t(burstUs_) * Scale);
+    }
+
+    void deactivate() {
+        boards_[active_[current_]].deficit = 0;
+        active_.erase(active_.begin() + current_);
+        credited_ = false;
+        if (current_ >= active_.size()) {
+            current_ = 0;
+        }
+    }
+
+    void next() {
+        credited_ = false;
+        if (++current_ >= active_.size()) {
+            current_ = 0;
+        }
+    }
+
+public:
+    BusScheduler(Driver& driver) : driver_(driver), lastRefill_(RaspberryPi::timeUs()), statsStart_(lastRefill_) {}
+
+    BusScheduler(const BusScheduler&) = delete;
+    BusScheduler(BusScheduler&&) = delete;
+    ~BusScheduler() = default;
+
+    BusScheduler& operator=(const BusScheduler&) = delete;
+    BusScheduler& operator=(BusScheduler&&) = delete;
+
+    /**
+     * @brief Set the clock rate of the bus, which determines how long a byte takes.
+     */
+    void clockHz(uint32_t hz) noexcept { clockHz_ = std::max<uint32_t>(hz, 1); }
+
+    uint32_t clockHz() const noexcept { return clockHz_; }
+
+    /**
+     * @brief Set the share of bus time the scheduler may use, in percent.
+     */
+    void ceiling(unsigned percent) noexcept { ceilingPercent_ = std::clamp<unsigned>(percent, 1, 100); }
+
+    unsigned ceiling() const noexcept { return ceilingPercent_; }
+
+    /**
+     * @brief Set the number of bytes a board with weight 1 may send per round.
+     */
+    void quantum(uint32_t bytes) noexcept { quantum_ = std::max<uint32_t>(bytes, 1); }
+
+    uint32_t quantum() const noexcept { return quantum_; }
+
+    /**
+     * @brief Set the bus time that may be saved up while idle, and then used in a single burst.
+     */
+    void burstUs(uint32_t us) noexcept { burstUs_ = us; }
+
+    uint32_t burstUs() const noexcept { return burstUs_; }
+
+    /**
+     * @brief Set the maximum number of messages queued per board. Any more are dropped.
+     */
+    void maxQueued(std::size_t messages) noexcept { maxQueued_ = messages; }
+
+    std::size_t maxQueued() const noexcept { return maxQueued_; }
+
+    /**
+     * @brief Set the weight of a board, the relative share of the bus it gets when all boards are busy.
+     */
+    void weight(uint8_t address, unsigned weight) noexcept {
+        if (address < Addresses) {
+            boards_[address].weight = std::max<unsigned>(weight, 1);
+        }
+    }
+
+    unsigned weight(uint8_t address) const noexcept { return (address < Addresses) ? boards_[address].weight : 0; }
+
+    /**
+     * @brief Queue a message for the given address.
+     *
+     * @return false if the queue for that board is full, and the message was dropped.
+     */
+    bool submit(Command command, uint8_t address, std::span<const uint8_t> data) {
+        if (address >= Addresses) {
+            log(std::format("Cannot schedule a message for invalid address 0x{:02x}.", address));
+            return false;
+        }
+        auto& board = boards_[address];
+        if (board.queue.size() >= maxQueued_) {
+            board.dropped++;
+            return false;
+        }
+        if (board.queue.empty()) {
+            active_.push_back(address);
+        }
+        if (free_.empty()) {
+            free_.emplace_back();
+        }
+        auto& msg = free_.front();
+        msg.command = command;
+        msg.sender = address;
+        msg.data.assign(data.begin(), data.end());
+        board.queue.splice(board.queue.end(), free_, free_.begin());
+
+        return true;
+    }
+
+    /**
+     * @brief Check if any messages are waiting to be scheduled.
+     */
+    bool pending() const noexcept { return !active_.empty(); }
+
+    /**
+     * @brief Return the number of messages waiting for a board.
+     */
+    std::size_t pending(uint8_t address) const noexcept { return (address < Addresses) ? boards_[address].queue.size() : 0; }
+
+    /**
+     * @brief Send as many messages as the utilization ceiling allows right now, in round-robin order, and let the driver
+     *        process its outgoing queue.
+     *
+     * @return The number of messages sent.
+     */
+    unsigned run() {
+        refill(RaspberryPi::timeUs());
+
+        unsigned sent{ 0 };
+        unsigned skipped{ 0 };
+        while (!active_.empty() && (skipped < active_.size())) {
+            const uint8_t address = active_[current_];
+            auto& board = boards_[address];
+
+            if (driver_.flowControl().available(address) == 0) {
+                skipped++;
+                next();
+                continue;
+            }
+            if (!credited_) {
+                board.deficit += board.weight * quantum_;
+                credited_ = true;
+            }
+
+            const auto& msg = board.queue.front();
+            const auto bytes = wireBytes(msg.data.size());
+            if (bytes > board.deficit) {
+                skipped = 0;
+                next();
+                continue;
+            }
+            const auto cost = busTime(bytes);
+            if ((cost * Scale) > budget_) {
+                break;
+            }
+            budget_ -= cost * Scale;
+            busTimeUs_ += cost;
+            board.deficit -= static_cast<uint32_t>(bytes);
+            board.bytesSent += bytes;
+            board.messagesSent++;
+
+            driver_.pushOutgoing(msg.command, address, std::span<const uint8_t>(msg.data));
+            free_.splice(free_.end(), board.queue, board.queue.begin());
+            sent++;
+            skipped = 0;
+
+            if (board.queue.empty()) {
+                deactivate();
+            }
+        }
+        if (sent > 0) {
+            driver_.processOutgoing();
+        }
+        return sent;
+    }
+
+    /**
+     * @brief Return the number of bytes sent to a board, including the address byte and message framing.
+     */
+    uint64_t bytesSent(uint8_t address) const noexcept { return (address < Addresses) ? boards_[address].bytesSent : 0; }
+
+    /**
+     * @brief Return the number of messages sent to a board.
+     */
+    uint32_t messagesSent(uint8_t address) const noexcept { return (address < Addresses) ? boards_[address].messagesSent : 0; }
+
+    /**
+     * @brief Return the number of messages for a board that were dropped because its queue was full.
+     */
+    uint32_t dropped(uint8_t address) const noexcept { return (address < Addresses) ? boards_[address].dropped : 0; }
+
+    /**
+     * @brief Return the share of all bytes sent that went to a board, from 0.0 to 1.0.
+     */
+    double share(uint8_t address) const noexcept {
+        uint64_t total{ 0 };
+        for (const auto& board : boards_) {
+            total += board.bytesSent;
+        }
+        return (total == 0) ? 0.0 : double(bytesSent(address)) / double(total);
+    }
+
+    /**
+     * @brief Return the share of time the bus was used by the scheduler since the statistics were reset, from 0.0 to 1.0.
+     */
+    double utilization() const noexcept {
+        const uint64_t elapsed = RaspberryPi::timeUs() - statsStart_;
+        return (elapsed == 0) ? 0.0 : double(busTimeUs_) / double(elapsed);
+    }
+
+    /**
+     * @brief Log the share of the bus each board got.
+     */
+    void report() {
+        log(std::format("Bus utilization {:.1f}% of {:d}% allowed.", utilization() * 100.0, ceilingPercent_));
+        for (unsigned address = 0; address < Addresses; ++address) {
+            if (boards_[address].messagesSent > 0) {
+                log(std::format("  0x{:02x}: {} messages, {} bytes, {:.1f}% share, {} queued, {} dropped.", address,
+                                boards_[address].messagesSent, boards_[address].bytesSent, share(address) * 100.0,
+                                boards_[address].queue.size(), boards_[address].dropped));
+            }
+        }
+    }
+
+    /**
+     * @brief Reset the statistics, but not the queues.
+     */
+    void resetStatistics() noexcept {
+        for (auto& board : boards_) {
+            board.bytesSent = 0;
+            board.messagesSent = 0;
+            board.dropped = 0;
+        }
+        busTimeUs_ = 0;
+        statsStart_ = RaspberryPi::timeUs();
+    }
+};
+
+} // namespace nl::rakis::raspberrypi::protocols
@@ -23,19 +23,133 @@
 #include <vector>
 #include <algorithm>
 #include <format>
+#include <functional>
 
+#include <raspberry-pi.hpp>
 #include <protocols/messages.hpp>
+#include <protocols/device-groups.hpp>
 #include <protocols/i2c-protocol-driver.hpp>
 
 
 namespace nl::rakis::raspberrypi::protocols {
 
+/**
+ * @brief Handles the messages that let boards find the bus controller, and get an address and group memberships.
+ *
+ * A board without an address answers the controller's Hello in a random slot, so a whole panel powering up at once does
+ * not have every board compete for the bus at the same moment. The slot is drawn from a window that doubles with each
+ * retry. The controller can collect the Hellos and answer them with a single SetAddress broadcast.
+ *
+ * Both sides can remember addresses between restarts. A board that kept its address resumes the lease and listens on it
+ * right away, and a controller that remembers it sends a ConfirmLease broadcast instead of waiting for Hellos. Only a
+ * board whose lease is not confirmed within a grace period falls back to the Hello/SetAddress exchange.
+ */
 template <typename ProtDriver>
 class I2CDeviceHandler {
+public:
+    /**
+     * @brief Chooses the address for a board that announced itself, or returns GeneralCallAddress to not assign one.
+     */
+    using AddressAllocator = std::function<uint8_t(BoardId board)>;
+
+    /**
+     * @brief Called when our address was set or confirmed by the bus controller, so it can be kept for the next start.
+     */
+    using LeaseKeeper = std::function<void(uint8_t address)>;
+
+    /**
+     * @brief Called by the bus controller when a board announced itself and was given an address, with the hash of its
+     *        descriptor, or 0 if it did not send one.
+     */
+    using BoardListener = std::function<void(BoardId board, uint8_t address, uint32_t descriptorHash)>;
+
+    static constexpr unsigned DefaultHelloSlots = 64;
+    static constexpr uint32_t DefaultHelloSlotUs = 1'500;
+    static constexpr unsigned MaxBackoffDoublings = 4;
+    static constexpr uint32_t DefaultLeaseGraceUs = 50'000;
+
+private:
     ProtDriver& driver_;
     BoardId deviceId_;
     uint8_t controllerAddress_{ GeneralCallAddress };
 
+    unsigned helloSlots_{ DefaultHelloSlots };
+    uint32_t helloSlotUs_{ DefaultHelloSlotUs };
+    unsigned attempt_{ 0 };
+    bool helloScheduled_{ false };
+    uint64_t nextHelloUs_{ 0 };
+
+    AddressAllocator allocator_;
+    std::vector<MsgSetAddress> pendingAddresses_;
+
+    LeaseKeeper keeper_;
+    BoardListener boardListener_;
+    uint32_t descriptorHash_{ 0 };
+    uint32_t leaseGraceUs_{ DefaultLeaseGraceUs };
+    bool leased_{ false };
+    bool confirmed_{ false };
+
+    /**
+     * @brief A 64-bit mixing function (SplitMix64), so boards with similar ids still end up in different slots.
+     */
+    static constexpr uint64_t mix(uint64_t x) noexcept {
+        x += 0x9e3779b97f4a7c15;
+        x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9;
+        x = (x ^ (x >> 27)) * 0x94d049bb133111eb;
+        return x ^ (x >> 31);
+    }
+
+    /**
+     * @brief Pick the time of the next Hello, in a random slot of the current window.
+     */
+    void scheduleHello(uint64_t nowUs) {
+        const uint64_t window = uint64_t(helloSlots_) << std::min(attempt_, MaxBackoffDoublings);
+        const uint64_t slot = mix(deviceId_.id ^ (uint64_t(attempt_) << 56) ^ nowUs) % window;
+
+        nextHelloUs_ = nowUs + slot * helloSlotUs_;
+        if ((attempt_ == 0) && leased_) {
+            // Give the controller the chance to confirm the lease first.
+            nextHelloUs_ += leaseGraceUs_;
+        }
+        helloScheduled_ = true;
+    }
+
+    /**
+     * @brief Send address records as one or more broadcasts of the given command, packing as many as fit into each.
+     */
+    bool sendAddresses(Command command, std::span<const MsgSetAddress> pairs)
+    {
+        std::array<uint8_t, MaxSetAddressPairs * sizeMsgSetAddress> msg;
+        bool success{ true };
+
+        while (!pairs.empty()) {
+            const auto count = std::min<std::size_t>(pairs.size(), MaxSetAddressPairs);
+            for (std::size_t i = 0; i < count; ++i) {
+                std::memcpy(msg.data() + i * sizeMsgSetAddress, &pairs[i].boardId.bytes[0], idSize);
+                msg[i * sizeMsgSetAddress + idSize] = pairs[i].address;
+            }
+            success = driver_.sendMessage(command, GeneralCallAddress, std::span<uint8_t>(msg.data(), count * sizeMsgSetAddress)) && success;
+            pairs = pairs.subspan(count);
+        }
+        return success;
+    }
+
+    /**
+     * @brief Unpack the address records of a SetAddress or ConfirmLease message, and handle each.
+     */
+    void handleAddresses(const char* name, std::span<const uint8_t> data) {
+        if (data.empty() || ((data.size() % sizeMsgSetAddress) != 0)) {
+            driver_.log(std::format("Dropping {} message: size {} is not a multiple of {}.", name, data.size(), sizeMsgSetAddress));
+            return;
+        }
+        for (; !data.empty(); data = data.subspan(sizeMsgSetAddress)) {
+            MsgSetAddress msg;
+            std::memcpy(&msg.boardId.bytes[0], data.data(), idSize);
+            msg.address = data[idSize];
+            handle(msg);
+        }
+    }
+
 public:
     I2CDeviceHandler(ProtDriver& driver, BoardId deviceId) : driver_(driver), deviceId_(deviceId) {}
 
@@ -50,21 +164,96 @@ public:
     inline void controllerAddress(uint8_t address) { controllerAddress_ = address; }
 
     /**
-     * @brief Handle a Hello broadcast message, if sent by the I2C bus controller.
+     * @brief Set the number of slots a Hello is spread over, and the length of a slot. A slot should fit a Hello
+     *        transfer, which takes about 1.3 ms at 100 kHz.
+     */
+    void helloBackoff(unsigned slots, uint32_t slotUs) noexcept {
+        helloSlots_ = std::max(slots, 1u);
+        helloSlotUs_ = slotUs;
+    }
+
+    /**
+     * @brief Set the function choosing addresses for boards that announce themselves, which makes this the handler of
+     *        the bus controller. Assigned addresses are collected until sendPendingAddresses() is called.
+     */
+    void addressAllocator(AddressAllocator allocator) { allocator_ = std::move(allocator); }
+
+    /**
+     * @brief Set the function told about boards that announced themselves, for example to check their descriptor.
+     */
+    void boardListener(BoardListener listener) { boardListener_ = std::move(listener); }
+
+    /**
+     * @brief Set the hash of our descriptor, which is sent along with our Hellos.
+     */
+    void descriptorHash(uint32_t hash) noexcept { descriptorHash_ = hash; }
+    inline uint32_t descriptorHash() const noexcept { return descriptorHash_; }
+
+    /**
+     * @brief Set the function that keeps our address for the next start, for example in flash.
+     */
+    void leaseKeeper(LeaseKeeper keeper) { keeper_ = std::move(keeper); }
+
+    /**
+     * @brief Set how long a resumed lease waits for a ConfirmLease, before falling back to sending Hellos.
+     */
+    void leaseGrace(uint32_t graceUs) noexcept { leaseGraceUs_ = graceUs; }
+
+    /**
+     * @brief Resume listening on the address we had before a restart, without waiting for the bus controller. Until it
+     *        confirms the lease, we still count as needing an address.
+     */
+    void resumeLease(uint8_t address) {
+        if (address == GeneralCallAddress) {
+            return;
+        }
+        driver_.listenAddress(address);
+        leased_ = true;
+        confirmed_ = false;
+        helloScheduled_ = false;
+    }
+
+    /**
+     * @brief Return true if the bus controller set or confirmed our current address.
+     */
+    inline bool leaseConfirmed() const noexcept { return confirmed_; }
+
+    /**
+     * @brief Handle a Hello message. If sent by the I2C bus controller, we now know its address. If sent to the bus
+     *        controller by a board, and we have an address allocator, an address is assigned to it and the board listener
+     *        is told. As the board restarted, what flow control knew of its address no longer holds.
      */
     void handle(uint8_t sender, const MsgHello& msg) {
         if (msg.boardId.id == ControllerId) {
-            // The bus controller sent this to announce its own address.
+            // The bus controller sent this to announce its own address. Start a new round of requests.
             controllerAddress(sender);
+            attempt_ = 0;
+            helloScheduled_ = false;
+        } else if (allocator_) {
+            driver_.flowControl().forget(sender);
+            const auto address = allocator_(msg.boardId);
+            if (address != GeneralCallAddress) {
+                assignAddress(msg.boardId, address);
+                if (boardListener_) {
+                    boardListener_(msg.boardId, address, msg.descriptorHash);
+                }
+            }
         }
     }
 
     /**
-     * @brief Send a Hello message to a specific address.
+     * @brief Send a Hello message to a specific address. Our own Hello carries our descriptor hash, if we have one.
      */
     inline bool sendHello(uint8_t address, BoardId id)
     {
-        return driver_.sendMessage(Command::Hello, address, std::span<uint8_t>(&((id.bytes)[0]), idSize));
+        std::array<uint8_t, sizeMsgHelloWithHash> msg;
+        std::memcpy(msg.data(), &id.bytes[0], idSize);
+        if ((id.id != deviceId_.id) || (descriptorHash_ == 0)) {
+            return driver_.sendMessage(Command::Hello, address, std::span<uint8_t>(msg.data(), sizeMsgHello));
+        }
+        std::memcpy(msg.data() + idSize, &descriptorHash_, sizeof(descriptorHash_));
+
+        return driver_.sendMessage(Command::Hello, address, std::span<uint8_t>(msg));
     }
 
     /**
@@ -76,13 +265,22 @@ public:
     }
 
     /**
-     * @brief Handle a SetAddress broadcast message, if for us. This can also change our listen address.
+     * @brief Handle a SetAddress or ConfirmLease record, if for us. This can also change our listen address. The address
+     *        is passed to the lease keeper only if it changed, or was not confirmed yet.
      */
     void handle(const MsgSetAddress& msg) {
-        if ((msg.boardId.id == deviceId_.id) && (msg.address != driver_.listenAddress())) {
-            driver_.disableResponderMode();
-            driver_.enableResponderMode(msg.address);
+        if (msg.boardId.id != deviceId_.id) {
+            return;
+        }
+        const bool changed = (msg.address != driver_.listenAddress());
+        if (changed) {
+            driver_.listenAddress(msg.address);
         }
+        if ((changed || !confirmed_) && keeper_) {
+            keeper_(msg.address);
+        }
+        leased_ = true;
+        confirmed_ = true;
     }
 
     /**
@@ -90,50 +288,214 @@ public:
      */
     inline bool sendSetAddress(BoardId id, uint8_t address)
     {
-        std::array<uint8_t, sizeMsgSetAddress> msg;
+        const MsgSetAddress pair{ id, address };
+
+        return sendSetAddresses(std::span<const MsgSetAddress>(&pair, 1));
+    }
+
+    /**
+     * @brief Send SetAddress broadcasts for several boards, packing as many as fit into each message.
+     *
+     * @return true if all messages were sent.
+     */
+    inline bool sendSetAddresses(std::span<const MsgSetAddress> pairs)
+    {
+        return sendAddresses(Command::SetAddress, pairs);
+    }
+
+    /**
+     * @brief Confirm the addresses boards had before the bus controller restarted, packing as many as fit into each
+     *        broadcast. Boards that kept their address see no interruption, others move to the given address.
+     *
+     * @return true if all messages were sent.
+     */
+    inline bool sendConfirmLeases(std::span<const MsgSetAddress> leases)
+    {
+        return sendAddresses(Command::ConfirmLease, leases);
+    }
+
+    /**
+     * @brief Collect an address assignment, to be sent with the next call to sendPendingAddresses(). A later assignment
+     *        for the same board replaces an earlier one. Flow control starts afresh for the address.
+     */
+    void assignAddress(BoardId id, uint8_t address)
+    {
+        driver_.flowControl().forget(address);
+        for (auto& pair : pendingAddresses_) {
+            if (pair.boardId.id == id.id) {
+                pair.address = address;
+                return;
+            }
+        }
+        pendingAddresses_.push_back(MsgSetAddress{ id, address });
+    }
+
+    /**
+     * @brief Return the number of address assignments waiting to be sent.
+     */
+    std::size_t pendingAddresses() const noexcept { return pendingAddresses_.size(); }
+
+    /**
+     * @brief Send all collected address assignments, in as few broadcasts as possible.
+     */
+    bool sendPendingAddresses()
+    {
+        const bool success = sendSetAddresses(pendingAddresses_);
+        pendingAddresses_.clear();
+
+        return success;
+    }
+
+    /**
+     * @brief Handle a SetGroup broadcast message, if for us, by joining or leaving the group.
+     */
+    void handle(const MsgSetGroup& msg) {
+        if (msg.boardId.id != deviceId_.id) {
+            return;
+        }
+        if (msg.member != 0) {
+            driver_.joinGroup(msg.group);
+        } else {
+            driver_.leaveGroup(msg.group);
+        }
+    }
+
+    /**
+     * @brief Send a SetGroup message as a broadcast, to add a board to a group or remove it.
+     */
+    inline bool sendSetGroup(BoardId id, uint8_t group, bool member =true)
+    {
+        std::array<uint8_t, sizeMsgSetGroup> msg;
         std::memcpy(msg.data(), &id.bytes[0], idSize);
-        msg[idSize] = address;
+        msg[idSize] = group;
+        msg[idSize + 1] = member ? 1 : 0;
+
+        return driver_.sendMessage(Command::SetGroup, GeneralCallAddress, std::span<uint8_t>(msg));
+    }
+
+    /**
+     * @brief Tell all boards which groups they are in, for example after they were given an address.
+     *
+     * @return true if all SetGroup messages were sent.
+     */
+    bool sendGroups(const DeviceGroups& groups)
+    {
+        bool success{ true };
+        for (unsigned group = 0; group < groups.count(); ++group) {
+            for (auto member : groups.members(static_cast<uint8_t>(group))) {
+                success = sendSetGroup(BoardId{ member }, static_cast<uint8_t>(group)) && success;
+            }
+        }
+        return success;
+    }
 
-        return driver_.sendMessage(GeneralCallAddress, Command::SetAddress, msg);
+    /**
+     * @brief Send a message to all members of a group, as a single broadcast.
+     *
+     * @return false if the message is too large to wrap, or could not be sent.
+     */
+    bool sendToGroup(uint8_t group, Command command, std::span<const uint8_t> body)
+    {
+        if (body.size() > (MaxPayloadSize - sizeMsgGroup)) {
+            driver_.log(std::format("Message of {} bytes is too large to send to group {}.", body.size(), group));
+
+            return false;
+        }
+        std::array<uint8_t, MaxPayloadSize> msg;
+        msg[0] = group;
+        msg[1] = toInt(command);
+        std::memcpy(msg.data() + sizeMsgGroup, body.data(), body.size());
+
+        return driver_.sendMessage(Command::Group, GeneralCallAddress, std::span<uint8_t>(msg.data(), sizeMsgGroup + body.size()));
+    }
+
+    /**
+     * @brief Send a message to all members of a group.
+     */
+    template <class Msg>
+    bool sendToGroup(uint8_t group, Command command, const Msg& msg)
+    {
+        return sendToGroup(group, command, std::span<const uint8_t>(reinterpret_cast<const uint8_t*>(&msg), sizeof(Msg)));
     }
 
     inline bool haveController() const { return controllerAddress_ != GeneralCallAddress; }
-    inline bool needAddress() const { return driver_.listenAddress() == GeneralCallAddress; }
+    inline bool needAddress() const { return (driver_.listenAddress() == GeneralCallAddress) || (leased_ && !confirmed_); }
 
     /**
-     * @brief A non-bus controller can call this to request an address from the bus controller.
+     * @brief A non-bus controller can call this regularly to request an address from the bus controller. The Hello is
+     *        sent in a random slot, and repeated in a larger window for as long as no address was assigned. With a
+     *        resumed lease, the first Hello waits an extra grace period for a ConfirmLease.
      */
     void requestAddressIfNeeded() {
-        if (haveController() && needAddress()) {
-            sendHello(controllerAddress_, deviceId_);
+        if (!haveController() || !needAddress()) {
+            attempt_ = 0;
+            helloScheduled_ = false;
+            return;
         }
+        const uint64_t now = RaspberryPi::timeUs();
+        if (!helloScheduled_) {
+            scheduleHello(now);
+        }
+        if (now < nextHelloUs_) {
+            return;
+        }
+        sendHello(controllerAddress_, deviceId_);
+        attempt_++;
+        scheduleHello(now);
     }
 
-    inline void registerAsDevice() {
-        driver_.registerHandler(Command::Hello, "MsgHello handler",
-                                [this]([[maybe_unused]] Command command, uint8_t sender, const std::vector<uint8_t>& data) {
-            if (data.size() != sizeMsgHello) {
-                driver_.i2cIn().log(std::format("Dropping Hello message: size {} does not match expected {}.", data.size(), sizeMsgHello));
+    /**
+     * @brief Handle a raw Hello message, as received by the ProtocolDriver.
+     */
+    void handleHello([[maybe_unused]] Command command, uint8_t sender, std::span<const uint8_t> data) {
+        if ((data.size() != sizeMsgHello) && (data.size() != sizeMsgHelloWithHash)) {
+            driver_.log(std::format("Dropping Hello message: size {} does not match expected {} or {}.", data.size(), sizeMsgHello, sizeMsgHelloWithHash));
 
-                return;
-            }
-            MsgHello msg;
-            std::memcpy(&msg.boardId.bytes[0], data.data(), idSize);
+            return;
+        }
+        MsgHello msg;
+        std::memcpy(&msg.boardId.bytes[0], data.data(), idSize);
+        if (data.size() == sizeMsgHelloWithHash) {
+            std::memcpy(&msg.descriptorHash, data.data() + idSize, sizeof(msg.descriptorHash));
+        }
 
-            handle(sender, msg);
-        });
+        handle(sender, msg);
+    }
 
-        driver_.registerHandler(Command::SetAddress, "MsgSetAddress handler",
-                                [this]([[maybe_unused]] Command command, [[maybe_unused]] uint8_t sender, const std::vector<uint8_t>& data) {
-            if (data.size() != sizeMsgSetAddress) {
-                driver_.i2cIn().log(std::format("Dropping SetAddress message: size {} does not match expected {}.", data.size(), sizeMsgSetAddress));
-                return;
-            }
-            MsgSetAddress msg;
-            std::memcpy(&msg.boardId.bytes[0], data.data(), idSize);
-            msg.address = data[idSize];
-            handle(msg);
-        });
+    /**
+     * @brief Handle a raw SetAddress message, as received by the ProtocolDriver. It may hold several assignments.
+     */
+    void handleSetAddress([[maybe_unused]] Command command, [[maybe_unused]] uint8_t sender, std::span<const uint8_t> data) {
+        handleAddresses("SetAddress", data);
+    }
+
+    /**
+     * @brief Handle a raw ConfirmLease message, as received by the ProtocolDriver. It may hold several leases.
+     */
+    void handleConfirmLease([[maybe_unused]] Command command, [[maybe_unused]] uint8_t sender, std::span<const uint8_t> data) {
+        handleAddresses("ConfirmLease", data);
+    }
+
+    /**
+     * @brief Handle a raw SetGroup message, as received by the ProtocolDriver.
+     */
+    void handleSetGroup([[maybe_unused]] Command command, [[maybe_unused]] uint8_t sender, std::span<const uint8_t> data) {
+        if (data.size() != sizeMsgSetGroup) {
+            driver_.log(std::format("Dropping SetGroup message: size {} does not match expected {}.", data.size(), sizeMsgSetGroup));
+            return;
+        }
+        MsgSetGroup msg;
+        std::memcpy(&msg.boardId.bytes[0], data.data(), idSize);
+        msg.group = data[idSize];
+        msg.member = data[idSize + 1];
+        handle(msg);
+    }
+
+    inline void registerAsDevice() {
+        driver_.template registerHandler<&I2CDeviceHandler::handleHello>(Command::Hello, "MsgHello handler", *this);
+        driver_.template registerHandler<&I2CDeviceHandler::handleSetAddress>(Command::SetAddress, "MsgSetAddress handler", *this);
+        driver_.template registerHandler<&I2CDeviceHandler::handleSetGroup>(Command::SetGroup, "MsgSetGroup handler", *this);
+        driver_.template registerHandler<&I2CDeviceHandler::handleConfirmLease>(Command::ConfirmLease, "MsgConfirmLease handler", *this);
     }
 };
 
@@ -0,0 +1,214 @@
+#pragma once
+/*
+ * Copyright (c) 2024 by Bert Laverman. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#include <span>
+#include <array>
+#include <optional>
+#include <algorithm>
+
+#include <protocols/messages.hpp>
+#include <protocols/i2c-integrity.hpp>
+
+
+namespace nl::rakis::raspberrypi::protocols {
+
+
+/**
+ * @brief Splits a stream of received bytes into frames, for listeners that receive data in chunks that need not line up
+ *        with the frames, such as the BSC peripheral.
+ *
+ * Bytes are kept in a fixed circular buffer, and parsing resumes where it left off when more arrive. A frame is handed
+ * out as a view into the buffer, and only copied if it wraps around the end. If a frame fails its integrity check, or
+ * announces an unknown integrity check, only its first byte is dropped and the search for a header starts again at the
+ * next one. A garbled length byte therefore costs just the damaged frame, not the ones that follow it. Only the first
+ * failure is reported until a good frame is found again. While searching, a frame must use the same integrity check as
+ * the last good one, so stray bytes cannot pass for a frame with a weak XOR checksum on a link that uses CRCs. Until
+ * the first good frame any known integrity check is accepted, as the parser cannot yet know which one the link uses.
+ *
+ * @tparam Capacity The size of the buffer, a power of two that holds at least two complete frames.
+ */
+template <std::size_t Capacity = 1024>
+class FrameParser {
+    static_assert((Capacity & (Capacity - 1)) == 0, "The capacity of a FrameParser must be a power of two");
+    static_assert(Capacity >= 2 * MaxFrameSize, "A FrameParser must be able to hold two complete frames");
+
+    static constexpr std::size_t mask = Capacity - 1;
+
+    std::array<uint8_t, Capacity> ring_;
+    std::array<uint8_t, MaxFrameSize> scratch_;
+    std::size_t head_{ 0 };
+    std::size_t tail_{ 0 };
+    bool resyncing_{ false };
+    std::optional<IntegrityKind> lastKind_;
+
+    uint32_t frames_{ 0 };
+    uint32_t skipped_{ 0 };
+    uint32_t overflows_{ 0 };
+
+    /**
+     * @brief Return a view of the next bytes, copying them to the scratch buffer if they wrap around.
+     */
+    std::span<uint8_t> view(std::size_t offset, std::size_t size) noexcept {
+        const std::size_t start = (head_ + offset) & mask;
+        if ((start + size) <= Capacity) {
+            return std::span<uint8_t>(ring_.data() + start, size);
+        }
+        const std::size_t first = Capacity - start;
+        std::memcpy(scratch_.data(), ring_.data() + start, first);
+        std::memcpy(scratch_.data() + first, ring_.data(), size - first);
+
+        return std::span<uint8_t>(scratch_.data(), size);
+    }
+
+    /**
+     * @brief Drop the first byte, and look for a header from the next one on.
+     */
+    void skip() noexcept {
+        head_++;
+        skipped_++;
+        resyncing_ = true;
+    }
+
+public:
+    FrameParser() = default;
+    FrameParser(const FrameParser&) = default;
+    FrameParser(FrameParser&&) = default;
+    ~FrameParser() = default;
+
+    FrameParser& operator=(const FrameParser&) = default;
+    FrameParser& operator=(FrameParser&&) = default;
+
+    /**
+     * @brief Return the number of bytes waiting to be parsed.
+     */
+    std::size_t size() const noexcept { return tail_ - head_; }
+
+    /**
+     * @brief Return the number of good frames found.
+     */
+    uint32_t frames() const noexcept { return frames_; }
+
+    /**
+     * @brief Return the number of bytes dropped to find the next header.
+     */
+    uint32_t skipped() const noexcept { return skipped_; }
+
+    /**
+     * @brief Return the number of times bytes were dropped because the buffer was full.
+     */
+    uint32_t overflows() const noexcept { return overflows_; }
+
+    /**
+     * @brief Add received bytes. If they do not fit, the oldest bytes are dropped, as those are most likely the start
+     *        of a frame that never completed.
+     */
+    void push(std::span<const uint8_t> data) noexcept {
+        if (data.size() > Capacity) {
+            data = data.last(Capacity);
+        }
+        if (data.size() > (Capacity - size())) {
+            head_ = tail_ + data.size() - Capacity;
+            resyncing_ = true;
+            overflows_++;
+        }
+        const std::size_t start = tail_ & mask;
+        const std::size_t first = std::min(data.size(), Capacity - start);
+        std::memcpy(ring_.data() + start, data.data(), first);
+        std::memcpy(ring_.data(), data.data() + first, data.size() - first);
+        tail_ += data.size();
+    }
+
+    /**
+     * @brief Hand out all complete frames. The payload is only valid during the call.
+     *
+     * @param onFrame   Called as onFrame(const MsgHeader&, std::span<uint8_t> payload) for every intact frame.
+     * @param onCorrupt Called as onCorrupt(const MsgHeader&) for the first damaged frame after a good one.
+     * @return The number of intact frames handed out.
+     */
+    template <class OnFrame, class OnCorrupt>
+    unsigned parse(OnFrame&& onFrame, OnCorrupt&& onCorrupt) {
+        unsigned count{ 0 };
+
+        while (size() >= MsgHeaderSize) {
+            MsgHeader header;
+            std::memcpy(&header, view(0, MsgHeaderSize).data(), MsgHeaderSize);
+
+            if (!knownIntegrity(header) || (resyncing_ && lastKind_ && (integrityOf(header) != *lastKind_))) {
+                if (!resyncing_) {
+                    onCorrupt(header);
+                }
+                skip();
+                continue;
+            }
+            const auto trailer = trailerSize(integrityOf(header));
+            const auto frameSize = MsgHeaderSize + header.length + trailer;
+            if (size() < frameSize) {
+                break;
+            }
+            auto frame = view(0, frameSize);
+            auto payload = frame.subspan(MsgHeaderSize, header.length);
+
+            if (!verify(header, payload, frame.subspan(MsgHeaderSize + header.length, trailer))) {
+                if (!resyncing_) {
+                    onCorrupt(header);
+                }
+                skip();
+                continue;
+            }
+            resyncing_ = false;
+            lastKind_ = integrityOf(header);
+            frames_++;
+            count++;
+            onFrame(header, payload);
+
+            head_ += frameSize;
+        }
+        return count;
+    }
+
+    /**
+     * @brief Give up on an incomplete frame, when the stream went quiet and it will not be completed. Bytes are dropped
+     *        one at a time until the rest parses, so a garbled length cannot hold back the frames after it.
+     *
+     * @return The number of intact frames handed out.
+     */
+    template <class OnFrame, class OnCorrupt>
+    unsigned flush(OnFrame&& onFrame, OnCorrupt&& onCorrupt) {
+        unsigned count{ 0 };
+
+        while (size() > 0) {
+            skip();
+            count += parse(onFrame, onCorrupt);
+        }
+        return count;
+    }
+
+    /**
+     * @brief Drop all bytes.
+     */
+    void clear() noexcept {
+        head_ = tail_;
+        resyncing_ = false;
+    }
+};
+
+} // namespace nl::rakis::raspberrypi::protocols
@@ -0,0 +1,178 @@
+#pragma once
+/*
+ * Copyright (c) 2024 by Bert Laverman. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <cstddef>
+#include <cstdint>
+
+#include <span>
+#include <array>
+
+#include <util/crc.hpp>
+#include <protocols/messages.hpp>
+
+
+namespace nl::rakis::raspberrypi::protocols {
+
+/**
+ * @brief Message header
+ *
+ * In the original (version 0) header, "checksum" is the XOR of all payload bytes. If the top bit of "sender" is set, the
+ * header is version 1, and "checksum" instead tells which integrity check is used. For the CRC checks, the CRC follows
+ * the payload in big-endian order, and covers both the header and the payload. It is not counted in "length".
+ */
+struct MsgHeader {
+    uint8_t command;
+    uint8_t length;
+    uint8_t sender;
+    uint8_t checksum;
+};
+constexpr unsigned MsgHeaderSize = sizeof(MsgHeader);
+
+/**
+ * @brief The flag in MsgHeader::sender that marks a version 1 header. I2C addresses only use seven bits.
+ */
+inline constexpr uint8_t HeaderV1Flag = 0x80;
+
+/**
+ * @brief The integrity checks a message can use.
+ */
+enum class IntegrityKind : uint8_t {
+    Xor8    = 0x00,     // Version 0 header, XOR of the payload bytes
+    Crc16   = 0x01,     // CRC-16/CCITT-FALSE trailer
+    Crc32   = 0x02,     // CRC-32/MPEG-2 trailer
+};
+
+/**
+ * @brief The largest trailer any integrity check adds.
+ */
+inline constexpr std::size_t MaxTrailerSize = sizeof(uint32_t);
+
+/**
+ * @brief The largest complete frame: header, payload, and trailer.
+ */
+inline constexpr std::size_t MaxFrameSize = MsgHeaderSize + MaxPayloadSize + MaxTrailerSize;
+
+/**
+ * @brief Return the number of bytes the integrity check adds after the payload.
+ */
+inline constexpr std::size_t trailerSize(IntegrityKind kind) noexcept {
+    switch (kind) {
+    case IntegrityKind::Crc16: return sizeof(uint16_t);
+    case IntegrityKind::Crc32: return sizeof(uint32_t);
+    default:                   return 0;
+    }
+}
+
+/**
+ * @brief Return the address of the sender, without the version flag.
+ */
+inline constexpr uint8_t senderOf(const MsgHeader& header) noexcept { return header.sender & ~HeaderV1Flag; }
+
+/**
+ * @brief Return the integrity check used for a message, based on its header.
+ */
+inline constexpr IntegrityKind integrityOf(const MsgHeader& header) noexcept {
+    return ((header.sender & HeaderV1Flag) == 0) ? IntegrityKind::Xor8 : static_cast<IntegrityKind>(header.checksum);
+}
+
+/**
+ * @brief Check if we know the integrity check a header announces.
+ */
+inline constexpr bool knownIntegrity(const MsgHeader& header) noexcept {
+    const auto kind = integrityOf(header);
+    return (kind == IntegrityKind::Xor8) || (kind == IntegrityKind::Crc16) || (kind == IntegrityKind::Crc32);
+}
+
+/**
+ * @brief Return the XOR of all bytes, as used by version 0 headers.
+ */
+inline constexpr uint8_t xorChecksum(std::span<const uint8_t> data) noexcept {
+    uint8_t checksum = 0;
+    for (auto byte : data) {
+        checksum ^= byte;
+    }
+    return checksum;
+}
+
+/**
+ * @brief Return the header as bytes, for computing a CRC.
+ */
+inline std::span<const uint8_t, MsgHeaderSize> headerBytes(const MsgHeader& header) noexcept {
+    return std::span<const uint8_t, MsgHeaderSize>(reinterpret_cast<const uint8_t*>(&header), MsgHeaderSize);
+}
+
+/**
+ * @brief Fill in the header fields for the integrity check, and write the trailer (if any).
+ *
+ * @param header  The header, with command, length, and sender already set.
+ * @param payload The payload.
+ * @param trailer Receives the trailer.
+ * @param kind    The integrity check to use.
+ * @return The number of trailer bytes written.
+ */
+inline std::size_t seal(MsgHeader& header, std::span<const uint8_t> payload, std::span<uint8_t, MaxTrailerSize> trailer, IntegrityKind kind) noexcept {
+    if (kind == IntegrityKind::Xor8) {
+        header.sender &= ~HeaderV1Flag;
+        header.checksum = xorChecksum(payload);
+
+        return 0;
+    }
+    header.sender |= HeaderV1Flag;
+    header.checksum = static_cast<uint8_t>(kind);
+
+    if (kind == IntegrityKind::Crc16) {
+        const uint16_t crc = util::Crc16().update(headerBytes(header)).update(payload).value();
+        trailer[0] = static_cast<uint8_t>(crc >> 8);
+        trailer[1] = static_cast<uint8_t>(crc);
+    } else {
+        const uint32_t crc = util::Crc32().update(headerBytes(header)).update(payload).value();
+        trailer[0] = static_cast<uint8_t>(crc >> 24);
+        trailer[1] = static_cast<uint8_t>(crc >> 16);
+        trailer[2] = static_cast<uint8_t>(crc >> 8);
+        trailer[3] = static_cast<uint8_t>(crc);
+    }
+    return trailerSize(kind);
+}
+
+/**
+ * @brief Check a received message.
+ *
+ * @param header  The received header.
+ * @param payload The received payload.
+ * @param trailer The received trailer, which must be trailerSize(integrityOf(header)) bytes.
+ * @return true if the message is intact.
+ */
+inline bool verify(const MsgHeader& header, std::span<const uint8_t> payload, std::span<const uint8_t> trailer) noexcept {
+    if ((payload.size() != header.length) || !knownIntegrity(header)) {
+        return false;
+    }
+    const auto kind = integrityOf(header);
+    if (trailer.size() != trailerSize(kind)) {
+        return false;
+    }
+    switch (kind) {
+    case IntegrityKind::Crc16:
+        return util::Crc16().update(headerBytes(header)).update(payload).update(trailer).value() == 0;
+    case IntegrityKind::Crc32:
+        return util::Crc32().update(headerBytes(header)).update(payload).update(trailer).value() == 0;
+    default:
+        return xorChecksum(payload) == header.checksum;
+    }
+}
+
+} // namespace nl::rakis::raspberrypi::protocols
@@ -23,16 +23,21 @@
 #include <map>
 #include <span>
 #include <list>
+#include <array>
 #include <tuple>
 #include <vector>
 #include <memory>
 
 #if !defined(TARGET_PICO)
 #include <format>
+#include <future>
 #endif
 
 #include <interfaces/i2c.hpp>
+#include <protocols/i2c-batch.hpp>
+#include <protocols/i2c-integrity.hpp>
 #include <protocols/protocol-driver.hpp>
+#include <protocols/protocol-metrics.hpp>
 
 
 namespace nl::rakis::raspberrypi::protocols {
@@ -40,12 +45,27 @@ namespace nl::rakis::raspberrypi::protocols {
 
 /**
  * @brief This class manages communication through I2C, using one bus for incoming, and another for outgoing messages.
+ *
+ * Messages sent through the outgoing queue are combined per address into "Batch" messages, so a burst of small updates
+ * costs one I2C transaction per recipient instead of one per message. If the outgoing interface can batch writes, the
+ * frames for all recipients are then handed to it at once.
  */
-template <typename QueueImpl>
-class I2CProtocolDriver : public ProtocolDriver<QueueImpl> {
+template <typename QueueImpl, typename OutQueueImpl = QueueImpl>
+class I2CProtocolDriver : public ProtocolDriver<QueueImpl, OutQueueImpl> {
+#if defined(TARGET_PICO)
+    static constexpr unsigned MaxOpenBatches = 8;
+#else
+    static constexpr unsigned MaxOpenBatches = 32;
+#endif
+
     std::shared_ptr<interfaces::I2C> i2cOut_;
     std::shared_ptr<interfaces::I2C> i2cIn_;
 
+    IntegrityKind integrity_{ IntegrityKind::Xor8 };
+    bool batching_{ true };
+    unsigned openBatches_{ 0 };
+    std::array<BatchFrame, MaxOpenBatches> batches_;
+
 protected:
     /**
      * @brief Reset the I2C protocol driver. If operating in dual mode, set both in their correct modes.
@@ -65,17 +85,232 @@ protected:
     }
 
     /**
-     * @brief Compute a (simple) checksum.
+     * @brief Build a complete frame, with header, payload, and trailer, in the given buffer.
+     *
+     * @return The part of the buffer holding the frame.
+     */
+    std::span<uint8_t> buildFrame(Command command, std::span<const uint8_t> msg, std::array<uint8_t, MaxFrameSize>& buffer) {
+        MsgHeader header{
+            static_cast<uint8_t>(command),
+            static_cast<uint8_t>(msg.size()),
+            listenAddress(),
+            0x00
+        };
+        std::array<uint8_t, MaxTrailerSize> trailer;
+        const auto trailerLength = seal(header, msg, trailer, integrity_);
+
+        std::memcpy(buffer.data(), &header, MsgHeaderSize);
+        std::memcpy(buffer.data() + MsgHeaderSize, msg.data(), msg.size());
+        std::memcpy(buffer.data() + MsgHeaderSize + msg.size(), trailer.data(), trailerLength);
+
+        return std::span<uint8_t>(buffer.data(), MsgHeaderSize + msg.size() + trailerLength);
+    }
+
+    /**
+     * @brief Check the message, and send it as a single frame, waiting for the transfer to finish.
+     */
+    bool writeFrame(Command command, uint8_t address, std::span<const uint8_t> msg) {
+        if (!i2cOut_) {
+            this->log("No outgoing I2C interface available, cannot send message.");
+            return false;
+        }
+        if (msg.size() > MaxPayloadSize) {
+            this->template log<util::LogLevel::Warning>("Payload of {} bytes is too large to send.", msg.size());
+            return false;
+        }
+        MsgHeader header{
+            static_cast<uint8_t>(command),
+            static_cast<uint8_t>(msg.size()),
+            listenAddress(),
+            0x00
+        };
+        std::array<uint8_t, MaxTrailerSize> trailer;
+        const auto trailerLength = seal(header, msg, trailer, integrity_);
+
+        const std::array<std::span<const uint8_t>, 3> parts{
+            headerBytes(header),
+            msg,
+            std::span<const uint8_t>(trailer.data(), trailerLength)
+        };
+
+        this->trace("writeFrame(0x{:02x}, 0x{:02x}, [{} bytes payload, {} total message size])", address, toInt(command), msg.size(), MsgHeaderSize + msg.size() + trailerLength);
+
+        const uint32_t start = static_cast<uint32_t>(RaspberryPi::timeUs());
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+        const bool success = i2cOut_->write(address, parts);
+#pragma GCC diagnostic pop
+        this->metrics().sent(command, msg.size(), success, elapsedUs(start));
+
+        return success;
+    }
+
+    /**
+     * @brief Check the message, build its frame, and hand it to the outgoing interface to send asynchronously.
+     */
+    bool writeFrameAsync(Command command, uint8_t address, std::span<const uint8_t> msg, interfaces::WriteCompletion completion) {
+        if (!i2cOut_) {
+            this->log("No outgoing I2C interface available, cannot send message.");
+            return false;
+        }
+        if (msg.size() > MaxPayloadSize) {
+            this->template log<util::LogLevel::Warning>("Payload of {} bytes is too large to send.", msg.size());
+            return false;
+        }
+        std::array<uint8_t, MaxFrameSize> buffer;
+        auto data = buildFrame(command, msg, buffer);
+
+        return i2cOut_->writeAsync(address, data, std::move(completion));
+    }
+
+    /**
+     * @brief Return the time since the given (truncated) start time, in microseconds.
+     */
+    static uint32_t elapsedUs(uint32_t start) noexcept { return static_cast<uint32_t>(RaspberryPi::timeUs()) - start; }
+
+    /**
+     * @brief Send a message taken from the outgoing queue without waiting for the transfer, logging if nobody answered.
+     */
+    void sendOutgoingMessage(Command command, uint8_t address, std::span<const uint8_t> data, uint8_t records = 1) {
+        util::TraceScope trace(util::TracePoint::MessageSent, toInt(command));
+
+#if defined(TARGET_PICO)
+        // The Pico's interfaces write synchronously anyway, and on a 32-bit target the completion below does not fit
+        // inside a std::function, so it would cost an allocation per message.
+        if (!writeFrame(command, address, data)) {
+            this->flowControl().unsent(address, records);
+            this->debug("Failed to send {} to {}, no response.", toInt(command), address);
+        }
+#else
+        // On a 64-bit target this capture is small enough for std::function to store it without allocating.
+        const uint32_t start = static_cast<uint32_t>(RaspberryPi::timeUs());
+        const uint8_t size = static_cast<uint8_t>(data.size());
+
+        const bool queued = writeFrameAsync(command, address, data, [this, command, address, size, records, start](bool success) {
+            this->metrics().sent(command, size, success, elapsedUs(start));
+            if (!success) {
+                this->flowControl().unsent(address, records);
+                this->debug("Failed to send {} to {}, no response.", toInt(command), address);
+            }
+        });
+        if (!queued) {
+            this->flowControl().unsent(address, records);
+            this->metrics().dropped();
+            this->template log<util::LogLevel::Warning>("Could not queue {} for {}, dropping it.", toInt(command), address);
+        }
+#endif
+    }
+
+    /**
+     * @brief Send a batch taken from the outgoing queue, or the message in it as is if it is the only one.
+     */
+    void sendOutgoingBatch(const BatchFrame& batch) {
+        if (batch.records() == 1) {
+            sendOutgoingMessage(batch.firstCommand(), batch.address(), batch.firstPayload());
+        } else {
+            sendOutgoingMessage(Command::Batch, batch.address(), batch.payload(), static_cast<uint8_t>(batch.records()));
+        }
+    }
+
+    /**
+     * @brief Return the open batch for an address, or nullptr if there is none.
+     */
+    BatchFrame* openBatch(uint8_t address) noexcept {
+        for (unsigned i = 0; i < openBatches_; ++i) {
+            if (batches_[i].address() == address) {
+                return &batches_[i];
+            }
+        }
+        return nullptr;
+    }
+
+    /**
+     * @brief Add a message from the outgoing queue to the batch for its address. A batch that is full is sent first. A
+     *        message that is sent on its own, because it does not fit in a batch, is sent after the open batch for its
+     *        address, so it does not overtake the messages queued before it.
+     */
+    virtual void sendOutgoing(Command command, uint8_t address, std::span<const uint8_t> data) override {
+        this->countSent(address);
+
+        BatchFrame* batch = openBatch(address);
+        if (!batching_ || (data.size() > BatchFrame::maxRecordSize())) {
+            if (batch != nullptr) {
+                sendOutgoingBatch(*batch);
+                *batch = batches_[--openBatches_];
+            }
+            sendOutgoingMessage(command, address, data);
+            return;
+        }
+        if (batch == nullptr) {
+            if (openBatches_ == MaxOpenBatches) {
+                flushOutgoing();
+            }
+            batch = &batches_[openBatches_++];
+            batch->start(address);
+        } else if (!batch->fits(data.size())) {
+            sendOutgoingBatch(*batch);
+            batch->start(address);
+        }
+        batch->add(command, data);
+    }
+
+    /**
+     * @brief Send all open batches with a single writeBatch() on the outgoing interface, and record the result of each.
+     */
+    void sendOutgoingBatches() {
+        std::array<std::array<uint8_t, MaxFrameSize>, MaxOpenBatches> frames;
+        std::array<interfaces::WriteRequest, MaxOpenBatches> requests;
+        std::array<Command, MaxOpenBatches> commands;
+        std::array<uint8_t, MaxOpenBatches> sizes;
+
+        for (unsigned i = 0; i < openBatches_; ++i) {
+            const auto& batch = batches_[i];
+            const bool single = (batch.records() == 1);
+            const auto payload = single ? batch.firstPayload() : batch.payload();
+            commands[i] = single ? batch.firstCommand() : Command::Batch;
+            sizes[i] = static_cast<uint8_t>(payload.size());
+            requests[i] = interfaces::WriteRequest{ batch.address(), buildFrame(commands[i], payload, frames[i]) };
+        }
+        const uint32_t start = static_cast<uint32_t>(RaspberryPi::timeUs());
+        i2cOut_->writeBatch(std::span<interfaces::WriteRequest>(requests.data(), openBatches_));
+        const uint32_t elapsed = elapsedUs(start);
+
+        for (unsigned i = 0; i < openBatches_; ++i) {
+            const auto& request = requests[i];
+            this->metrics().sent(commands[i], sizes[i], request.success, elapsed);
+            if (!request.success) {
+                this->flowControl().unsent(request.address, batches_[i].records());
+                this->debug("Failed to send {} to {}, no response.", toInt(commands[i]), request.address);
+            }
+        }
+    }
+
+    /**
+     * @brief Send all open batches, together if the outgoing interface can batch writes.
+     */
+    virtual void flushOutgoing() override {
+        if ((openBatches_ > 1) && i2cOut_ && i2cOut_->canBatch()) {
+            sendOutgoingBatches();
+        } else {
+            for (unsigned i = 0; i < openBatches_; ++i) {
+                sendOutgoingBatch(batches_[i]);
+            }
+        }
+        openBatches_ = 0;
+    }
+
+    /**
+     * @brief Let the listening interface deliver the frames it received.
      */
-    uint8_t computeChecksum(std::span<uint8_t> data) {
-        uint8_t checksum = 0;
-        for (auto it = data.begin(); it != data.end(); ++it) {
-            checksum ^= *it;
+    virtual void pollIncoming() override {
+        if (i2cIn_) {
+            i2cIn_->poll();
         }
-        return checksum;
     }
 
 public:
+    using ProtocolDriver<QueueImpl, OutQueueImpl>::sendMessage;
+
     I2CProtocolDriver() = default;
 
     virtual ~I2CProtocolDriver() {}
@@ -101,6 +336,50 @@ public:
     void i2cOut(std::shared_ptr<interfaces::I2C> i2c) { i2cOut_ = i2c; }
     std::weak_ptr<interfaces::I2C> i2cOut() const { return i2cOut_; }
 
+    /**
+     * @brief Add the incoming interface to a device group, so "Group" messages for it are received.
+     */
+    void joinGroup(uint8_t group) {
+        if (i2cIn_) {
+            i2cIn_->joinGroup(group);
+        }
+    }
+
+    /**
+     * @brief Remove the incoming interface from a device group.
+     */
+    void leaveGroup(uint8_t group) {
+        if (i2cIn_) {
+            i2cIn_->leaveGroup(group);
+        }
+    }
+
+    /**
+     * @brief Return the groups the incoming interface is a member of, as a bitmask.
+     */
+    uint32_t groups() const noexcept { return i2cIn_ ? i2cIn_->groups() : 0; }
+
+    /**
+     * @brief Set the integrity check for outgoing messages. Xor8 sends version 0 headers, which older firmware expects.
+     *        Receivers accept all kinds, as the header tells them which one was used.
+     */
+    void integrity(IntegrityKind kind) noexcept { integrity_ = kind; }
+
+    /**
+     * @brief Return the integrity check used for outgoing messages.
+     */
+    IntegrityKind integrity() const noexcept { return integrity_; }
+
+    /**
+     * @brief Set if messages from the outgoing queue are combined into "Batch" messages. This is on by default.
+     */
+    void batching(bool batching) noexcept { batching_ = batching; }
+
+    /**
+     * @brief Check if messages from the outgoing queue are combined into "Batch" messages.
+     */
+    bool batching() const noexcept { return batching_; }
+
     /**
      * @brief Initialize the protocol driver for usage.
      */
@@ -159,8 +438,8 @@ public:
      */
     virtual void startListening() override {
         if (i2cIn_) {
-            i2cIn_->callback([this](Command command, uint8_t sender, const std::span<uint8_t> data) {
-                this->pushIncoming(command, sender, data);
+            i2cIn_->callback([this](Command command, uint8_t sender, const std::span<uint8_t> data, bool generalCall) {
+                this->pushIncoming(command, sender, data, generalCall);
             });
             i2cIn_->startListening();
         } else {
@@ -201,29 +480,80 @@ public:
      * @param msg     The payload of the message.
      */
     virtual bool sendMessage(Command command, uint8_t address, const std::span<uint8_t> msg) override {
-        if (!i2cOut_) {
-            this->log("No outgoing I2C interface available, cannot send message.");
-            return false;
+        const bool success = writeFrame(command, address, msg);
+        if (success) {
+            this->countSent(address);
         }
-        std::vector<uint8_t> data(MsgHeaderSize + msg.size(), 0x00);
-        std::memcpy(data.data() + MsgHeaderSize, msg.data(), msg.size());
+        return success;
+    }
 
-        if (this->verbose()) {
-            this->log(std::format("sendMessage(0x{:02x}, 0x{:02x}, [{} bytes payload, {} total message size])", address, toInt(command), msg.size(), data.size()));
+    /**
+     * @brief Send a message without waiting for the transfer to finish. Whether that is actually the case depends on the
+     *        outgoing interface: a ThreadedI2C queues it for its transmit thread, others send it immediately.
+     *
+     * @param command    The command to send.
+     * @param address    The address to send it to.
+     * @param msg        The payload of the message, which is copied.
+     * @param completion Called with the result, possibly on another thread. It is stored in the same WriteCompletion as
+     *                   the metrics update, so pass a lambda rather than a std::function.
+     * @return false if the message could not be queued, in which case the completion is not called.
+     */
+    template <class Completion>
+    bool sendMessageAsync(Command command, uint8_t address, std::span<const uint8_t> msg, Completion&& completion) {
+        const uint32_t start = static_cast<uint32_t>(RaspberryPi::timeUs());
+        const uint8_t size = static_cast<uint8_t>(msg.size());
+
+        const bool queued = writeFrameAsync(command, address, msg, [this, command, address, size, start, completion = std::forward<Completion>(completion)](bool success) mutable {
+            this->metrics().sent(command, size, success, elapsedUs(start));
+            if (!success) {
+                this->flowControl().unsent(address);
+            }
+            completion(success);
+        });
+        if (queued) {
+            this->countSent(address);
+        } else {
+            this->metrics().dropped();
         }
+        return queued;
+    }
 
-        MsgHeader header{
-            static_cast<uint8_t>(command),
-            static_cast<uint8_t>(msg.size()),
-            listenAddress(),
-            computeChecksum(msg)
-        };
-        std::memcpy(data.data(), &header, MsgHeaderSize);
+#if !defined(TARGET_PICO)
+    /**
+     * @brief Send a message without waiting for the transfer to finish.
+     *
+     * @return A future for the result, which is false if nobody answered or the message could not be queued.
+     */
+    std::future<bool> sendMessageAsync(Command command, uint8_t address, std::span<const uint8_t> msg) {
+        auto promise = std::make_shared<std::promise<bool>>();
+        auto result = promise->get_future();
 
-#pragma GCC diagnostic push
-#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
-        return i2cOut_->write(address, data);
-#pragma GCC diagnostic pop
+        if (!sendMessageAsync(command, address, msg, [promise](bool success) { promise->set_value(success); })) {
+            promise->set_value(false);
+        }
+        return result;
+    }
+#endif
+
+    /**
+     * @brief Send the metrics of this driver and its interfaces as one or more "Log" messages, for example to let a Pico
+     *        report to the bus controller.
+     *
+     * @return true if all pages were sent.
+     */
+    bool sendMetrics(uint8_t address) {
+        static const LinkMetrics none;
+        const LinkMetrics& incoming = i2cIn_ ? i2cIn_->metrics() : none;
+        const LinkMetrics& outgoing = i2cOut_ ? i2cOut_->metrics() : none;
+
+        std::array<uint8_t, MaxPayloadSize> page;
+        unsigned cursor{ 0 };
+        bool success{ true };
+        while (cursor <= ProtocolMetrics::TrackedCommands) {
+            const auto size = encodeMetrics(this->metrics(), incoming, outgoing, cursor, page);
+            success = sendMessage(Command::Log, address, std::span<uint8_t>(page.data(), size)) && success;
+        }
+        return success;
     }
 
 };
@@ -0,0 +1,273 @@
+/*
+ * Copyright (c) 2024 by Bert Laverman. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <cstring>
+
+#include <array>
+#include <format>
+#include <algorithm>
+
+#include <interfaces/virtual-i2c.hpp>
+#include <protocols/protocol-driver.hpp>
+
+
+using namespace nl::rakis::raspberrypi::interfaces;
+using namespace nl::rakis::raspberrypi::protocols;
+
+
+void VirtualBus::attach(VirtualI2C& endpoint)
+{
+    std::lock_guard<std::recursive_mutex> lock(mutex_);
+
+    if (std::find(endpoints_.begin(), endpoints_.end(), &endpoint) == endpoints_.end()) {
+        endpoints_.push_back(&endpoint);
+    }
+}
+
+void VirtualBus::detach(VirtualI2C& endpoint)
+{
+    std::lock_guard<std::recursive_mutex> lock(mutex_);
+
+    std::erase(endpoints_, &endpoint);
+}
+
+std::size_t VirtualBus::endpoints() const
+{
+    std::lock_guard<std::recursive_mutex> lock(mutex_);
+
+    return endpoints_.size();
+}
+
+bool VirtualBus::transfer(VirtualI2C& from, uint8_t address, std::span<const uint8_t> data)
+{
+    std::lock_guard<std::recursive_mutex> lock(mutex_);
+
+    const uint64_t requested = from.nowNs();
+    const uint64_t bitNs = clocks(1);
+    uint64_t start = requested;
+    if (requested < idleAtNs_) {
+        // If we were already trying when the last transfer started, we took part in its arbitration, and lost.
+        if (requested < (lastStartNs_ + bitNs)) {
+            arbitrationLosses_++;
+        } else {
+            waits_++;
+        }
+        start = idleAtNs_;
+    }
+
+    std::vector<VirtualI2C*> receivers;
+    uint32_t stretchNs{ 0 };
+    for (auto endpoint : endpoints_) {
+        if ((endpoint != &from) && endpoint->accepts(address)) {
+            receivers.push_back(endpoint);
+            stretchNs = std::max(stretchNs, endpoint->stretchNs());
+        }
+    }
+
+    // START, the address byte, and STOP. If nobody acknowledges the address, that is where it ends.
+    constexpr uint64_t startAndStop = 2;
+    uint64_t duration = clocks(9 + startAndStop);
+    if (receivers.empty()) {
+        nacks_++;
+    } else {
+        duration += clocks(9 * data.size()) + data.size() * stretchNs;
+        bytes_ += data.size();
+    }
+    lastStartNs_ = start;
+    idleAtNs_ = start + duration;
+    busyNs_ += duration;
+    transfers_++;
+
+    from.nowNs(idleAtNs_);
+    for (auto receiver : receivers) {
+        receiver->receive(address, data, idleAtNs_);
+    }
+    return !receivers.empty();
+}
+
+uint64_t VirtualBus::idleAtNs() const
+{
+    std::lock_guard<std::recursive_mutex> lock(mutex_);
+
+    return idleAtNs_;
+}
+
+uint64_t VirtualBus::transfers() const
+{
+    std::lock_guard<std::recursive_mutex> lock(mutex_);
+
+    return transfers_;
+}
+
+uint64_t VirtualBus::bytes() const
+{
+    std::lock_guard<std::recursive_mutex> lock(mutex_);
+
+    return bytes_;
+}
+
+uint64_t VirtualBus::nacks() const
+{
+    std::lock_guard<std::recursive_mutex> lock(mutex_);
+
+    return nacks_;
+}
+
+uint64_t VirtualBus::arbitrationLosses() const
+{
+    std::lock_guard<std::recursive_mutex> lock(mutex_);
+
+    return arbitrationLosses_;
+}
+
+uint64_t VirtualBus::waits() const
+{
+    std::lock_guard<std::recursive_mutex> lock(mutex_);
+
+    return waits_;
+}
+
+uint64_t VirtualBus::busyNs() const
+{
+    std::lock_guard<std::recursive_mutex> lock(mutex_);
+
+    return busyNs_;
+}
+
+double VirtualBus::utilization() const
+{
+    std::lock_guard<std::recursive_mutex> lock(mutex_);
+
+    return (idleAtNs_ == 0) ? 0.0 : double(busyNs_) / double(idleAtNs_);
+}
+
+void VirtualBus::resetStatistics()
+{
+    std::lock_guard<std::recursive_mutex> lock(mutex_);
+
+    transfers_ = 0;
+    bytes_ = 0;
+    nacks_ = 0;
+    arbitrationLosses_ = 0;
+    waits_ = 0;
+    busyNs_ = 0;
+}
+
+
+VirtualI2C::~VirtualI2C()
+{
+    close();
+}
+
+bool VirtualI2C::accepts(uint8_t address) const noexcept
+{
+    if (!listening()) {
+        return false;
+    }
+    return (address == GeneralCallAddress) || ((listenAddress() != GeneralCallAddress) && (address == listenAddress()));
+}
+
+void VirtualI2C::receive(uint8_t address, std::span<const uint8_t> frame, uint64_t arrivedNs)
+{
+    nowNs_ = std::max(nowNs_, arrivedNs);
+
+    if (frame.size() < MsgHeaderSize) {
+        metrics().malformed.add();
+        log(std::format("Dropping a frame of {} bytes, which is too short for a header.", frame.size()));
+
+        return;
+    }
+    MsgHeader header;
+    std::memcpy(&header, frame.data(), MsgHeaderSize);
+
+    if (!knownIntegrity(header)) {
+        metrics().integrityFailures.add();
+        log(std::format("Dropping message from 0x{:02x} with unknown integrity check 0x{:02x}.", senderOf(header), header.checksum));
+
+        return;
+    }
+    const auto trailer = trailerSize(integrityOf(header));
+    if (frame.size() != (MsgHeaderSize + header.length + trailer)) {
+        metrics().malformed.add();
+        log(std::format("Dropping message from 0x{:02x}: {} bytes received for a payload of {}.", senderOf(header), frame.size(), header.length));
+
+        return;
+    }
+
+    std::array<uint8_t, MaxPayloadSize> payload;
+    std::memcpy(payload.data(), frame.data() + MsgHeaderSize, header.length);
+    if (!verify(header, std::span<const uint8_t>(payload.data(), header.length), frame.subspan(MsgHeaderSize + header.length))) {
+        metrics().integrityFailures.add();
+        log(std::format("Dropping message from 0x{:02x} with command 0x{:02x}: integrity check failed.", senderOf(header), header.command));
+
+        return;
+    }
+    if (!deliver(toCommand(header.command), senderOf(header), std::span<uint8_t>(payload.data(), header.length), address == GeneralCallAddress)) {
+        log(std::format("Received message from 0x{:02x} with command 0x{:02x}, but no callback or a malformed batch.", senderOf(header), header.command));
+    }
+}
+
+void VirtualI2C::open()
+{
+    if (!initialized()) {
+        bus_->attach(*this);
+        initialized(true);
+    }
+}
+
+void VirtualI2C::close()
+{
+    if (initialized()) {
+        stopListening();
+        bus_->detach(*this);
+        initialized(false);
+    }
+}
+
+bool VirtualI2C::canListen() const noexcept
+{
+    return true;
+}
+
+void VirtualI2C::startListening()
+{
+    open();
+    listening(true);
+}
+
+void VirtualI2C::stopListening()
+{
+    listening(false);
+}
+
+bool VirtualI2C::canSend() const noexcept
+{
+    return true;
+}
+
+bool VirtualI2C::write(uint8_t address, std::span<uint8_t> data)
+{
+    open();
+
+    if (verbose()) {
+        log(std::format("Sending {} bytes to 0x{:02x} at {} ns.", data.size(), address, nowNs_));
+    }
+    const bool success = bus_->transfer(*this, address, data);
+    metrics().written(data.size(), success);
+
+    return success;
+}
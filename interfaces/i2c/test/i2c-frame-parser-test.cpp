@@ -0,0 +1,86 @@
+/*
+ * Copyright (c) 2024 by Bert Laverman. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+
+#include <cstdio>
+#include <cstdint>
+
+#include <span>
+#include <array>
+#include <vector>
+
+#include <protocols/i2c-frame-parser.hpp>
+
+
+using namespace nl::rakis::raspberrypi::protocols;
+
+
+static std::vector<uint8_t> makeFrame(uint8_t command, uint8_t length, IntegrityKind kind)
+{
+    MsgHeader header{ command, length, 0x10, 0x00 };
+    std::vector<uint8_t> payload(length);
+    for (unsigned i = 0; i < length; i++) {
+        payload[i] = uint8_t(command + i);
+    }
+    std::array<uint8_t, MaxTrailerSize> trailer;
+    const auto trailerLength = seal(header, payload, trailer, kind);
+
+    std::vector<uint8_t> frame(headerBytes(header).begin(), headerBytes(header).end());
+    frame.insert(frame.end(), payload.begin(), payload.end());
+    frame.insert(frame.end(), trailer.begin(), trailer.begin() + trailerLength);
+
+    return frame;
+}
+
+/**
+ * A listener that starts receiving in the middle of a frame on a link using CRCs must still find the frames after it,
+ * even though it has not yet seen a good frame to learn the integrity check from.
+ */
+static bool partialFrameFirst()
+{
+    constexpr IntegrityKind kind{ IntegrityKind::Crc16 };
+
+    std::vector<uint8_t> stream;
+    const auto first = makeFrame(0x42, 12, kind);
+    stream.insert(stream.end(), first.begin() + 3, first.end());
+
+    constexpr unsigned count{ 10 };
+    for (unsigned i = 0; i < count; i++) {
+        const auto frame = makeFrame(uint8_t(0x20 + i), uint8_t(i * 3), kind);
+        stream.insert(stream.end(), frame.begin(), frame.end());
+    }
+
+    FrameParser<> parser;
+    unsigned next{ 0 };
+    bool inOrder{ true };
+    parser.push(stream);
+    parser.parse([&](const MsgHeader& header, std::span<uint8_t>) {
+            inOrder = inOrder && (header.command == (0x20 + next));
+            next++;
+        },
+        [](const MsgHeader&) {});
+
+    const bool ok = inOrder && (next == count) && (parser.size() == 0);
+    std::printf("Partial frame first, CRC-16 link: %u of %u frames %s\n", next, count, ok ? "ok" : "FAILED");
+
+    return ok;
+}
+
+int main()
+{
+    return partialFrameFirst() ? 0 : 1;
+}
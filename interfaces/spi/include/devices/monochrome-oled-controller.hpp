@@ -197,27 +197,26 @@ public:
             switch (addressingMode_) {
             case AddressingMode::Page:
             {
-                this->log("Sending pages: ", false);
                 unsigned pos{ 0 };
                 for (uint8_t page = 0; page < (this->height() / 8); page++, pos += this->width()) {
-                    this->log(std::format("{} (pos={})... ", page, pos, false), false);
+                    this->trace("Sending page {} (pos={}).", page, pos);
 
                     this->setPAMPage(page);
                     this->setPAMFirstColumn(columnOffset()); 
 
                     this->data(std::span<uint8_t>{ &(this->buffer()[pos]), this->width() });
                 }
-                this->log(std::format("Done for {} by {}", this->width(), this->height()));
+                this->trace("Done for {} by {}", this->width(), this->height());
             }
                 break;
 
             case AddressingMode::Horizontal:
-                this->log(std::format("Setting dimensions to pages {}-{}, and columns {}-{}.", 0, ((MaxHeight/8)-1), columnOffset(), this->columnOffset()+this->width()-1));
+                this->trace("Setting dimensions to pages {}-{}, and columns {}-{}.", 0, ((MaxHeight/8)-1), columnOffset(), this->columnOffset()+this->width()-1);
 
                 this->setColumnRange(columnOffset(), this->columnOffset()+this->width()-1);
                 this->setPageRange(0, ((MaxHeight/8)-1));
 
-                this->log(std::format("Sending {} bytes.", this->buffer().size()));
+                this->trace("Sending {} bytes.", this->buffer().size());
                 this->data(this->buffer());
                 break;
 
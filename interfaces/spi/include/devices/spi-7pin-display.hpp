@@ -23,6 +23,7 @@
 
 #include <format>
 
+#include <util/trace.hpp>
 #include <interfaces/spi.hpp>
 #include <devices/spi-device.hpp>
 
@@ -191,7 +192,11 @@ public:
         this->interface().write(std::span<uint8_t>{data.data(), data.size()});
     }
 
-    void data(std::span<uint8_t> buffer) { setData(); this->interface().write(std::span<uint8_t>{buffer.data(), buffer.size()}); }
+    void data(std::span<uint8_t> buffer) {
+        util::TraceScope trace(util::TracePoint::DisplayData, buffer.size());
+        setData();
+        this->interface().write(std::span<uint8_t>{buffer.data(), buffer.size()});
+    }
 
 };
 
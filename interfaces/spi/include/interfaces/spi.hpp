@@ -27,6 +27,7 @@
 #include <raspberry-pi.hpp>
 #include <util/named-component.hpp>
 #include <util/verbose-component.hpp>
+#include <util/trace.hpp>
 #include <interfaces/gpio.hpp>
 #include <devices/spi-device.hpp>
 
@@ -169,7 +170,10 @@ public:
     /**
      * Write the given set of bytes.
      */
-    void write(const std::span<uint8_t> value) { static_cast<SpiClass*>(this)->doWrite(value); }
+    void write(const std::span<uint8_t> value) {
+        util::TraceScope trace(util::TracePoint::SpiWrite, value.size());
+        static_cast<SpiClass*>(this)->doWrite(value);
+    }
 
 };
 
@@ -19,6 +19,7 @@ set(CPP_RASPBERRY_INCLUDES ${CPP_RASPBERRY_INCLUDES}
     ${CMAKE_CURRENT_LIST_DIR}/include)
 
 set(CPP_RASPBERRY_SOURCES ${CPP_RASPBERRY_SOURCES}
-    ${CMAKE_CURRENT_LIST_DIR}/src/interfaces/pico-i2c.cpp)
+    ${CMAKE_CURRENT_LIST_DIR}/src/interfaces/pico-i2c.cpp
+    ${CMAKE_CURRENT_LIST_DIR}/src/util/flash-lease.cpp)
 
-set(CPP_RASPBERRY_LIBS ${CPP_RASPBERRY_LIBS} hardware_i2c)
+set(CPP_RASPBERRY_LIBS ${CPP_RASPBERRY_LIBS} hardware_i2c hardware_dma hardware_flash pico_flash)
@@ -15,21 +15,71 @@
  * limitations under the License.
  */
 
+#include <array>
+#include <atomic>
 #include <vector>
 
 #include <pico/stdlib.h>
 #include "hardware/i2c.h"
 
 #include <interfaces/i2c.hpp>
+#include <protocols/i2c-integrity.hpp>
 
 
 namespace nl::rakis::raspberrypi::interfaces {
 
+/**
+ * @brief I2C on the Pico. When listening, a DMA channel moves received bytes from the FIFO into a free slot, and the
+ *        interrupt handler only starts and ends frames. Checking and delivering them is left to poll(), which the
+ *        protocol driver calls from thread context, so other interrupts are never held up by a transfer. Without a
+ *        DMA channel, the interrupt handler copies whatever the FIFO holds, but still never waits for bytes.
+ */
 class PicoI2C : public I2C
 {
     constexpr static const uint baudrate = 100000;
 
+    /**
+     * @brief A frame as received, waiting to be checked and delivered.
+     */
+    struct RxSlot {
+        std::array<uint8_t, protocols::MaxFrameSize> bytes;
+        uint16_t size{ 0 };
+        bool overflow{ false };
+        bool generalCall{ false };
+    };
+
+    /**
+     * @brief The number of frames that can be received before poll() is called.
+     */
+    static constexpr unsigned RxSlots = 4;
+
+    /**
+     * @brief The FIFO level that raises an interrupt while the DMA channel is receiving, which only happens if the
+     *        frame is longer than a slot.
+     */
+    static constexpr uint32_t OverflowThreshold = 8;
+
     i2c_inst_t *interface_{ nullptr };
+    int dmaChannel_{ -1 };
+
+    std::array<RxSlot, RxSlots> slots_;
+    std::atomic<unsigned> slotsFilled_{ 0 };    // Only written by the interrupt handler
+    std::atomic<unsigned> slotsTaken_{ 0 };     // Only written by poll()
+    unsigned rxSize_{ 0 };
+    bool receiving_{ false };
+    bool dropping_{ false };
+    bool generalCall_{ false };     // The current frame was sent to the General Call address
+    uint8_t discard_{ 0 };
+
+    RxSlot& receiveSlot() noexcept { return slots_[slotsFilled_.load(std::memory_order_relaxed) % RxSlots]; }
+
+    void beginFrame() noexcept;
+
+    void drainFifo() noexcept;
+
+    void endFrame() noexcept;
+
+    void processFrame(const RxSlot& slot);
 
     inline uint8_t readByteRaw() {
         return i2c_read_byte_raw(interface_);
@@ -39,6 +89,8 @@ class PicoI2C : public I2C
     }
 
 public:
+    using I2C::write;
+
     PicoI2C(i2c_inst_t *interface, unsigned sdaPin, unsigned sclPin);
 
     PicoI2C(unsigned sdaPin, unsigned sclPin) : PicoI2C(i2c0, sdaPin, sclPin)
@@ -50,14 +102,29 @@ public:
     }
 
     PicoI2C(const PicoI2C &) = default;
-    PicoI2C(PicoI2C &&) = default;
+    PicoI2C(PicoI2C &&) = delete;
     PicoI2C &operator=(const PicoI2C &) = default;
-    PicoI2C &operator=(PicoI2C &&) = default;
+    PicoI2C &operator=(PicoI2C &&) = delete;
 
     ~PicoI2C() = default;
 
     inline int channel() const { return i2c_hw_index(interface_); }
 
+    /**
+     * @brief Return the DMA channel used to receive frames, or -1 if none could be claimed.
+     */
+    inline int dmaChannel() const noexcept { return dmaChannel_; }
+
+    /**
+     * @brief Handle an I2C interrupt. This only moves bytes and starts or ends frames.
+     */
+    void handleInterrupt() noexcept;
+
+    /**
+     * @brief Check and deliver the frames received since the last call.
+     */
+    void poll() override;
+
     static PicoI2C& defaultInstance();
 
     virtual void open() override;
@@ -27,6 +27,7 @@
 
 
 #include <util/pico-message-queue.hpp>
+#include <util/ring-message-queue.hpp>
 #include <interfaces/pico-i2c.hpp>
 #include <protocols/messages.hpp>
 #include <protocols/i2c-protocol-driver.hpp>
@@ -34,6 +35,11 @@
 
 namespace nl::rakis::raspberrypi::protocols {
 
-using PicoI2CProtocolDriver = I2CProtocolDriver<util::PicoMessageQueue>;
+/**
+ * @brief The incoming queue is filled by PicoI2C::poll() and emptied by processIncoming(), both on the main loop, so it
+ *        uses the lock-free ring, which never allocates. Outgoing messages can be pushed from several places (main loop,
+ *        GPIO interrupts), so that keeps using the guarded queue.
+ */
+using PicoI2CProtocolDriver = I2CProtocolDriver<util::RingMessageQueue<>, util::PicoMessageQueue>;
 
 } // namespace nl::rakis::raspberrypi::protocols
\ No newline at end of file
@@ -0,0 +1,73 @@
+#pragma once
+/*
+ * Copyright (c) 2024 by Bert Laverman. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#if !defined(TARGET_PICO)
+#error "The FlashLease runs only on the Raspberry Pi Pico"
+#endif
+
+#include <cstdint>
+
+#include <hardware/flash.h>
+
+#include <protocols/messages.hpp>
+
+
+namespace nl::rakis::raspberrypi::util {
+
+/**
+ * @brief Keeps the I2C address a board was given in the last sector of flash, so it can start listening on it right
+ *        after a restart. The sector is only rewritten when the address changes, to spare the flash.
+ *
+ * Make sure the program does not reach into the last sector, for example by reserving it in the linker script.
+ */
+class FlashLease {
+    uint32_t offset_;
+
+public:
+    /**
+     * @brief The offset of the last sector of flash, which is used by default.
+     */
+    static constexpr uint32_t DefaultOffset = PICO_FLASH_SIZE_BYTES - FLASH_SECTOR_SIZE;
+
+    /**
+     * @brief How long to wait for the other core to pause while the flash is written.
+     */
+    static constexpr uint32_t SafeExecuteTimeoutMs = 100;
+
+    FlashLease(uint32_t offset =DefaultOffset) : offset_(offset) {}
+
+    FlashLease(const FlashLease&) = default;
+    FlashLease(FlashLease&&) = default;
+    FlashLease& operator=(const FlashLease&) = default;
+    FlashLease& operator=(FlashLease&&) = default;
+
+    /**
+     * @brief Return the address stored for this board, or the General Call address if there is none, it is damaged,
+     *        or was stored by another board.
+     */
+    uint8_t load(protocols::BoardId board) const;
+
+    /**
+     * @brief Store the address for this board, unless it already is.
+     *
+     * @return false if the flash could not be written.
+     */
+    bool store(protocols::BoardId board, uint8_t address);
+};
+
+} // namespace nl::rakis::raspberrypi::util
@@ -23,12 +23,18 @@
 
 namespace nl::rakis::raspberrypi::util {
 
+/**
+ * @brief A MessageQueue protected by a critical section, so it can be shared with an interrupt handler or the other core.
+ *        It is bounded by default, as running out of heap on a Pico is fatal.
+ */
 class PicoMessageQueue : public MessageQueue
 {
     critical_section_t section_;
 
 public:
-    PicoMessageQueue() : MessageQueue() { critical_section_init(&section_); }
+    static constexpr std::size_t DefaultCapacity = 32;
+
+    PicoMessageQueue(std::size_t capacity =DefaultCapacity, DropPolicy policy =DropPolicy::DropOldest) : MessageQueue(capacity, policy) { critical_section_init(&section_); }
     PicoMessageQueue(const PicoMessageQueue&) = default;
     PicoMessageQueue(PicoMessageQueue&&) = default;
     ~PicoMessageQueue() = default;
@@ -44,14 +50,36 @@ public:
         return result;
     }
 
+    virtual std::size_t size() override {
+        critical_section_enter_blocking(&section_);
+        auto result = MessageQueue::size();
+        critical_section_exit(&section_);
+
+        return result;
+    }
+
+    virtual bool push(protocols::Command command, uint8_t address, std::span<const uint8_t> data) override {
+        critical_section_enter_blocking(&section_);
+        auto result = MessageQueue::push(command, address, data);
+        critical_section_exit(&section_);
+
+        return result;
+    }
+
     [[nodiscard]]
-    virtual bool pop(protocols::Command& command, uint8_t& address, std::vector<uint8_t>& data) override {
+    virtual bool pop(Queue& slot) override {
         critical_section_enter_blocking(&section_);
-        auto result = MessageQueue::pop(command, address, data);
+        auto result = MessageQueue::pop(slot);
         critical_section_exit(&section_);
 
         return result;
     }
+
+    virtual void release(Queue& slot) override {
+        critical_section_enter_blocking(&section_);
+        MessageQueue::release(slot);
+        critical_section_exit(&section_);
+    }
 };
 
 } // namespace nl::rakis::raspberrypi::util
\ No newline at end of file
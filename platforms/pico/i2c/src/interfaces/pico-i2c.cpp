@@ -17,14 +17,21 @@
 
 #include "hardware/i2c.h"
 #include "hardware/timer.h"
+#include "hardware/dma.h"
 #include "pico/error.h"
 #include "pico/types.h"
+#include "pico/sync.h"
 
-#include <vector>
+#include <span>
+#include <array>
+#include <atomic>
 #include <string>
 #include <format>
+#include <cstring>
+#include <algorithm>
 
 #include <protocols/messages.hpp>
+#include <protocols/i2c-integrity.hpp>
 #include <interfaces/pico-i2c.hpp>
 
 
@@ -57,6 +64,11 @@ void PicoI2C::open()
         gpio_pull_up(sdaPin());
         gpio_pull_up(sclPin());
 
+        dmaChannel_ = dma_claim_unused_channel(false);
+        if (dmaChannel_ < 0) {
+            log("No DMA channel available, received bytes will be copied by the interrupt handler.");
+        }
+
         initialized(true);
     }
 }
@@ -76,6 +88,11 @@ void PicoI2C::close()
         log(std::format("Deinitialising I2C{}.", channel()));
 
         i2c_deinit(interface_);
+        if (dmaChannel_ >= 0) {
+            dma_channel_abort(dmaChannel_);
+            dma_channel_unclaim(dmaChannel_);
+            dmaChannel_ = -1;
+        }
         initialized(false);
     }
 }
@@ -88,154 +105,171 @@ bool PicoI2C::canListen() const noexcept
 
 
 /**
- * @brief Read a byte from the I2C channel, waiting at most a certain number of microseconds
+ * @brief Start receiving a frame into the next free slot. If there is none, the frame is received but dropped. With a
+ *        DMA channel, the FIFO is drained by DMA from here on, and only raises an interrupt if the frame overflows.
  */
-static bool i2cReadByte(i2c_inst_t* i2c, uint8_t& byte, uint32_t timeout_us = 500)
+void PicoI2C::beginFrame() noexcept
 {
-    auto limit = time_us_64() + timeout_us;
-    while (i2c_get_read_available(i2c) == 0) {
-        if (time_us_64() > limit) {
-            return false;
-        }
+    const unsigned filled = slotsFilled_.load(std::memory_order_relaxed);
+    dropping_ = (filled - slotsTaken_.load(std::memory_order_acquire)) >= RxSlots;
+    rxSize_ = 0;
+    receiving_ = true;
+
+    if (dmaChannel_ >= 0) {
+        auto hw = i2c_get_hw(interface_);
+        auto config = dma_channel_get_default_config(dmaChannel_);
+        channel_config_set_transfer_data_size(&config, DMA_SIZE_8);
+        channel_config_set_read_increment(&config, false);
+        channel_config_set_write_increment(&config, !dropping_);
+        channel_config_set_dreq(&config, i2c_get_dreq(interface_, false));
+
+        void* target = dropping_ ? static_cast<void*>(&discard_) : static_cast<void*>(receiveSlot().bytes.data());
+        dma_channel_configure(dmaChannel_, &config, target, &hw->data_cmd, MaxFrameSize, true);
+        hw->rx_tl = OverflowThreshold;
     }
-    byte = i2c_read_byte_raw(i2c);
-    return true;
 }
 
 /**
- * @brief Read a number of bytes from the I2C channel, waiting at most a certain number of microseconds
+ * @brief Copy what the FIFO holds into the current slot. Bytes that do not fit are only counted.
  */
-static bool i2c_read_raw_blocking(i2c_inst_t* i2c, std::vector<uint8_t>& data, uint32_t timeout_us = 500)
+void PicoI2C::drainFifo() noexcept
 {
-    for (auto& byte : data) {
-        if (!i2cReadByte(i2c, byte, timeout_us)) {
-            return false;
+    auto hw = i2c_get_hw(interface_);
+    auto& slot = receiveSlot();
+
+    while (i2c_get_read_available(interface_) > 0) {
+        const auto byte = static_cast<uint8_t>(hw->data_cmd);
+        if (!dropping_ && (rxSize_ < slot.bytes.size())) {
+            slot.bytes[rxSize_] = byte;
         }
+        rxSize_++;
     }
-    return true;
 }
 
-
 /**
- * @brief Verify the payload given the provided header.
+ * @brief Finish the current frame on a STOP, and hand it over to poll().
  */
-static bool verify_payload(MsgHeader const& header, std::vector<uint8_t> const& data, PicoI2C& picoI2C)
+void PicoI2C::endFrame() noexcept
 {
-    if (header.length != data.size()) {
-        picoI2C.log(std::format("Verify payload: Invalid length. ({} announced, {} received)", header.length, data.size()));
-
-        return false;
+    if (!receiving_) {
+        return;     // A STOP ending a transfer to some other address
+    }
+    if (dmaChannel_ >= 0) {
+        // The DMA channel needs at most a few cycles per byte still in the FIFO.
+        while ((i2c_get_read_available(interface_) > 0) && dma_channel_is_busy(dmaChannel_)) {
+        }
+        rxSize_ = std::max<unsigned>(rxSize_, MaxFrameSize - dma_channel_hw_addr(dmaChannel_)->transfer_count);
+        dma_channel_abort(dmaChannel_);
+        i2c_get_hw(interface_)->rx_tl = 0;
     }
+    drainFifo();
+    receiving_ = false;
 
-    uint8_t checksum = 0;
-    for (size_t i = 0; i < data.size(); ++i) {
-        checksum ^= data[i];
+    const bool generalCall = generalCall_;
+    generalCall_ = false;
+    if (dropping_) {
+        metrics().overruns.add();
+        return;
     }
+    auto& slot = receiveSlot();
+    slot.size = static_cast<uint16_t>(std::min<unsigned>(rxSize_, slot.bytes.size()));
+    slot.overflow = (rxSize_ > slot.bytes.size());
+    slot.generalCall = generalCall;
+    slotsFilled_.store(slotsFilled_.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+
+    // Wake an EventLoop waiting in WFE, so it calls poll().
+    __sev();
+}
 
-    if (checksum != header.checksum) {
-        picoI2C.log("Verify payload: Invalid checksum.");
+void PicoI2C::handleInterrupt() noexcept
+{
+    auto hw = i2c_get_hw(interface_);
+    const auto status = hw->intr_stat;
 
-        return false;
+    if (status & I2C_IC_INTR_STAT_R_GEN_CALL_BITS) {
+        [[maybe_unused]] auto gcStatus = hw->clr_gen_call;
+        generalCall_ = true;
+    }
+    if (status & I2C_IC_INTR_STAT_R_RX_FULL_BITS) {
+        const bool started = !receiving_;
+        if (started) {
+            beginFrame();
+        }
+        if (dmaChannel_ < 0) {
+            drainFifo();
+        } else if (!started && !dma_channel_is_busy(dmaChannel_)) {
+            // The DMA channel filled the slot, so this frame is too long. Keep the bus going until the STOP.
+            rxSize_ = std::max<unsigned>(rxSize_, MaxFrameSize);
+            drainFifo();
+        }
+    }
+    if (status & I2C_IC_INTR_STAT_R_STOP_DET_BITS) {
+        [[maybe_unused]] auto stopStatus = hw->clr_stop_det;
+        endFrame();
     }
-
-    return true;
 }
 
 /**
- * @brief I2C0 instance
+ * @brief Check a received frame and pass it on. This runs in thread context, so it may take its time and log.
  */
-static PicoI2C* picoI2C0 = nullptr;
-static PicoI2C* picoI2C1 = nullptr;
-
+void PicoI2C::processFrame(const RxSlot& slot)
+{
+    if (slot.overflow || (slot.size < MsgHeaderSize)) {
+        metrics().malformed.add();
+        debug("Dropping frame of {} bytes on channel {}: {}.", slot.size, channel(), slot.overflow ? "too long" : "no header");
+        return;
+    }
+    MsgHeader header;
+    std::memcpy(&header, slot.bytes.data(), MsgHeaderSize);
 
-/**
- * @brief I2C0 interrupt handler
- */
-static void i2c_cb(i2c_inst_t* i2c, PicoI2C& picoI2C) {
-    auto status = i2c->hw->intr_stat;
-    if (status == 0) {
+    if (!knownIntegrity(header)) {
+        metrics().integrityFailures.add();
+        debug("Unknown integrity check 0x{:02x} on channel {}.", header.checksum, channel());
         return;
     }
-    picoI2C.log(std::format("I2C interrupt on channel {}. (status=0x{:08x})", picoI2C.channel(), status));
-    if (status & I2C_IC_INTR_STAT_R_GEN_CALL_BITS) {
-        auto gcStatus = i2c->hw->clr_gen_call;
-        picoI2C.log(std::format("Clearing General Call on channel {}. (0x0{:08x})", picoI2C.channel(), gcStatus));
-
-        if (status & I2C_IC_INTR_STAT_R_RX_FULL_BITS) {
-            MsgHeader header;
-            if (!i2cReadByte(i2c, header.command) ||
-                !i2cReadByte(i2c, header.length) ||
-                !i2cReadByte(i2c, header.sender) ||
-                !i2cReadByte(i2c, header.checksum))
-            {
-                picoI2C.log(std::format("Timeout trying to receive GC message header on channel {}.", picoI2C.channel()));
-                return;
-            }
-            picoI2C.log(std::format("I2C General Call payload on channel {} is {} byte(s), checksum 0x{:02x}.", picoI2C.channel(), header.length, header.checksum));
-
-            std::vector<uint8_t> data(header.length, 0);
-            if (!i2c_read_raw_blocking(i2c0, data)) {
-                picoI2C.log(std::format("Timeout trying to receive GC message data on I2C channel {}.", picoI2C.channel()));
-
-                return;
-            }
-
-            if (!verify_payload(header, data, picoI2C)) {
-                picoI2C.log(std::format("Checksum failed for GC message on I2C channel {}.", picoI2C.channel()));
-
-                return;
-            }
-
-            if (picoI2C.callback()) {
-                picoI2C.callback()(toCommand(header.command), header.sender, data);
-            } else {
-                picoI2C.log(std::format("No callback set for channel {}.", picoI2C.channel()));
-            }
-        } else {
-            picoI2C.log(std::format("I2C General Call announced on channel {}.", picoI2C.channel()));
-        }
-    } else if (status & I2C_IC_INTR_STAT_R_RX_FULL_BITS) {
-        MsgHeader header;
-        if (!i2cReadByte(i2c, header.command) ||
-            !i2cReadByte(i2c, header.length) ||
-            !i2cReadByte(i2c, header.sender) ||
-            !i2cReadByte(i2c, header.checksum))
-        {
-            picoI2C.log(std::format("Timeout trying to receive message header on channel {}.", picoI2C.channel()));
-
-            return;
-        }
-        picoI2C.log(std::format("I2C message payload on channel {} is {} byte(s), checksum 0x{:02x}.", picoI2C.channel(), header.length, header.checksum));
+    const auto trailer = trailerSize(integrityOf(header));
+    if (slot.size != (MsgHeaderSize + header.length + trailer)) {
+        metrics().malformed.add();
+        debug("Dropping frame of {} bytes on channel {}: header announces {} bytes of payload.", slot.size, channel(), header.length);
+        return;
+    }
+    // The slot is ours until slotsTaken_ moves past it, and deliver() wants a mutable view.
+    std::span<uint8_t> payload(const_cast<uint8_t*>(slot.bytes.data()) + MsgHeaderSize, header.length);
+    if (!verify(header, payload, std::span<const uint8_t>(payload.data() + payload.size(), trailer))) {
+        metrics().integrityFailures.add();
+        debug("Integrity check failed for message on I2C channel {}.", channel());
+        return;
+    }
+    if (!deliver(toCommand(header.command), senderOf(header), payload, slot.generalCall)) {
+        debug("No callback set or malformed batch on channel {}.", channel());
+    }
+}
 
-        std::vector<uint8_t> data(header.length, 0);
-        if (!i2c_read_raw_blocking(i2c, data)) {
-            picoI2C.log(std::format("Timeout trying to receive message data on I2C channel {}.", picoI2C.channel()));
+void PicoI2C::poll()
+{
+    unsigned taken = slotsTaken_.load(std::memory_order_relaxed);
+    const unsigned filled = slotsFilled_.load(std::memory_order_acquire);
 
-            return;
-        }
+    for (; taken != filled; ++taken) {
+        processFrame(slots_[taken % RxSlots]);
+        slotsTaken_.store(taken + 1, std::memory_order_release);
+    }
+}
 
-        if (!verify_payload(header, data, picoI2C)) {
-            picoI2C.log(std::format("Checksum failed for message on I2C channel {}.", picoI2C.channel()));
 
-            return;
-        }
+/**
+ * @brief I2C0 instance
+ */
+static PicoI2C* picoI2C0 = nullptr;
+static PicoI2C* picoI2C1 = nullptr;
 
-        if (picoI2C.callback()) {
-            picoI2C.callback()(toCommand(header.command), header.sender, data);
-        } else {
-            picoI2C.log(std::format("No callback set for channel {}.", picoI2C.channel()));
-        }
-    } else if (picoI2C.verbose()) {
-        picoI2C.log(std::format("I2C unknown interrupt on channel {}.", picoI2C.channel()));
-    }
-}
 
 static void i2c0_cb() {
-    i2c_cb(i2c0, *picoI2C0);
+    picoI2C0->handleInterrupt();
 }
 
 static void i2c1_cb() {
-    i2c_cb(i2c1, *picoI2C1);
+    picoI2C1->handleInterrupt();
 }
 
 void PicoI2C::startListening()
@@ -253,7 +287,7 @@ void PicoI2C::startListening()
         picoI2C0 = this;
         irq_set_exclusive_handler(I2C0_IRQ, i2c0_cb);
         i2c_set_slave_mode(interface_, true, listenAddress());
-        i2c0->hw->intr_mask = I2C_IC_INTR_STAT_R_RX_FULL_BITS|I2C_IC_INTR_STAT_R_GEN_CALL_BITS;
+        i2c0->hw->intr_mask = I2C_IC_INTR_MASK_M_RX_FULL_BITS|I2C_IC_INTR_MASK_M_GEN_CALL_BITS|I2C_IC_INTR_MASK_M_STOP_DET_BITS;
         irq_set_enabled(I2C0_IRQ, true);
     } else if (interface_ == i2c1) {
         log("Setting up IRQ handler for i2c1.");
@@ -261,7 +295,7 @@ void PicoI2C::startListening()
         picoI2C1 = this;
         irq_set_exclusive_handler(I2C1_IRQ, i2c1_cb);
         i2c_set_slave_mode(interface_, true, listenAddress());
-        i2c1->hw->intr_mask = I2C_IC_INTR_STAT_R_RX_FULL_BITS|I2C_IC_INTR_STAT_R_GEN_CALL_BITS;
+        i2c1->hw->intr_mask = I2C_IC_INTR_MASK_M_RX_FULL_BITS|I2C_IC_INTR_MASK_M_GEN_CALL_BITS|I2C_IC_INTR_MASK_M_STOP_DET_BITS;
         irq_set_enabled(I2C1_IRQ, true);
     } else {
         log("Trying to use an unknown I2C interface.");
@@ -285,6 +319,11 @@ void PicoI2C::stopListening()
         log("Trying to use an unknown I2C interface.");
     }
     i2c_set_slave_mode(interface_, false, 0);
+
+    if (receiving_ && (dmaChannel_ >= 0)) {
+        dma_channel_abort(dmaChannel_);
+    }
+    receiving_ = false;
 }
 
 bool PicoI2C::canSend() const noexcept
@@ -294,29 +333,29 @@ bool PicoI2C::canSend() const noexcept
 
 bool PicoI2C::write(uint8_t address, std::span<uint8_t> data)
 {
-    log(std::format("Sending {} bytes to 0x{:02x} on channel {}.", data.size(), address, channel()));
+    trace("Sending {} bytes to 0x{:02x} on channel {}.", data.size(), address, channel());
 
     [[maybe_unused]]
     absolute_time_t deadline{ time_us_64() + (5000 * data.size()) };
     auto result = i2c_write_blocking_until(interface_, address, data.data(), data.size(), false, deadline);
+    metrics().written(data.size(), (result >= 0) && (static_cast<unsigned>(result) == data.size()));
     if (result == PICO_ERROR_GENERIC) {
-        log(std::format("Failed to write bytes to 0x{:02x}. No one there.", address));
+        log<util::LogLevel::Warning>("Failed to write bytes to 0x{:02x}. No one there.", address);
 
         return false;
     } else if (result == PICO_ERROR_TIMEOUT) {
-        log(std::format("Failed to write bytes to 0x{:02x}. Timeout.", address));
+        log<util::LogLevel::Warning>("Failed to write bytes to 0x{:02x}. Timeout.", address);
 
         return false;
     } else if (result < 0) {
-        log(std::format("Failed to write bytes to 0x{:02x}. Errno={}.", address, result));
+        log<util::LogLevel::Warning>("Failed to write bytes to 0x{:02x}. Errno={}.", address, result);
 
         return false;
     } else if (static_cast<unsigned>(result) != data.size()) {
-        log(std::format("Failed to write {} bytes to 0x{:02x}. Only wrote {} bytes.", data.size(), address, result));
+        log<util::LogLevel::Warning>("Failed to write {} bytes to 0x{:02x}. Only wrote {} bytes.", data.size(), address, result);
 
         return false;
-    } else {
-        log(std::format("Successfully wrote {} bytes to 0x{:02x}.", data.size(), address));
     }
+    trace("Successfully wrote {} bytes to 0x{:02x}.", data.size(), address);
     return true;
 }
\ No newline at end of file
@@ -0,0 +1,105 @@
+/*
+ * Copyright (c) 2024 by Bert Laverman. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <cstddef>
+#include <cstring>
+#include <cstdint>
+
+#include <array>
+#include <span>
+
+#include <pico/error.h>
+#include <pico/flash.h>
+#include <hardware/flash.h>
+
+#include <util/crc.hpp>
+#include <util/flash-lease.hpp>
+#include <protocols/protocol-driver.hpp>
+
+
+using namespace nl::rakis::raspberrypi::util;
+using nl::rakis::raspberrypi::protocols::BoardId;
+using nl::rakis::raspberrypi::protocols::GeneralCallAddress;
+
+
+namespace {
+
+/**
+ * @brief The lease as stored in flash. The CRC covers everything before it.
+ */
+struct LeaseRecord {
+    uint32_t magic;
+    uint64_t boardId;
+    uint8_t address;
+    uint8_t reserved[3];
+    uint32_t crc;
+};
+static_assert(sizeof(LeaseRecord) <= FLASH_PAGE_SIZE, "A lease must fit in a single flash page");
+
+constexpr uint32_t LeaseMagic = 0x4c454153; // "LEAS"
+
+uint32_t leaseCrc(const LeaseRecord& record) {
+    return Crc32::compute(std::span<const uint8_t>(reinterpret_cast<const uint8_t*>(&record), offsetof(LeaseRecord, crc)));
+}
+
+struct ProgramParams {
+    uint32_t offset;
+    const uint8_t* page;
+};
+
+/**
+ * @brief Erase the sector and write the page. This runs with the other core and interrupts paused, as nothing can
+ *        execute from flash while it is being written.
+ */
+void programLease(void* param) {
+    auto params = static_cast<const ProgramParams*>(param);
+
+    flash_range_erase(params->offset, FLASH_SECTOR_SIZE);
+    flash_range_program(params->offset, params->page, FLASH_PAGE_SIZE);
+}
+
+} // namespace
+
+
+uint8_t FlashLease::load(BoardId board) const
+{
+    LeaseRecord record;
+    std::memcpy(&record, reinterpret_cast<const void*>(XIP_BASE + offset_), sizeof(record));
+
+    if ((record.magic != LeaseMagic) || (record.crc != leaseCrc(record)) || (record.boardId != board.id)) {
+        return GeneralCallAddress;
+    }
+    return record.address;
+}
+
+
+bool FlashLease::store(BoardId board, uint8_t address)
+{
+    if (load(board) == address) {
+        return true;
+    }
+    LeaseRecord record{ LeaseMagic, board.id, address, { 0, 0, 0 }, 0 };
+    record.crc = leaseCrc(record);
+
+    std::array<uint8_t, FLASH_PAGE_SIZE> page;
+    page.fill(0xff);
+    std::memcpy(page.data(), &record, sizeof(record));
+
+    ProgramParams params{ offset_, page.data() };
+
+    return flash_safe_execute(programLease, &params, SafeExecuteTimeoutMs) == PICO_OK;
+}
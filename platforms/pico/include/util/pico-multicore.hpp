@@ -0,0 +1,218 @@
+#pragma once
+/*
+ * Copyright (c) 2024 by Bert Laverman. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+
+#if !defined(TARGET_PICO)
+#error "The PicoMulticore runtime runs only on the Raspberry Pi Pico"
+#endif
+
+#include <cstdint>
+
+#include <span>
+#include <atomic>
+#include <string>
+#include <vector>
+#include <functional>
+
+#include <pico/sync.h>
+#include <pico/multicore.h>
+
+#include <util/verbose-component.hpp>
+#include <util/ring-message-queue.hpp>
+#include <protocols/messages.hpp>
+#include <protocols/dispatch-table.hpp>
+
+
+namespace nl::rakis::raspberrypi::util {
+
+
+/**
+ * @brief The two cores of the RP2040, named for what the PicoMulticore runtime uses them for.
+ */
+enum class Core : unsigned {
+    Protocol = 0,   // I2C interrupts, the ProtocolDriver and its queues, and the main loop.
+    Devices = 1     // Message handlers that drive devices, and rendering/flushing their buffers.
+};
+
+
+/**
+ * @brief Return the core the caller is running on.
+ */
+inline Core currentCore() noexcept { return (get_core_num() == 0) ? Core::Protocol : Core::Devices; }
+
+
+/**
+ * @brief Split the work of a Pico over its two cores. Core 0 keeps the protocol: the I2C interrupt handler, the
+ *        ProtocolDriver with its queues, and whatever the main loop does. Core 1 runs the device handlers and
+ *        renderers, so a slow SPI transfer, such as a full ST7789 sendBuffer(), no longer delays reception of the next
+ *        I2C frame.
+ *
+ * Handlers registered here instead of at the driver are bound to core 1: the driver gets a forwarding handler that
+ * copies the message into a lock-free ring and sends an event (SEV) to wake core 1. Core 1 sleeps with WFE when it has
+ * nothing to do. GPIO interrupts stay on the core that installed their callback, which is core 0.
+ *
+ * Code on core 1 must only send through the driver's pushOutgoing(). Its PicoMessageQueue is safe to use from either
+ * core, and core 0 sends the messages. Never call sendMessage() or the other driver methods from core 1: they use the
+ * outgoing I2C interface and driver state that only core 0 may touch.
+ *
+ * The SIO FIFO is deliberately left alone, as the SDK uses it to pause core 1 while flash is written (FlashLease).
+ *
+ * All handlers and renderers must be registered before start().
+ *
+ * @tparam Driver The protocol driver running on core 0, e.g. a PicoI2CProtocolDriver.
+ * @tparam Slots  The number of messages that can be waiting for core 1.
+ */
+template <class Driver, unsigned Slots = 32>
+class PicoMulticore : public VerboseComponent {
+    inline static PicoMulticore* instance_{ nullptr };
+
+    Driver& driver_;
+    protocols::DispatchTable devices_;
+    RingMessageQueue<Slots> toDevices_;
+    std::vector<std::function<void()>> renderers_;
+
+    std::atomic<bool> running_{ false };
+    std::atomic<bool> stopped_{ true };
+
+    /**
+     * @brief Core 0 side: queue a message for core 1 and wake it.
+     */
+    void forward(protocols::Command command, uint8_t sender, std::span<const uint8_t> data) {
+        if (toDevices_.push(command, sender, data)) {
+            __sev();
+        }
+    }
+
+    void dispatch(protocols::Command command, uint8_t sender, std::span<const uint8_t> data) {
+        devices_.dispatch(command, sender, data);
+    }
+
+    /**
+     * @brief Core 1 side: apply queued messages, then let the renderers flush, and sleep until the next message.
+     *        An event sent between the check and the WFE is latched, so no message is left waiting.
+     */
+    void runDevices() {
+        multicore_lockout_victim_init();
+
+        const MessageQueue::Handler handler{ [this](protocols::Command command, uint8_t sender, std::span<const uint8_t> data) {
+            dispatch(command, sender, data);
+        } };
+        while (running_.load(std::memory_order_acquire)) {
+            toDevices_.processAll(handler);
+            for (auto& render : renderers_) {
+                render();
+            }
+            if (toDevices_.empty() && running_.load(std::memory_order_acquire)) {
+                __wfe();
+            }
+        }
+        stopped_.store(true, std::memory_order_release);
+        __sev();
+    }
+
+    static void core1Main() { instance_->runDevices(); }
+
+public:
+    PicoMulticore(Driver& driver) : driver_(driver) {}
+    PicoMulticore(const PicoMulticore&) = delete;
+    PicoMulticore(PicoMulticore&&) = delete;
+    PicoMulticore& operator=(const PicoMulticore&) = delete;
+    PicoMulticore& operator=(PicoMulticore&&) = delete;
+    ~PicoMulticore() { stop(); }
+
+    /**
+     * @brief Return the protocol driver, which runs on Core::Protocol.
+     */
+    Driver& driver() noexcept { return driver_; }
+
+    /**
+     * @brief Return the core handlers registered here run on.
+     */
+    static constexpr Core handlerCore() noexcept { return Core::Devices; }
+
+    /**
+     * @brief Register a member function as the handler for a command, running on Core::Devices. This has the same
+     *        signature as ProtocolDriver::registerHandler(), so a handler's registerAt() accepts this in place of the
+     *        driver.
+     */
+    template <auto Method, class Target>
+    void registerHandler(protocols::Command command, std::string description, Target& target) {
+        devices_.set(command, protocols::bindHandler<Method>(target));
+        driver_.template registerHandler<&PicoMulticore::forward>(command, std::move(description), *this);
+    }
+
+    /**
+     * @brief Add a function that is called on Core::Devices after every batch of messages, e.g. to flush a display
+     *        buffer that was changed. It should return quickly if there is nothing to do.
+     */
+    void addRenderer(std::function<void()> render) { renderers_.push_back(std::move(render)); }
+
+    /**
+     * @brief Wake core 1, e.g. after changing something a renderer looks at.
+     */
+    void wake() noexcept { __sev(); }
+
+    /**
+     * @brief Return the number of messages waiting for core 1.
+     */
+    std::size_t pending() const noexcept { return toDevices_.size(); }
+
+    /**
+     * @brief Return the number of messages dropped because core 1 could not keep up.
+     */
+    uint32_t dropped() const noexcept { return toDevices_.dropped(); }
+
+    /**
+     * @brief Check if core 1 is running the device side.
+     */
+    bool running() const noexcept { return !stopped_.load(std::memory_order_acquire); }
+
+    /**
+     * @brief Launch the device side on core 1. Only one PicoMulticore can be running.
+     */
+    void start() {
+        if (running()) {
+            return;
+        }
+        if (verbose()) {
+            log("Starting device handlers and renderers on core 1");
+        }
+        instance_ = this;
+        stopped_.store(false, std::memory_order_relaxed);
+        running_.store(true, std::memory_order_release);
+        multicore_launch_core1(&PicoMulticore::core1Main);
+    }
+
+    /**
+     * @brief Let core 1 finish what it is doing, and then reset it. Messages still in the ring stay there.
+     */
+    void stop() {
+        if (!running()) {
+            return;
+        }
+        running_.store(false, std::memory_order_release);
+        __sev();
+        while (!stopped_.load(std::memory_order_acquire)) {
+            __wfe();
+        }
+        multicore_reset_core1();
+        instance_ = nullptr;
+    }
+};
+
+} // namespace nl::rakis::raspberrypi::util
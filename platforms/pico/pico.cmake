@@ -21,8 +21,11 @@ set(CPP_RASPBERRY_INCLUDES ${CPP_RASPBERRY_INCLUDES}
 
 set(CPP_RASPBERRY_SOURCES ${CPP_RASPBERRY_SOURCES}
     ${CMAKE_CURRENT_LIST_DIR}/src/interfaces/pico-gpio.cpp
+    ${CMAKE_CURRENT_LIST_DIR}/src/util/event-loop.cpp
     ${CMAKE_CURRENT_LIST_DIR}/src/pico.cpp)
 
+set(CPP_RASPBERRY_LIBS ${CPP_RASPBERRY_LIBS} pico_multicore)
+
 # Add in interface specific stuff for the Pico
 
 if(HAVE_I2C)
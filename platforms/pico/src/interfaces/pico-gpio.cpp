@@ -22,10 +22,13 @@
 #include <functional>
 #include <stdexcept>
 
+#include <util/trace.hpp>
 #include <interfaces/gpio.hpp>
 
 
 using namespace nl::rakis::raspberrypi::interfaces;
+using nl::rakis::raspberrypi::util::TraceScope;
+using nl::rakis::raspberrypi::util::TracePoint;
 
 
 /**
@@ -312,6 +315,7 @@ inline static uint32_t irqMask(unsigned pin) {
  */
 static void gpioIRQ(uint pin, uint32_t events) noexcept {
     if (pin >= NumGPIO) { return; }
+    TraceScope trace(TracePoint::GpioEdge, pin);
 
     if (((events & GPIO_IRQ_LEVEL_LOW) != 0) && gpioLowHandlers[pin]) {
         gpioLowHandlers[pin](pin, events);
@@ -82,4 +82,12 @@ RaspberryPi& RaspberryPi::instance() {
  */
 void RaspberryPi::sleepMs(unsigned ms) const {
     sleep_ms(ms);
-}
\ No newline at end of file
+}
+
+
+/**
+ * Return a monotonic timestamp in microseconds, since boot.
+ */
+uint64_t RaspberryPi::timeUs() {
+    return time_us_64();
+}
@@ -0,0 +1,51 @@
+/*
+ * Copyright (c) 2024 by Bert Laverman. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <pico/stdlib.h>
+#include <pico/sync.h>
+
+#include <util/event-loop.hpp>
+
+
+using namespace nl::rakis::raspberrypi::util;
+
+
+EventLoop::EventLoop()
+{
+}
+
+EventLoop::~EventLoop()
+{
+}
+
+/**
+ * The Pico sleeps using WFE, so waking is just sending an event. If the event arrives before we get to WFE, the event
+ * flag is still set, and WFE returns immediately.
+ */
+void EventLoop::wake() noexcept
+{
+    __sev();
+}
+
+void EventLoop::wait(uint64_t deadlineUs)
+{
+    if (deadlineUs == NoDeadline) {
+        __wfe();
+    } else {
+        best_effort_wfe_or_timeout(from_us_since_boot(deadlineUs));
+    }
+}
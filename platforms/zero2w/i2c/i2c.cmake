@@ -21,6 +21,7 @@ set(CPP_RASPBERRY_INCLUDES ${CPP_RASPBERRY_INCLUDES}
 set(CPP_RASPBERRY_SOURCES ${CPP_RASPBERRY_SOURCES}
     ${CMAKE_CURRENT_LIST_DIR}/src/interfaces/pigpiod-i2c.cpp
     ${CMAKE_CURRENT_LIST_DIR}/src/interfaces/pigpiod-bsc-i2c.cpp
-    ${CMAKE_CURRENT_LIST_DIR}/src/interfaces/i2cdev-i2c.cpp)
+    ${CMAKE_CURRENT_LIST_DIR}/src/interfaces/i2cdev-i2c.cpp
+    ${CMAKE_CURRENT_LIST_DIR}/src/interfaces/threaded-i2c.cpp)
 
 set(CPP_RASPBERRY_LIBS ${CPP_RASPBERRY_LIBS} i2c pigpiod_if2)
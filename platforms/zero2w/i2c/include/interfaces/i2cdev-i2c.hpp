@@ -18,6 +18,7 @@
 
 #include <fcntl.h>
 
+#include <bitset>
 #include <vector>
 #include <thread>
 #include <iostream>
@@ -32,15 +33,45 @@ constexpr static char const *i2cdev_bus1 = "/dev/i2c-1";
 constexpr static char const *i2cdev_bus2 = "/dev/i2c-2";
 
 class I2CDevI2C : public I2C {
+    /**
+     * @brief The most parts a gathered write is sent as, before falling back to copying.
+     */
+    static constexpr unsigned MaxGatherParts = 4;
+
+    /**
+     * @brief The most messages the kernel accepts in a single I2C_RDWR call (I2C_RDWR_IOCTL_MAX_MSGS).
+     */
+    static constexpr unsigned MaxBatchMessages = 42;
+
     std::string interface_{ i2cdev_bus1 };
     int fd_{ -1 };
+    bool noStart_{ false };
+
+    /**
+     * @brief Addresses in a batch that failed. They are written separately until they answer again, so a missing board
+     *        does not make every batch fail.
+     */
+    std::bitset<128> unreliable_;
+
+    /**
+     * @brief Send the messages of a batch in one I2C_RDWR call. If it fails, all of them are reported as failed without
+     *        being resent, as some may have arrived, and their addresses are marked unreliable.
+     */
+    unsigned writeChunk(std::span<WriteRequest*> requests);
+
+    /**
+     * @brief Write a single message of a batch, and keep track of the address answering.
+     */
+    bool writeSingle(WriteRequest& request);
 
 public:
+    using I2C::write;
+
     I2CDevI2C() = default;
     I2CDevI2C(I2CDevI2C const &) = delete;
-    I2CDevI2C(I2CDevI2C &&) = default;
+    I2CDevI2C(I2CDevI2C &&) = delete;
     I2CDevI2C &operator=(I2CDevI2C const &) = delete;
-    I2CDevI2C &operator=(I2CDevI2C &&) = default;
+    I2CDevI2C &operator=(I2CDevI2C &&) = delete;
 
     virtual ~I2CDevI2C();
 
@@ -63,6 +94,22 @@ public:
 
     bool write(uint8_t address, std::span<uint8_t> data) override;
 
+    /**
+     * @brief Send the parts as a single I2C_RDWR transfer, if the adapter supports I2C_M_NOSTART to continue a message
+     *        without a new START. Otherwise they are copied into one buffer first.
+     */
+    bool write(uint8_t address, std::span<const std::span<const uint8_t>> parts) override;
+
+    virtual bool canBatch() const noexcept override { return true; }
+
+    /**
+     * @brief Send the messages with as few I2C_RDWR calls as possible, each carrying up to 42 messages. The kernel sends
+     *        them with repeated STARTs in between, so a listener only sees where a frame ends at the final STOP. A call
+     *        therefore never has two messages for the same address, and General Call messages are sent on their own.
+     *        If a call fails, all of its messages are reported as failed, even though some may have arrived.
+     */
+    unsigned writeBatch(std::span<WriteRequest> requests) override;
+
 };
 
 } // namespace nl::rakis::raspberrypi::interfaces
\ No newline at end of file
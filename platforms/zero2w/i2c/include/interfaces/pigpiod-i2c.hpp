@@ -18,11 +18,15 @@
 
 #include <fcntl.h>
 
+#include <mutex>
+#include <chrono>
 #include <vector>
 #include <thread>
 #include <iostream>
+#include <condition_variable>
 
 #include <interfaces/i2c.hpp>
+#include <protocols/i2c-frame-parser.hpp>
 
 
 namespace nl::rakis::raspberrypi::interfaces {
@@ -49,12 +53,14 @@ protected:
     void error(int result, int bus =0, uint8_t address =0, unsigned size =0);
 
 public:
+    using I2C::write;
+
     PigpiodI2C() = default;
 
     PigpiodI2C(PigpiodI2C const &) = delete;
-    PigpiodI2C(PigpiodI2C &&) = default;
+    PigpiodI2C(PigpiodI2C &&) = delete;
     PigpiodI2C &operator=(PigpiodI2C const &) = delete;
-    PigpiodI2C &operator=(PigpiodI2C &&) = default;
+    PigpiodI2C &operator=(PigpiodI2C &&) = delete;
 
     virtual ~PigpiodI2C();
 
@@ -72,21 +78,62 @@ public:
 
     bool write(uint8_t address, std::span<uint8_t> data) override;
 
+    /**
+     * @brief Send the parts as a single write, gathered directly into the command buffer of an i2c_zip() call.
+     */
+    bool write(uint8_t address, std::span<const std::span<const uint8_t>> parts) override;
+
 };
 
 
 /**
  * @brief The BSC version can only act as receiver. (formerly known as "Slave")
+ *
+ * The listener thread sleeps until pigpiod reports BSC activity with a PI_EVENT_BSC event, and then drains the FIFO. It
+ * also polls, as a safety net: right after receiving data every millisecond, backing off to a longer interval when the
+ * bus is quiet. If pigpiod does not deliver events, that interval is kept short.
  */
 class PigpiodBSCI2C : public I2C {
     int channel_{ -1 };
     std::jthread listener_;
     bool listening_{ false };
 
-    std::vector<uint8_t> bytes_;
+    static constexpr std::chrono::milliseconds MinPoll{ 1 };
+    static constexpr std::chrono::milliseconds MaxPoll{ 10 };
+    static constexpr std::chrono::milliseconds MaxPollWithEvents{ 100 };
+
+    /**
+     * @brief How long an incomplete frame waits for more bytes before it is given up on.
+     */
+    static constexpr std::chrono::milliseconds FlushAfter{ 30 };
+
+    protocols::FrameParser<> parser_;
+
+    std::mutex wakeMutex_;
+    std::condition_variable wake_;
+    bool woken_{ false };
+    int eventCallback_{ -1 };
+
+    static void bscEvent(int pi, unsigned event, uint32_t tick, void* userdata);
+
+    /**
+     * @brief Wake the listener thread, because there is data or it should stop.
+     */
+    void wakeListener();
+
+    /**
+     * @brief Sleep until woken, or until the timeout has passed.
+     */
+    void waitForActivity(std::chrono::milliseconds timeout);
+
+    void frameReceived(const protocols::MsgHeader& header, std::span<uint8_t> payload);
+
+    void frameCorrupt(const protocols::MsgHeader& header);
 
     void processBytes(std::span<uint8_t> data);
 
+    void flushBytes();
+
     static void listen(PigpiodBSCI2C& bus);
 
 protected:
@@ -96,12 +143,14 @@ protected:
     inline int channel() const { return channel_; }
 
 public:
+    using I2C::write;
+
     PigpiodBSCI2C() = default;
 
     PigpiodBSCI2C(PigpiodBSCI2C const &) = delete;
-    PigpiodBSCI2C(PigpiodBSCI2C &&) = default;
+    PigpiodBSCI2C(PigpiodBSCI2C &&) = delete;
     PigpiodBSCI2C &operator=(PigpiodBSCI2C const &) = delete;
-    PigpiodBSCI2C &operator=(PigpiodBSCI2C &&) = default;
+    PigpiodBSCI2C &operator=(PigpiodBSCI2C &&) = delete;
 
     virtual ~PigpiodBSCI2C();
 
@@ -0,0 +1,137 @@
+#pragma once
+/*
+ * Copyright (c) 2024 by Bert Laverman. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <cstddef>
+#include <cstdint>
+
+#include <span>
+#include <deque>
+#include <atomic>
+#include <mutex>
+#include <memory>
+#include <thread>
+#include <vector>
+#include <condition_variable>
+
+#include <interfaces/i2c.hpp>
+
+
+namespace nl::rakis::raspberrypi::interfaces {
+
+
+/**
+ * @brief Wraps a sending I2C interface with a bounded transmit queue and a background thread that drains it. Callers of
+ *        writeAsync() never wait for the bus, not even for a listener that does not answer.
+ *
+ * Completions are called on the transmit thread. A synchronous write() goes through the same queue, so it keeps its
+ * order relative to asynchronous writes. If the bus can batch writes, the transmit thread sends everything queued
+ * with a single writeBatch().
+ *
+ * A completion may call write(), which then goes straight to the bus as the transmit thread cannot wait for itself. It
+ * may overtake writes still in the queue. flush() returns immediately when called from a completion.
+ */
+class ThreadedI2C : public I2C {
+    struct Job {
+        uint8_t address;
+        std::vector<uint8_t> data;
+        WriteCompletion completion;
+    };
+
+    /**
+     * @brief The most queued writes handed to the bus in a single writeBatch().
+     */
+    static constexpr std::size_t MaxBatch = 42;
+
+    std::shared_ptr<I2C> bus_;
+    std::size_t capacity_;
+
+    mutable std::mutex mutex_;
+    std::condition_variable_any wakeup_;
+    std::condition_variable_any idle_;
+    std::deque<Job> jobs_;
+    std::vector<Job> sending_;                  // Only used by the transmit thread
+    std::vector<WriteRequest> requests_;        // Only used by the transmit thread
+    bool busy_{ false };
+    uint32_t dropped_{ 0 };
+
+    std::jthread transmitter_;
+    std::atomic<std::thread::id> transmitterId_;
+
+    bool onTransmitThread() const noexcept { return std::this_thread::get_id() == transmitterId_.load(std::memory_order_relaxed); }
+
+    void transmit(std::stop_token stop);
+
+    void send();
+
+public:
+    using I2C::write;
+
+    /**
+     * @brief Create the wrapper.
+     *
+     * @param bus      The interface that does the actual sending.
+     * @param capacity The maximum number of queued writes.
+     */
+    explicit ThreadedI2C(std::shared_ptr<I2C> bus, std::size_t capacity = 32);
+
+    ThreadedI2C(ThreadedI2C const &) = delete;
+    ThreadedI2C(ThreadedI2C &&) = delete;
+    ThreadedI2C &operator=(ThreadedI2C const &) = delete;
+    ThreadedI2C &operator=(ThreadedI2C &&) = delete;
+
+    virtual ~ThreadedI2C();
+
+    /**
+     * @brief Return the maximum number of queued writes.
+     */
+    std::size_t capacity() const noexcept { return capacity_; }
+
+    /**
+     * @brief Return the number of writes waiting to be sent.
+     */
+    std::size_t pending() const;
+
+    /**
+     * @brief Return the number of writes rejected because the queue was full.
+     */
+    uint32_t dropped() const;
+
+    /**
+     * @brief Wait until all queued writes have been sent.
+     */
+    void flush();
+
+    virtual void open() override;
+
+    virtual void close() override;
+
+    virtual bool canListen() const noexcept override;
+
+    virtual void startListening() override;
+
+    virtual void stopListening() override;
+
+    virtual bool canSend() const noexcept override;
+
+    bool write(uint8_t address, std::span<uint8_t> data) override;
+
+    bool writeAsync(uint8_t address, std::span<const uint8_t> data, WriteCompletion completion) override;
+
+};
+
+} // namespace nl::rakis::raspberrypi::interfaces
@@ -16,6 +16,7 @@
 
 
 #include <cstring>
+#include <array>
 #include <format>
 
 #include <fcntl.h>
@@ -83,6 +84,11 @@ void I2CDevI2C::open() {
     if (fd_ < 0) {
         log(std::format("Failed to open '{}'. Errno={}.", interface_, errno));
     } else {
+        unsigned long funcs{ 0 };
+        noStart_ = (::ioctl(fd_, I2C_FUNCS, &funcs) == 0) && ((funcs & I2C_FUNC_NOSTART) != 0);
+        if (!noStart_) {
+            log(std::format("'{}' does not support I2C_M_NOSTART, gathered writes will be copied.", interface_));
+        }
         initialized(true);
     }
 }
@@ -126,19 +132,134 @@ bool I2CDevI2C::write(uint8_t address, std::span<uint8_t> data)
 {
     open();
 
-    log(std::format("Going to send {} bytes to 0x{:02x}.", data.size(), address));
+    trace("Going to send {} bytes to 0x{:02x}.", data.size(), address);
 
     struct i2c_msg msg{ address, 0, static_cast<__u16>(data.size()), data.data() };
     struct i2c_rdwr_ioctl_data msgs{ &msg, 1 };
 
     auto result = ::ioctl(fd_, I2C_RDWR, &msgs);
+    metrics().written(data.size(), (result == 0) || (result == 1));
     if (result == 0) {
         return true;
     }
     if (result != 1) {
-        log(std::format("Failed to write {} bytes to 0x{:02x}. Errno={}.", data.size(), address, errno));
+        log<util::LogLevel::Warning>("Failed to write {} bytes to 0x{:02x}. Errno={}.", data.size(), address, errno);
 
         return false;
     }
     return true;
 }
+
+bool I2CDevI2C::write(uint8_t address, std::span<const std::span<const uint8_t>> parts)
+{
+    open();
+
+    if (!noStart_ || (parts.size() > MaxGatherParts)) {
+        return I2C::write(address, parts);
+    }
+
+    std::array<struct i2c_msg, MaxGatherParts> msgs;
+    __u32 count{ 0 };
+    std::size_t size{ 0 };
+    for (auto part : parts) {
+        if (part.empty()) {
+            continue;
+        }
+        msgs[count] = i2c_msg{ address, static_cast<__u16>((count == 0) ? 0 : I2C_M_NOSTART), static_cast<__u16>(part.size()), const_cast<__u8*>(part.data()) };
+        count++;
+        size += part.size();
+    }
+    if (count == 0) {
+        return true;
+    }
+    trace("Going to send {} bytes in {} parts to 0x{:02x}.", size, count, address);
+
+    struct i2c_rdwr_ioctl_data data{ msgs.data(), count };
+
+    const bool success = (::ioctl(fd_, I2C_RDWR, &data) >= 0);
+    metrics().written(size, success);
+    if (!success) {
+        log<util::LogLevel::Warning>("Failed to write {} bytes to 0x{:02x}. Errno={}.", size, address, errno);
+
+        return false;
+    }
+    return true;
+}
+
+bool I2CDevI2C::writeSingle(WriteRequest& request)
+{
+    request.success = write(request.address, std::span<uint8_t>(const_cast<uint8_t*>(request.data.data()), request.data.size()));
+    unreliable_.set(request.address & 0x7f, !request.success);
+
+    return request.success;
+}
+
+unsigned I2CDevI2C::writeChunk(std::span<WriteRequest*> requests)
+{
+    if (requests.size() == 1) {
+        return writeSingle(*requests.front()) ? 1 : 0;
+    }
+    std::array<struct i2c_msg, MaxBatchMessages> msgs;
+    std::size_t size{ 0 };
+    for (std::size_t i = 0; i < requests.size(); ++i) {
+        auto& request = *requests[i];
+        msgs[i] = i2c_msg{ request.address, 0, static_cast<__u16>(request.data.size()), const_cast<__u8*>(request.data.data()) };
+        size += request.data.size();
+    }
+    trace("Going to send {} bytes in {} messages.", size, requests.size());
+
+    struct i2c_rdwr_ioctl_data data{ msgs.data(), static_cast<__u32>(requests.size()) };
+    if (::ioctl(fd_, I2C_RDWR, &data) >= 0) {
+        for (auto request : requests) {
+            metrics().written(request->data.size(), true);
+            request->success = true;
+        }
+        return static_cast<unsigned>(requests.size());
+    }
+
+    // The kernel does not tell which message was not answered, and the ones before it did arrive, so none is resent:
+    // that would deliver those twice. All of them are reported as failed, and their addresses are written separately
+    // from the next batch on, until they answer again.
+    debug("Batch of {} messages failed (errno={}), writing their addresses separately from now on.", requests.size(), errno);
+    for (auto request : requests) {
+        metrics().written(request->data.size(), false);
+        request->success = false;
+        unreliable_.set(request->address & 0x7f);
+    }
+    return 0;
+}
+
+unsigned I2CDevI2C::writeBatch(std::span<WriteRequest> requests)
+{
+    open();
+
+    std::array<WriteRequest*, MaxBatchMessages> chunk;
+    std::bitset<128> addresses;
+    std::size_t count{ 0 };
+    unsigned sent{ 0 };
+
+    auto flush = [&]() {
+        if (count > 0) {
+            sent += writeChunk(std::span<WriteRequest*>(chunk.data(), count));
+            count = 0;
+            addresses.reset();
+        }
+    };
+    for (auto& request : requests) {
+        const unsigned address = request.address & 0x7f;
+
+        if ((address == 0) || unreliable_.test(address)) {
+            flush();
+            sent += writeSingle(request) ? 1 : 0;
+            continue;
+        }
+        if ((count == chunk.size()) || addresses.test(address)) {
+            flush();
+        }
+        chunk[count++] = &request;
+        addresses.set(address);
+    }
+    flush();
+
+    return sent;
+}
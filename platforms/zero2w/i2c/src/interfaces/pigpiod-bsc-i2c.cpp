@@ -16,6 +16,8 @@
 
 
 #include <cstring>
+#include <algorithm>
+#include <chrono>
 #include <format>
 #include <exception>
 
@@ -78,26 +80,60 @@ bool PigpiodBSCI2C::canListen() const noexcept {
     return true;
 }
 
+void PigpiodBSCI2C::frameReceived(const protocols::MsgHeader& header, std::span<uint8_t> payload)
+{
+    if (!deliver(protocols::toCommand(header.command), protocols::senderOf(header), payload)) {
+        log(std::format("Received message from 0x{:02x} with command 0x{:02x} and length {}, but no callback or a malformed batch", protocols::senderOf(header), header.command, header.length));
+    }
+}
+
+void PigpiodBSCI2C::frameCorrupt(const protocols::MsgHeader& header)
+{
+    metrics().integrityFailures.add();
+    log(std::format("Dropping message from 0x{:02x} with command 0x{:02x} and length {}: integrity check failed", protocols::senderOf(header), header.command, header.length));
+}
+
 void PigpiodBSCI2C::processBytes(std::span<uint8_t> data)
 {
-    bytes_.insert(bytes_.end(), data.begin(), data.end());
+    parser_.push(data);
     if (verbose()) {
-        log(std::format("Received {} bytes, now {} in buffer", data.size(), bytes_.size()));
+        log(std::format("Received {} bytes, now {} in buffer", data.size(), parser_.size()));
     }
+    parser_.parse([this](const auto& header, auto payload) { frameReceived(header, payload); },
+                  [this](const auto& header) { frameCorrupt(header); });
+}
 
-    while (bytes_.size() >= protocols::MsgHeaderSize) {
-        protocols::MsgHeader header;
-        std::memcpy(&header, bytes_.data(), protocols::MsgHeaderSize);
-        if (bytes_.size() < protocols::MsgHeaderSize + header.length) {
-            break;
-        }
-        if (callback()) {
-            callback()(protocols::toCommand(header.command), header.sender, std::span<uint8_t>(bytes_.data() + protocols::MsgHeaderSize, header.length));
-        } else {
-            log(std::format("Received message from 0x{:02x} with command 0x{:02x} and length {}, but no callback", header.sender, header.command, header.length));
-        }
-        bytes_.erase(bytes_.begin(), bytes_.begin() + protocols::MsgHeaderSize + header.length);
+void PigpiodBSCI2C::flushBytes()
+{
+    if (parser_.size() == 0) {
+        return;
     }
+    if (verbose()) {
+        log(std::format("Giving up on {} bytes of an incomplete message", parser_.size()));
+    }
+    parser_.flush([this](const auto& header, auto payload) { frameReceived(header, payload); },
+                  [this](const auto& header) { frameCorrupt(header); });
+}
+
+void PigpiodBSCI2C::bscEvent([[maybe_unused]] int pi, [[maybe_unused]] unsigned event, [[maybe_unused]] uint32_t tick, void* userdata)
+{
+    static_cast<PigpiodBSCI2C*>(userdata)->wakeListener();
+}
+
+void PigpiodBSCI2C::wakeListener()
+{
+    {
+        std::lock_guard lock(wakeMutex_);
+        woken_ = true;
+    }
+    wake_.notify_one();
+}
+
+void PigpiodBSCI2C::waitForActivity(std::chrono::milliseconds timeout)
+{
+    std::unique_lock lock(wakeMutex_);
+    wake_.wait_for(lock, timeout, [this]() { return woken_; });
+    woken_ = false;
 }
 
 void PigpiodBSCI2C::listen(PigpiodBSCI2C& bus)
@@ -113,6 +149,10 @@ void PigpiodBSCI2C::listen(PigpiodBSCI2C& bus)
     std::memset(&xfer, 0, sizeof(xfer));
     xfer.control = Control(bus.listenAddress(), PIGPIO_Control::EnableTransmit | PIGPIO_Control::EnableReceive | PIGPIO_Control::EnableI2C | PIGPIO_Control::EnableBS1);
 
+    const auto maxPoll = (bus.eventCallback_ >= 0) ? MaxPollWithEvents : MaxPoll;
+    auto poll = MinPoll;
+    auto lastReceived = std::chrono::steady_clock::now();
+
     while (bus.listening()) {
         int status = bsc_i2c(bus.channel(), bus.listenAddress(), &xfer);
         if (status < 0) {
@@ -120,9 +160,17 @@ void PigpiodBSCI2C::listen(PigpiodBSCI2C& bus)
         } else if ((status > 0) && (xfer.rxCnt > 0)) {
             bus.processBytes(std::span<uint8_t>(reinterpret_cast<uint8_t*>(xfer.rxBuf), xfer.rxCnt));
         }
-        if  (xfer.rxCnt == 0) {
-            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        if (xfer.rxCnt > 0) {
+            // There may be more in the FIFO, so look again right away.
+            poll = MinPoll;
+            lastReceived = std::chrono::steady_clock::now();
+            continue;
+        }
+        if ((bus.parser_.size() > 0) && ((std::chrono::steady_clock::now() - lastReceived) >= FlushAfter)) {
+            bus.flushBytes();
         }
+        bus.waitForActivity(poll);
+        poll = std::min(2 * poll, maxPoll);
     }
     bus.log("Listener thread stopped");
 }
@@ -154,6 +202,10 @@ void PigpiodBSCI2C::startListening()
     if (xfer.rxCnt > 0) {
         processBytes(std::span<uint8_t>(reinterpret_cast<uint8_t*>(xfer.rxBuf), xfer.rxCnt));
     }
+    eventCallback_ = event_callback_ex(channel(), PI_EVENT_BSC, bscEvent, this);
+    if (eventCallback_ < 0) {
+        log(std::format("No BSC events ({}), polling every {} ms", eventCallback_, MaxPoll.count()));
+    }
     listening(true);
     listener_ = std::jthread([this]() { listen(*this); });
 }
@@ -168,8 +220,14 @@ void PigpiodBSCI2C::stopListening()
     log(std::format("Stop listening on channel {} and address 0x{:02x}", channel(), listenAddress()));
 
     listening(false);
+    wakeListener();
     listener_.join();
 
+    if (eventCallback_ >= 0) {
+        event_callback_cancel(eventCallback_);
+        eventCallback_ = -1;
+    }
+
     log("Listener thread joined");
 
     bsc_xfer_t xfer;
@@ -16,6 +16,7 @@
 
 
 #include <cstring>
+#include <array>
 #include <format>
 #include <exception>
 
@@ -130,7 +131,9 @@ bool PigpiodI2C::write(uint8_t address, std::span<uint8_t> data)
     int handle{ -1 };
     bool success{ false };
     try {
-        log(std::format("Opening bus {} on channel {} for address 0x{:02x}", bus(), channel(), address));
+        if (verbose()) {
+            log(std::format("Opening bus {} on channel {} for address 0x{:02x}", bus(), channel(), address));
+        }
         handle = i2c_open(channel(), bus(), address, 0);
         if (handle >= 0) {
             auto result = i2c_write_device(channel(), handle, reinterpret_cast<char*>(data.data()), data.size());
@@ -148,6 +151,71 @@ bool PigpiodI2C::write(uint8_t address, std::span<uint8_t> data)
     if (handle >= 0) {
         i2c_close(channel(), handle);
     }
+    metrics().written(data.size(), success);
+
+    return success;
+}
+
+bool PigpiodI2C::write(uint8_t address, std::span<const std::span<const uint8_t>> parts)
+{
+    open();
+
+    // A single write command: PI_I2C_WRITE, the count (escaped if it needs two bytes), the bytes, and PI_I2C_END.
+    constexpr std::size_t overhead{ 5 };
+    std::array<char, protocols::MaxFrameSize + overhead> commands;
+
+    std::size_t size{ 0 };
+    for (auto part : parts) {
+        size += part.size();
+    }
+    if (size == 0) {
+        log("writeBytes(): No data to write");
+
+        return true;
+    }
+    if (size > protocols::MaxFrameSize) {
+        log(std::format("Cannot write {} bytes in one go.", size));
+
+        return false;
+    }
+
+    std::size_t pos{ 0 };
+    if (size > 255) {
+        commands[pos++] = PI_I2C_ESC;
+        commands[pos++] = PI_I2C_WRITE;
+        commands[pos++] = static_cast<char>(size & 0xff);
+        commands[pos++] = static_cast<char>(size >> 8);
+    } else {
+        commands[pos++] = PI_I2C_WRITE;
+        commands[pos++] = static_cast<char>(size);
+    }
+    for (auto part : parts) {
+        std::memcpy(commands.data() + pos, part.data(), part.size());
+        pos += part.size();
+    }
+    commands[pos++] = PI_I2C_END;
+
+    int handle{ -1 };
+    bool success{ false };
+    try {
+        handle = i2c_open(channel(), bus(), address, 0);
+        if (handle >= 0) {
+            auto result = i2c_zip(channel(), handle, commands.data(), pos, nullptr, 0);
+            if (result >= 0) {
+                success = true;
+            } else {
+                error(result, bus(), address, size);
+            }
+        } else if (verbose()) {
+            error(handle);
+        }
+    } catch (...) {
+        log("Exception caught in write()");
+    }
+    if (handle >= 0) {
+        i2c_close(channel(), handle);
+    }
+    metrics().written(size, success);
 
     return success;
 }
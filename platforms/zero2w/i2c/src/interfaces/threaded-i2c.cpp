@@ -0,0 +1,193 @@
+/*
+ * Copyright (c) 2024 by Bert Laverman. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <future>
+#include <format>
+#include <algorithm>
+
+#include <interfaces/threaded-i2c.hpp>
+
+
+using namespace nl::rakis::raspberrypi::interfaces;
+
+
+ThreadedI2C::ThreadedI2C(std::shared_ptr<I2C> bus, std::size_t capacity)
+    : bus_(bus), capacity_(capacity)
+{
+}
+
+ThreadedI2C::~ThreadedI2C()
+{
+    close();
+}
+
+void ThreadedI2C::transmit(std::stop_token stop)
+{
+    transmitterId_.store(std::this_thread::get_id(), std::memory_order_relaxed);
+
+    std::unique_lock lock(mutex_);
+
+    // Stopping only takes effect once the queue is empty, so queued writes are not lost.
+    while (wakeup_.wait(lock, stop, [this] { return !jobs_.empty(); })) {
+        const std::size_t count = bus_->canBatch() ? std::min(jobs_.size(), MaxBatch) : 1;
+        sending_.clear();
+        for (std::size_t i = 0; i < count; ++i) {
+            sending_.push_back(std::move(jobs_.front()));
+            jobs_.pop_front();
+        }
+        busy_ = true;
+        lock.unlock();
+
+        send();
+
+        lock.lock();
+        busy_ = false;
+        if (jobs_.empty()) {
+            idle_.notify_all();
+        }
+    }
+}
+
+/**
+ * Send the jobs taken from the queue, with a single writeBatch() if there are several.
+ */
+void ThreadedI2C::send()
+{
+    if (sending_.size() == 1) {
+        auto& job = sending_.front();
+        const bool success = bus_->write(job.address, job.data);
+        if (job.completion) {
+            job.completion(success);
+        }
+        return;
+    }
+    requests_.clear();
+    for (const auto& job : sending_) {
+        requests_.push_back(WriteRequest{ job.address, job.data });
+    }
+    bus_->writeBatch(requests_);
+    for (std::size_t i = 0; i < sending_.size(); ++i) {
+        if (sending_[i].completion) {
+            sending_[i].completion(requests_[i].success);
+        }
+    }
+}
+
+std::size_t ThreadedI2C::pending() const
+{
+    std::lock_guard lock(mutex_);
+    return jobs_.size();
+}
+
+uint32_t ThreadedI2C::dropped() const
+{
+    std::lock_guard lock(mutex_);
+    return dropped_;
+}
+
+void ThreadedI2C::flush()
+{
+    if (onTransmitThread()) {
+        return;
+    }
+    std::unique_lock lock(mutex_);
+    idle_.wait(lock, [this] { return jobs_.empty() && !busy_; });
+}
+
+void ThreadedI2C::open()
+{
+    if (initialized()) {
+        return;
+    }
+    bus_->open();
+
+    log(std::format("Starting transmit thread, queue capacity {}.", capacity_));
+    transmitter_ = std::jthread([this](std::stop_token stop) { transmit(stop); });
+
+    std::lock_guard lock(mutex_);
+    initialized(true);
+}
+
+void ThreadedI2C::close()
+{
+    if (!initialized()) {
+        return;
+    }
+    {
+        // writeAsync() checks this under the lock, so nothing is queued after the transmit thread drained the queue.
+        std::lock_guard lock(mutex_);
+        initialized(false);
+    }
+    log("Stopping transmit thread.");
+    transmitter_ = std::jthread();      // Requests a stop and joins
+    transmitterId_.store(std::thread::id(), std::memory_order_relaxed);
+
+    bus_->close();
+}
+
+bool ThreadedI2C::canListen() const noexcept
+{
+    return false;
+}
+
+void ThreadedI2C::startListening()
+{
+    log("ThreadedI2C can only send.");
+}
+
+void ThreadedI2C::stopListening()
+{
+    log("ThreadedI2C can only send.");
+}
+
+bool ThreadedI2C::canSend() const noexcept
+{
+    return bus_ && bus_->canSend();
+}
+
+bool ThreadedI2C::write(uint8_t address, std::span<uint8_t> data)
+{
+    if (onTransmitThread()) {
+        // Waiting for the queue here would wait for ourselves.
+        return bus_->write(address, data);
+    }
+    std::promise<bool> done;
+    auto result = done.get_future();
+
+    if (!writeAsync(address, data, [&done](bool success) { done.set_value(success); })) {
+        return false;
+    }
+    return result.get();
+}
+
+bool ThreadedI2C::writeAsync(uint8_t address, std::span<const uint8_t> data, WriteCompletion completion)
+{
+    {
+        std::lock_guard lock(mutex_);
+        if (!initialized()) {
+            return false;
+        }
+        if (jobs_.size() >= capacity_) {
+            dropped_++;
+            return false;
+        }
+        jobs_.push_back(Job{ address, std::vector<uint8_t>(data.begin(), data.end()), std::move(completion) });
+    }
+    wakeup_.notify_one();
+
+    return true;
+}
@@ -0,0 +1,107 @@
+#pragma once
+/*
+ * Copyright (c) 2024 by Bert Laverman. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <cstdint>
+
+#include <bitset>
+#include <string>
+#include <vector>
+#include <functional>
+
+#include <util/verbose-component.hpp>
+#include <util/ini-state.hpp>
+#include <protocols/messages.hpp>
+
+
+namespace nl::rakis::raspberrypi::util {
+
+/**
+ * @brief Remembers which address the bus controller gave each board, in the "board:" sections of an IniState, so a
+ *        restarted controller can confirm those leases instead of repeating discovery.
+ *
+ * Each board gets a section named after its BoardId in hexadecimal, with the address in the "address" key.
+ */
+class LeaseCache : public VerboseComponent {
+    IniState& state_;
+    uint8_t first_;
+    uint8_t last_;
+    std::bitset<128> taken_;
+
+    static constexpr const char* addressKey{ "address" };
+
+    void scan();
+
+public:
+    /**
+     * @brief The default range of addresses handed out, which skips the I2C reserved addresses at both ends.
+     */
+    static constexpr uint8_t FirstAddress = 0x08;
+    static constexpr uint8_t LastAddress = 0x77;
+
+    LeaseCache(IniState& state, uint8_t first =FirstAddress, uint8_t last =LastAddress);
+
+    LeaseCache(const LeaseCache&) = delete;
+    LeaseCache(LeaseCache&&) = delete;
+    LeaseCache& operator=(const LeaseCache&) = delete;
+    LeaseCache& operator=(LeaseCache&&) = delete;
+
+    /**
+     * @brief Return the name of the section for a board.
+     */
+    static std::string boardKey(protocols::BoardId board);
+
+    /**
+     * @brief Keep an address from being handed out, for example the controller's own.
+     */
+    void reserve(uint8_t address) { taken_.set(address & 0x7f); }
+
+    /**
+     * @brief Return the address leased to a board, or the General Call address if it has none.
+     */
+    uint8_t address(protocols::BoardId board) const;
+
+    /**
+     * @brief Return all known leases, ready to be sent as ConfirmLease messages.
+     */
+    std::vector<protocols::MsgSetAddress> leases() const;
+
+    /**
+     * @brief Remember the address given to a board.
+     */
+    void record(protocols::BoardId board, uint8_t address);
+
+    /**
+     * @brief Return the address leased to a board, or lease it the lowest free one. Returns the General Call address
+     *        if all addresses are taken.
+     */
+    uint8_t allocate(protocols::BoardId board);
+
+    /**
+     * @brief Return a function that can be used as the address allocator of an I2CDeviceHandler.
+     */
+    std::function<uint8_t(protocols::BoardId)> allocator() {
+        return [this](protocols::BoardId board) { return allocate(board); };
+    }
+
+    /**
+     * @brief Write the state file, if any lease changed.
+     */
+    void save() { state_.save(); }
+};
+
+} // namespace nl::rakis::raspberrypi::util
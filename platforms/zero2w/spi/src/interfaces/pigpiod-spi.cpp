@@ -165,7 +165,7 @@ void PigpiodSPI::doWrite(std::span<uint8_t> data)
         open();
     }
 
-    if (verbose()) {
+    if (logging<util::LogLevel::Trace>()) {
         log(std::format("Writing {} bytes: ", data.size()), false);
         for (auto const &byte : data)
             log(std::format("0x{:02x} ", byte), false);
@@ -92,7 +92,7 @@ void SPIDevSPI::doWrite(std::span<uint8_t> data)
     rx_buf.resize(bufSize);
     rx_buf.assign(bufSize, 0);
 
-    if (verbose()) {
+    if (logging<util::LogLevel::Trace>()) {
         log(std::format("Writing {} bytes: ", data.size()), false);
         for (auto const &byte : data)
             log(std::format("0x{:02x} ", byte), false);
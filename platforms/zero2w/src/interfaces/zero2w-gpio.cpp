@@ -28,10 +28,13 @@ extern "C" {
 
 #include <iostream>
 
+#include <util/trace.hpp>
 #include <interfaces/gpio.hpp>
 
 
 using namespace nl::rakis::raspberrypi::interfaces;
+using nl::rakis::raspberrypi::util::TraceScope;
+using nl::rakis::raspberrypi::util::TracePoint;
 
 
 /**
@@ -343,6 +346,7 @@ static std::array<GPIO::GPIOHandler, NumGPIO> gpioFallHandlers;
  */
 static void gpioIRQ([[maybe_unused]] int channel, unsigned gpio, unsigned level, uint32_t tick) {
     if (gpio >= NumGPIO) { return; }
+    TraceScope trace(TracePoint::GpioEdge, gpio);
 
     if ((level == 0) && gpioFallHandlers[gpio]) {
         gpioFallHandlers[gpio](gpio, tick);
@@ -471,10 +475,10 @@ void GPIO::set(unsigned pin, bool value)
         openChannel();
     }
 
-    log(std::format("Setting pin {} to {}.", pin, value ? 1 : 0));
+    trace("Setting pin {} to {}.", pin, value ? 1 : 0);
     auto result = gpio_write(gpioChannel, pin, value ? 1 : 0);
     if (result < 0) {
-        log(std::format("Unable to set pin {} to {} (error={}).", pin, value, result));
+        log<util::LogLevel::Warning>("Unable to set pin {} to {} (error={}).", pin, value, result);
     }
 }
 
@@ -498,7 +502,7 @@ bool GPIO::get(unsigned pin)
 
     auto result = gpio_read(gpioChannel, pin);
     if (result < 0) {
-        log(std::format("Unable to read pin {} (error={}).", pin, result));
+        log<util::LogLevel::Warning>("Unable to read pin {} (error={}).", pin, result);
     }
     return result != 0;
 }
\ No newline at end of file
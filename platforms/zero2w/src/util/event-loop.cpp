@@ -0,0 +1,86 @@
+/*
+ * Copyright (c) 2024 by Bert Laverman. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include <array>
+#include <algorithm>
+
+#include <raspberry-pi.hpp>
+#include <util/event-loop.hpp>
+
+
+using namespace nl::rakis::raspberrypi;
+using namespace nl::rakis::raspberrypi::util;
+
+
+EventLoop::EventLoop()
+{
+    eventFd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    epollFd_ = epoll_create1(EPOLL_CLOEXEC);
+    if ((eventFd_ < 0) || (epollFd_ < 0)) {
+        RaspberryPi::log("EventLoop: failed to create eventfd or epoll instance.");
+
+        return;
+    }
+    epoll_event event{};
+    event.events = EPOLLIN;
+    event.data.fd = eventFd_;
+    if (epoll_ctl(epollFd_, EPOLL_CTL_ADD, eventFd_, &event) < 0) {
+        RaspberryPi::log("EventLoop: failed to add eventfd to epoll instance.");
+    }
+}
+
+EventLoop::~EventLoop()
+{
+    if (epollFd_ >= 0) {
+        ::close(epollFd_);
+    }
+    if (eventFd_ >= 0) {
+        ::close(eventFd_);
+    }
+}
+
+/**
+ * The counter of the eventfd stays set until the loop reads it, so a wake-up between checking the waiters and calling
+ * epoll_wait() is not lost.
+ */
+void EventLoop::wake() noexcept
+{
+    const uint64_t one{ 1 };
+    [[maybe_unused]] auto result = ::write(eventFd_, &one, sizeof(one));
+}
+
+void EventLoop::wait(uint64_t deadlineUs)
+{
+    int timeoutMs{ -1 };
+    if (deadlineUs != NoDeadline) {
+        const uint64_t now = RaspberryPi::timeUs();
+        timeoutMs = (deadlineUs <= now) ? 0 : static_cast<int>(std::min<uint64_t>((deadlineUs - now + 999) / 1000, 60'000));
+    }
+
+    std::array<epoll_event, 4> events;
+    const int count = epoll_wait(epollFd_, events.data(), events.size(), timeoutMs);
+    for (int i = 0; i < count; ++i) {
+        if (events[i].data.fd == eventFd_) {
+            uint64_t value;
+            [[maybe_unused]] auto result = ::read(eventFd_, &value, sizeof(value));
+        }
+    }
+}
@@ -0,0 +1,146 @@
+/*
+ * Copyright (c) 2024 by Bert Laverman. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <charconv>
+#include <string>
+#include <string_view>
+#include <format>
+
+#include <util/lease-cache.hpp>
+#include <protocols/protocol-driver.hpp>
+
+
+using namespace nl::rakis::raspberrypi::util;
+using nl::rakis::raspberrypi::protocols::BoardId;
+using nl::rakis::raspberrypi::protocols::MsgSetAddress;
+using nl::rakis::raspberrypi::protocols::GeneralCallAddress;
+
+
+namespace {
+
+/**
+ * @brief Format a value as a zero-padded hexadecimal number of the given number of digits.
+ */
+std::string hex(uint64_t value, unsigned digits) {
+    char buf[16];
+    auto [ptr, ec] = std::to_chars(buf, buf + sizeof(buf), value, 16);
+    const unsigned length = ptr - buf;
+
+    return std::string((length < digits) ? (digits - length) : 0, '0') + std::string(buf, length);
+}
+
+/**
+ * @brief Parse a hexadecimal value, with an optional "0x" prefix. Returns false if the text is not entirely a number.
+ */
+template <typename T>
+bool parseHex(std::string_view text, T& value) {
+    if (text.starts_with("0x") || text.starts_with("0X")) {
+        text.remove_prefix(2);
+    }
+    const auto end = text.data() + text.size();
+    auto [ptr, ec] = std::from_chars(text.data(), end, value, 16);
+
+    return !text.empty() && (ec == std::errc()) && (ptr == end);
+}
+
+} // namespace
+
+
+LeaseCache::LeaseCache(IniState& state, uint8_t first, uint8_t last)
+    : state_(state), first_(first), last_(last)
+{
+    scan();
+}
+
+
+void LeaseCache::scan()
+{
+    taken_.reset();
+    for (auto board : leases()) {
+        taken_.set(board.address & 0x7f);
+    }
+}
+
+
+std::string LeaseCache::boardKey(BoardId board)
+{
+    return hex(board.id, 2 * sizeof(board.id));
+}
+
+
+uint8_t LeaseCache::address(BoardId board) const
+{
+    unsigned address{ GeneralCallAddress };
+    if (!parseHex(state_.boardValue(boardKey(board), addressKey), address) || (address > 0x7f)) {
+        return GeneralCallAddress;
+    }
+    return static_cast<uint8_t>(address);
+}
+
+
+std::vector<MsgSetAddress> LeaseCache::leases() const
+{
+    std::vector<MsgSetAddress> result;
+
+    for (auto id : state_.boardIds()) {
+        BoardId board{ 0 };
+        if (!parseHex(id, board.id)) {
+            continue;       // Some other kind of board section
+        }
+        const auto leased = address(board);
+        if (leased != GeneralCallAddress) {
+            result.push_back(MsgSetAddress{ board, leased });
+        }
+    }
+    return result;
+}
+
+
+void LeaseCache::record(BoardId board, uint8_t address)
+{
+    const auto key = boardKey(board);
+    const auto old = this->address(board);
+    if (old == address) {
+        return;
+    }
+    state_.setBoardValue(key, addressKey, "0x" + hex(address, 2));
+
+    if (old != GeneralCallAddress) {
+        taken_.reset(old);
+    }
+    taken_.set(address & 0x7f);
+}
+
+
+uint8_t LeaseCache::allocate(BoardId board)
+{
+    const auto leased = address(board);
+    if (leased != GeneralCallAddress) {
+        return leased;
+    }
+    for (unsigned address = first_; address <= last_; ++address) {
+        if (!taken_.test(address)) {
+            record(board, static_cast<uint8_t>(address));
+            log(std::format("Leasing address 0x{:02x} to board {}.", address, boardKey(board)));
+
+            return static_cast<uint8_t>(address);
+        }
+    }
+    log(std::format("No free address left for board {}.", boardKey(board)));
+
+    return GeneralCallAddress;
+}
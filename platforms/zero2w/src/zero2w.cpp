@@ -81,3 +81,11 @@ RaspberryPi& RaspberryPi::instance() {
 void RaspberryPi::sleepMs(unsigned ms) const {
     std::this_thread::sleep_for(std::chrono::milliseconds(ms));
 }
+
+
+/**
+ * Return a monotonic timestamp in microseconds.
+ */
+uint64_t RaspberryPi::timeUs() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
@@ -21,6 +21,8 @@ set(CPP_RASPBERRY_INCLUDES ${CPP_RASPBERRY_INCLUDES}
 
 set(CPP_RASPBERRY_SOURCES ${CPP_RASPBERRY_SOURCES}
     ${CMAKE_CURRENT_LIST_DIR}/src/util/ini-state.cpp
+    ${CMAKE_CURRENT_LIST_DIR}/src/util/lease-cache.cpp
+    ${CMAKE_CURRENT_LIST_DIR}/src/util/event-loop.cpp
     ${CMAKE_CURRENT_LIST_DIR}/src/interfaces/zero2w-gpio.cpp
     ${CMAKE_CURRENT_LIST_DIR}/src/zero2w.cpp)
 